@@ -0,0 +1,45 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * edsac_arena.h
+ * Per-thread bump allocator used for cJSON's allocations while encoding and decoding
+ */
+
+#ifndef EDSAC_ARENA_H 
+#define EDSAC_ARENA_H
+
+// link properly with C++
+#ifdef _cplusplus
+extern "C" {
+#endif // _cplusplus
+
+// includes
+#include <stddef.h>
+
+// declarations
+
+// size of a thread's first arena chunk
+#define ARENA_CHUNK_SIZE 4096
+
+// allocation counters for the calling thread
+typedef struct {
+    unsigned long arena_allocs; // allocations served from the arena
+    unsigned long heap_allocs; // cJSON allocations made outside an arena scope (passed on to malloc)
+    unsigned long chunk_allocs; // times the arena had to malloc a new chunk
+} ArenaStats;
+
+// from now until arena_end, cJSON allocations on this thread come from this thread's arena
+// scopes may nest. Installs the cJSON hooks the first time it is called
+void arena_begin(void);
+
+// end an arena scope. When the outermost scope ends everything allocated in it is released at once.
+// Nothing allocated in the scope may be used afterwards
+void arena_end(void);
+
+// fills in the counters for the calling thread
+void arena_get_stats(ArenaStats *stats);
+
+#ifdef _cplusplus
+}
+#endif // _cplusplus
+#endif // EDSAC_ARENA_H
@@ -0,0 +1,39 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * edsac_compress.h
+ * Small block compressor for batch frames, writing the LZ4 block format
+ */
+
+#ifndef EDSAC_COMPRESS_H
+#define EDSAC_COMPRESS_H
+
+// link properly with C++
+#ifdef _cplusplus
+extern "C" {
+#endif // _cplusplus
+
+// includes
+#include <stddef.h>
+#include <stdbool.h>
+
+// declarations
+
+// blocks are at most this long before compression (offsets are 16 bit)
+#define MAX_COMPRESS_LEN 65535
+
+// most bytes compress_block can write for len bytes of input
+#define COMPRESS_BOUND(len) ((len) + (len) / 255 + 16)
+
+// compress src_len (at most MAX_COMPRESS_LEN) bytes of src into dst, which has room for COMPRESS_BOUND(src_len)
+// returns the compressed length
+size_t compress_block(const char *src, size_t src_len, char *dst);
+
+// decompress a block which should expand to exactly dst_len bytes into dst
+// returns false if the block is malformed or expands to a different length
+bool decompress_block(const char *src, size_t src_len, char *dst, size_t dst_len);
+
+#ifdef _cplusplus
+}
+#endif // _cplusplus
+#endif // EDSAC_COMPRESS_H
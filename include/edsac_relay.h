@@ -0,0 +1,48 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * edsac_relay.h
+ * Relay which forwards messages from the monitors on one host or subnet to the server over one connection
+ */
+
+#ifndef EDSAC_RELAY_H
+#define EDSAC_RELAY_H
+
+// link properly with C++
+#ifdef _cplusplus
+extern "C" {
+#endif // _cplusplus
+
+// includes
+#include <stdbool.h>
+#include <sys/socket.h>
+#include "edsac_server.h"
+#include "edsac_sending.h"
+
+// declarations
+
+// options for start_relay
+typedef struct {
+    ServerOptions server; // for the connections from the monitors
+    SendingOptions sending; // for the connection to the server. Always async
+} RelayOptions;
+
+// fills in the default relay options
+void default_relay_options(RelayOptions *opts);
+
+// accept monitors on listen_addr and forward everything they send to the server at upstream_addr, marked with the
+// address of the monitor it came from (see ServerOptions.relayed_origins). Their KEEP_ALIVEs are not forwarded: the
+// relay sends its own. Connection errors for the monitors are forwarded like any other message.
+// The relay uses the server and sender so a process can't also use them itself.
+// The server's signal handlers only run on the calling thread (and any other threads which don't block them) so it
+// should have nothing else to do, e.g. wait in pause(). Returns success
+bool start_relay(const struct sockaddr *listen_addr, socklen_t listen_addrlen, const struct sockaddr *upstream_addr,
+        socklen_t upstream_addrlen, const RelayOptions *opts);
+
+// forwards anything already received, disconnects the monitors then closes the connection to the server
+void stop_relay(void);
+
+#ifdef _cplusplus
+}
+#endif // _cplusplus
+#endif // EDSAC_RELAY_H
@@ -17,6 +17,7 @@ extern "C" {
 #include <stdbool.h>
 #include <sys/types.h> // ssize_t size_t 
 #include <stdint.h>
+#include <netinet/in.h> // struct in_addr
 #include <glib.h>
 
 // declarations
@@ -27,6 +28,8 @@ typedef enum {
     HARD_ERROR_OTHER, // the monitor found a hardware error which cannot be narrowed down to one valve
     SOFT_ERROR,       // the monitor encountered a software error
     KEEP_ALIVE,       // message from the client to the server to show it is still there
+    ACK,              // message from the server to the client: every message up to seq has been received
+    CREDIT,           // message from the server to the client: it may send until seq messages have been sent
     INVALID,          // invalid message type
 } MessageType;
 
@@ -55,12 +58,42 @@ typedef union {
     SoftErrorData software;
 } MessageData;
 
+// how many times a coalesced message happened (see SendingOptions.coalesce_window)
+typedef struct {
+    uint32_t count; // 0 for a message which was not coalesced
+    int64_t first_ms, last_ms; // wall clock time of the first and last repeat in milliseconds since the epoch
+} MessageRepeat;
+
 // representation of the full message
 typedef struct {
     MessageType type;
     MessageData data;
+    MessageRepeat repeat;
+    struct in_addr origin; // the node which raised the message if it came through a relay (INADDR_ANY for none)
+    uint32_t node_id; // logical node which raised the message (0 for none: the server uses the connection's node)
+    uint64_t seq; // numbered by the sender (see SendingOptions.sequence_numbers), 0 for none
+    uint32_t caps; // CAP_* flags a sender announces in the KEEP_ALIVE it starts each connection with, 0 for none
 } Message;
 
+// what a sender can handle, announced when it connects (Message.caps)
+#define CAP_ACKS 0x1 // it reads ACKs (see SendingOptions.acks)
+#define CAP_CREDIT 0x2 // it reads CREDIT (see SendingOptions.flow_control)
+#define CAP_COMPRESS 0x4 // it may send COMPRESSED_FRAMEs (see SendingOptions.compress)
+#define CAP_COMPACT_KEEP_ALIVE 0x8 // it may send COMPACT_KEEP_ALIVEs (see SendingOptions.compact_keep_alive)
+#define CAP_BATCH_JSON 0x10 // it may send JSON batch frames (see SendingOptions.batch)
+#define CAP_BATCH_BINARY 0x20 // it may send binary batch frames
+// it waits for the server to reply with a KEEP_ALIVE of its own carrying the CAP_* agreed to, and CAP_HANDSHAKE.
+// The version is agreed at the same time: later messages on the connection are decoded without checking theirs
+#define CAP_HANDSHAKE 0x40
+
+// what decode_message_route finds out about a message
+typedef struct {
+    MessageType type;
+    uint32_t node_id; // 0 if it has none
+    uint64_t seq; // 0 if it has none
+    uint32_t caps; // 0 if it has none
+} MessageRoute;
+
 // function to initialise a hardware error valve structure
 void hardware_error_valve(Message *message, int valve_no, const char *string);
 
@@ -73,21 +106,119 @@ void software_error(Message *message, const char *string);
 // function to initialise a keep alive message
 void keep_alive(Message *message);
 
+// function to initialise an acknowledgement of every message up to seq (see SendingOptions.acks)
+void ack_message(Message *message, uint64_t seq);
+
+// function to initialise a grant of credit up to limit messages on the connection (see SendingOptions.flow_control)
+void credit_message(Message *message, uint64_t limit);
+
 // function to encode a message. Dynamically allocates storage
 // returns the size of the encoded message or -1 on error
 ssize_t encode_message(const Message *message, char **encoded_message);
 
+// function to encode a message into buf without any allocation (in steady state).
+// returns the length of the encoded message (excluding the NUL terminator) or -1 on error or if it does not fit
+ssize_t encode_message_buf(const Message *message, char *buf, size_t buflen);
+
 // function to decode a message. 
 // Returns success or failure
 bool decode_message(const char* encoded_message, Message *message);
 
+// function to decode a message without copying it. frame does not need to be NUL terminated but is modified:
+// escapes in the message text are expanded in place and the text is NUL terminated inside frame.
+// On success *text points into frame (NULL for KEEP_ALIVE) and the message's GString is left NULL.
+// Returns success or failure
+bool decode_message_inplace(char *frame, size_t len, Message *message, const char **text);
+
+// function to decode just the version and type of a message, e.g. to route it before decoding the rest.
+// frame does not need to be NUL terminated and is not modified.
+// Returns success or failure
+bool decode_message_header(const char *frame, size_t len, MessageType *type);
+
+// function to decode just what is needed to route a message: its version, type, node_id, seq and caps.
+// frame does not need to be NUL terminated and is not modified.
+// Returns success or failure
+bool decode_message_route(const char *frame, size_t len, MessageRoute *route);
+
+// decode_message, decode_message_inplace and decode_message_route for a connection which has agreed the version in a
+// handshake (see CAP_HANDSHAKE): the message's own version is not looked at
+bool decode_agreed_message(const char* encoded_message, Message *message);
+bool decode_agreed_message_inplace(char *frame, size_t len, Message *message, const char **text);
+bool decode_agreed_message_route(const char *frame, size_t len, MessageRoute *route);
+
+// a batch frame carries several messages, each encoded as usual, in one frame. In JSON it is a version 2 object of
+// type BATCH whose data holds an array of the messages: {"version":2,"type":"BATCH","data":{"messages":[...]}}.
+// In binary it is the byte BINARY_BATCH, the length of the rest and then each message preceded by its length (lengths
+// are 16 bit big endian). Batches hold at most MAX_BATCH_LEN bytes of messages
+typedef struct {
+    const char *p, *end; // the rest of the messages
+    bool binary;
+    bool error; // the batch turned out to be malformed
+} BatchReader;
+
+// function to start reading the messages in a JSON batch frame. Returns false if the frame is not a batch
+bool batch_begin(const char *frame, size_t len, BatchReader *reader);
+
+// function to start reading the messages in a binary batch frame (starting with BINARY_BATCH). Returns false if the
+// frame is not a complete batch
+bool binary_batch_begin(const char *frame, size_t len, BatchReader *reader);
+
+// function to find the next message in a batch. The message is not decoded. Returns false once there are no more or
+// if the rest of the batch is malformed (reader->error)
+bool batch_next(BatchReader *reader, const char **msg, size_t *len);
+
+// look up a message type by its name on the wire (name need not be NUL terminated). Returns INVALID if unknown
+MessageType message_type_from_name(const char *name, size_t len);
+
+// returns the name of a message type on the wire or NULL for INVALID
+const char *message_type_name(MessageType type);
+
 // frees dynamically allocated memory *within* a message (aka this will not free the message structure itself)
 void free_message(Message *msg);
 
+// a message encoded in advance with its valve_no left as a slot to be filled in when it is sent
+typedef struct MessageTemplate MessageTemplate;
+
+// encode message once. For HARD_ERROR_VALVE its valve_no is ignored: each render fills in its own.
+// Returns NULL on error. The template does not refer to message afterwards
+MessageTemplate *compile_template(const Message *message);
+
+// the encoded message for this valve_no (ignored for other types), as encode_message_buf would produce it.
+// returns the length (excluding the NUL terminator) or -1 if it does not fit in buf
+ssize_t render_template(const MessageTemplate *tmpl, int valve_no, char *buf, size_t buflen);
+
+// the type of message a template encodes
+MessageType template_type(const MessageTemplate *tmpl);
+
+// initialise message to what the template renders for this valve_no. Free it with free_message. Returns success
+bool template_message(const MessageTemplate *tmpl, int valve_no, Message *message);
+
+// frees a template
+void free_template(MessageTemplate *tmpl);
+
 // internals
 #define DATA_FORMAT_VERSION 2.0
 #define MAX_ENCODED_LEN ((MAX_MSG_LEN) + 100) // approximate
 
+// largest sequence number: they are JSON numbers so must be exact as doubles
+#define MAX_SEQ 9007199254740992.0
+
+// a KEEP_ALIVE can also be sent as just this byte between messages (ASCII ENQ)
+#define COMPACT_KEEP_ALIVE '\x05'
+
+// batch frames (see BatchReader). A JSON batch written by this library starts with BATCH_PREFIX, separates the messages
+// with commas and ends with BATCH_SUFFIX. A binary batch starts with BINARY_BATCH (ASCII STX) and two length bytes
+#define BATCH_PREFIX "{\"version\":2,\"type\":\"BATCH\",\"data\":{\"messages\":["
+#define BATCH_SUFFIX "]}}"
+#define BINARY_BATCH '\x02'
+#define BINARY_BATCH_HEADER_LEN 3
+#define MAX_BATCH_LEN 16384
+
+// a batch frame compressed with compress_block (see edsac_compress.h): COMPRESSED_FRAME (ASCII ETX), the length of the
+// block and the length of the batch frame it expands to (both 16 bit big endian), then the block
+#define COMPRESSED_FRAME '\x03'
+#define COMPRESSED_FRAME_HEADER_LEN 5
+
 #ifdef _cplusplus
 }
 #endif // _cplusplus
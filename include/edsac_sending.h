@@ -25,11 +25,140 @@ extern "C" {
 // the time between KEEP_ALIVE messages in seconds
 #define KEEP_ALIVE_INTERVAL 10 
 
+// default length of the async sending queue
+#define DEFAULT_SEND_QUEUE_LEN 1024
+
+// default time in milliseconds a write may wait for the socket to accept more data
+#define DEFAULT_SEND_TIMEOUT_MS 5000
+
+// default time in milliseconds to wait for a connection to be established
+#define DEFAULT_CONNECT_TIMEOUT_MS 5000
+
+// default bounds on the time between reconnection attempts in milliseconds
+#define DEFAULT_RECONNECT_MIN_MS 100
+#define DEFAULT_RECONNECT_MAX_MS 30000
+
+// default spool segment file size in bytes, number of segments and drain rate in messages per second
+#define DEFAULT_SPOOL_SEGMENT_SIZE (1024 * 1024)
+#define DEFAULT_SPOOL_MAX_SEGMENTS 64
+#define DEFAULT_SPOOL_DRAIN_RATE 100
+
+// default time in milliseconds to wait for the server to acknowledge anything before reconnecting
+#define DEFAULT_ACK_TIMEOUT_MS 5000
+
+// how start_sending_multi shares messages between servers
+typedef enum {
+    UPLINK_MIRROR, // every message goes to every server
+    UPLINK_FAILOVER // messages go to the first server which is working
+} UplinkMode;
+
+// how the async writer packs messages which are waiting together (see SendingOptions.batch)
+typedef enum {
+    BATCH_NONE, // one frame per message
+    BATCH_JSON, // a JSON batch frame, which any version 2 parser can take apart
+    BATCH_BINARY // a binary batch frame, which the server can split up without scanning the messages
+} BatchFormat;
+
+// whether batch frames are compressed (see SendingOptions.compress)
+typedef enum {
+    COMPRESS_OFF,
+    COMPRESS_AUTO, // except on connections to this host
+    COMPRESS_ALWAYS
+} CompressMode;
+
+// limit on how fast messages of one type are sent (see SendingOptions.rate_limits)
+typedef struct {
+    unsigned int rate; // messages per second (0 for no limit)
+    unsigned int burst; // most messages which can be sent at once after a quiet spell (0 for the same as rate)
+} RateLimit;
+
+// options for start_sending_opts
+typedef struct {
+    // send_message only encodes the message and queues it. A background thread writes queued messages in batches.
+    // send_message fails if the queue is full
+    bool async;
+    size_t queue_len; // how many messages can be queued in async mode (or for replay in reconnect mode)
+    int send_timeout_ms; // how long a write may wait for the socket to accept more data before failing
+    // if the connection breaks, reconnect in the background. Messages sent in the meantime are queued and written in
+    // order once the connection is back. send_message only fails if the queue is full
+    bool reconnect;
+    unsigned int reconnect_min_ms; // first delay before reconnecting. Doubles after each failed attempt
+    unsigned int reconnect_max_ms; // most time between attempts
+    // send KEEP_ALIVEs as the single byte COMPACT_KEEP_ALIVE. Only for servers which understand it (this version on)
+    // unless handshake is set
+    bool compact_keep_alive;
+    // when several messages are queued for the writer send them as one batch frame (see BatchReader) instead of one
+    // frame each. Only for servers which understand it (this version on) unless handshake is set
+    BatchFormat batch;
+    // compress batch frames which come out smaller (see edsac_compress.h), for slow links. The sender announces it
+    // when connecting and the server only accepts compressed frames from senders which did. Needs batch. Only for
+    // servers which understand it (this version on) unless handshake is set
+    CompressMode compress;
+    // directory for an on-disk spool (NULL for none). Needs reconnect. Messages go to the spool while the connection is
+    // down or the queue is full and survive the process crashing. They are sent at spool_drain_rate once it is back
+    const char *spool_dir;
+    size_t spool_segment_size; // bytes per segment file
+    unsigned int spool_max_segments; // the spool holds at most this many segments
+    unsigned int spool_drain_rate; // messages per second
+    int connect_timeout_ms; // how long (re)connecting may take before it fails
+    // start_sending returns straight away and the connection is made in the background. Needs reconnect. Messages are
+    // queued until it is up
+    bool lazy_connect;
+    // for start_sending_multi. With several servers spool_dir holds a numbered spool for each one
+    UplinkMode uplink_mode;
+    // seconds for which repeats of the last message are counted instead of sent (0 for off). They are sent as one
+    // message with a repeat count when the window closes or a different message is sent
+    unsigned int coalesce_window;
+    // indexed by MessageType. Messages over their type's limit are dropped and once a second one "N SOFT_ERRORs
+    // suppressed" message (of that type) is sent instead. HARD_ERROR_VALVE and KEEP_ALIVE are never limited
+    RateLimit rate_limits[INVALID];
+    // logical node id announced to the server whenever a connection is made (0 for none). The server reports messages
+    // from this connection as coming from it unless the message has a node_id of its own
+    uint32_t node_id;
+    // number messages 1, 2, 3... so that the server can count lost, reordered and duplicated messages. Numbering
+    // starts again from 1 each time sending starts. Messages with a node_id of their own are sent with their own seq
+    bool sequence_numbers;
+    // keep each numbered message until the server acknowledges it (see ServerOptions.ack_every) and send whatever
+    // wasn't acknowledged again after reconnecting. Needs reconnect and turns on async and sequence_numbers. Messages
+    // waiting for an ACK count towards queue_len. Not for UPLINK_FAILOVER or spool_dir: spooled messages are deleted
+    // once written, so a spool could lose them in the outages acknowledgements are for
+    bool acks;
+    // if messages have waited this long without anything being acknowledged the connection is treated as broken
+    unsigned int ack_timeout_ms;
+    // only write as many messages as the server has granted credit for (see ServerOptions.credit_window). The rest wait
+    // on the queue, so once it is full send_message fails (or spools) instead of blocking. KEEP_ALIVEs don't need
+    // credit. Servers which grant none within a second are written to as fast as they read. Turns on async
+    bool flow_control;
+    // on each new connection ask the server which of compact_keep_alive, batch and compress it agrees to (see
+    // ServerOptions.caps) and wait up to a second for the reply before sending anything. Only what was agreed is used;
+    // a server which doesn't reply (an older one) gets plain frames. The version is agreed at the same time, so the
+    // server doesn't check each message's. Safe to turn on whatever version the server is
+    bool handshake;
+} SendingOptions;
+
+// fills in the default sending options
+void default_sending_options(SendingOptions *opts);
+
 // addr is the address of the server to which we will report errors
 bool start_sending(const struct sockaddr *addr, socklen_t addrlen);
 
+// start sending with non-default options
+bool start_sending_opts(const struct sockaddr *addr, socklen_t addrlen, const SendingOptions *opts);
+
+// connect to count servers. Each has its own queue and is always async and reconnects. opts->uplink_mode chooses
+// whether messages are mirrored to all of them or fail over from the first to the rest. Those which can't be connected
+// to yet are connected in the background. Fails if none of them can be (unless opts->lazy_connect)
+bool start_sending_multi(const struct sockaddr *const *addrs, const socklen_t *addrlens, size_t count,
+        const SendingOptions *opts);
+
+// send (or in async mode queue) a message. Returns success
 bool send_message(const Message *msg);
 
+// send (or queue) a message compiled with compile_template, with valve_no filled in. The same as send_message but
+// without encoding anything
+bool send_template(const MessageTemplate *tmpl, int valve_no);
+
+// close the connection. In async mode anything queued is written first
 void stop_sending(void);
 
 #ifdef _cplusplus
@@ -35,27 +35,138 @@ extern "C" {
 // the actual time in seconds before an error is signaled
 #define KEEP_ALIVE_PROD ((KEEP_ALIVE_CHECK_PERIOD) * (KEEP_ALIVE_GRACE) * (KEEP_ALIVE_INTERVAL))
 
+// default number of messages from a sender between acknowledgements, and most milliseconds an acknowledgement waits
+#define DEFAULT_ACK_EVERY 32
+#define DEFAULT_ACK_INTERVAL_MS 200
+
+// default credit granted to a sender at a time and number of messages waiting for read_message before none is granted
+#define DEFAULT_CREDIT_WINDOW 256
+#define DEFAULT_READ_QUEUE_LIMIT 65536
+
+// every CAP_* the server can agree to (see ServerOptions.caps)
+#define SERVER_CAPS (CAP_ACKS | CAP_CREDIT | CAP_COMPRESS | CAP_COMPACT_KEEP_ALIVE | CAP_BATCH_JSON | CAP_BATCH_BINARY)
+
+// a reference counted receive buffer (see ServerOptions.borrowed_views)
+struct RecvChunk;
+
 // stores a message and the IP address it was from
 typedef struct {
     Message msg; // Error Message
     struct in_addr address; // IPv4 address which sent (or generated) the error
+    uint32_t node_id; // logical node which sent the error (see SendingOptions.node_id), 0 if it didn't say
     time_t recv_time; // the time at which the message was received
+    const char *text; // message text borrowed from chunk, or NULL when msg has its own GString. Use bufferitem_text()
+    char *raw; // frame waiting to be decoded (see ServerOptions.lazy_decode). NULL once decoded
+    size_t raw_len;
+    bool agreed; // raw is from a connection which agreed the version in its handshake (see CAP_HANDSHAKE)
+    struct RecvChunk *chunk; // receive buffer text or raw points into
 } BufferItem;
 
+// options for start_server_opts
+typedef struct {
+    // BufferItems point into the buffer the message was received into instead of copying the text into a GString.
+    // The buffer is freed along with the last BufferItem referring to it. Read the text with bufferitem_text()
+    bool borrowed_views;
+
+    // Only the version and type of a message are decoded when it arrives (enough to handle KEEP_ALIVEs).
+    // The raw frame is queued and the rest is decoded by read_message on the consumer's thread
+    bool lazy_decode;
+
+    // Number of threads decoding message bodies. 0 decodes in the signal handler (or lazily, see above).
+    // Messages still reach read_message in the order they were received
+    unsigned int decode_workers;
+
+    // Messages with an origin (added by a relay, see edsac_relay.h) are reported as coming from that address rather
+    // than from the relay. Only turn this on if the nodes which can connect are trusted not to forge it
+    bool relayed_origins;
+
+    // Numbered messages from a connection's own node are acknowledged (see SendingOptions.acks, which announces CAP_ACKS
+    // when it connects) once every ack_every messages, and every ack_interval_ms while fewer have arrived. One ACK
+    // covers everything up to its number. A gap which is still open after a whole interval is given up on. 0 for no acknowledgements
+    unsigned int ack_every;
+    unsigned int ack_interval_ms;
+
+    // Senders which announce CAP_CREDIT (see SendingOptions.flow_control) may send credit_window messages beyond what
+    // they have sent so far. The credit is shared out from the room left below read_queue_limit messages waiting for
+    // read_message, so less is granted as the queue backs up and none once it is full. It is topped up as messages
+    // arrive and every ack_interval_ms. 0 for no flow control
+    unsigned int credit_window;
+    size_t read_queue_limit;
+
+    // CAP_* the server agrees to when a sender announces them (default SERVER_CAPS). Senders which ask for a handshake
+    // (see SendingOptions.handshake) are told which were agreed and use nothing else. Those which don't may still
+    // send batches and COMPACT_KEEP_ALIVEs regardless. CAP_ACKS is never agreed when ack_every is 0, nor CAP_CREDIT
+    // when credit_window is
+    uint32_t caps;
+} ServerOptions;
+
+// counts from checking the sequence numbers of received messages (see SendingOptions.sequence_numbers)
+typedef struct {
+    uint64_t received; // numbered messages accepted
+    uint64_t lost; // numbers which were skipped over and haven't turned up since
+    uint64_t reordered; // messages which arrived after one with a higher number
+    uint64_t duplicates; // messages dropped because their number had already been received (or was too old to tell)
+    uint64_t restarts; // times the sender started again from 1
+} SequenceStats;
+
+// a connection and the sequence numbers of the messages it sent for its own node
+typedef struct {
+    struct sockaddr_in addr;
+    uint32_t node_id; // announced by the connection, 0 for none
+    SequenceStats seq;
+} ConnectionStats;
+
+// number of messages waiting at each stage of the receive pipeline
+typedef struct {
+    size_t decode_queue; // received but not yet taken by a decode worker
+    size_t reorder; // decoded but waiting for earlier messages to finish decoding
+    size_t read_queue; // waiting for read_message
+} PipelineDepths;
+
 // frees a BufferItem
 void free_bufferitem(BufferItem *item);
 
+// returns the message text of a BufferItem (borrowed or not) or NULL if it has none. Valid until the item is freed
+const char *bufferitem_text(const BufferItem *item);
+
+// fills in the default server options
+void default_server_options(ServerOptions *opts);
+
 // set up the server
 // returns success
 bool start_server(const struct sockaddr *addr, socklen_t addrlen);
 
-// read in an error message from the queue
+// set up the server with non-default options
+// returns success
+bool start_server_opts(const struct sockaddr *addr, socklen_t addrlen, const ServerOptions *opts);
+
+// read in an error message from the queue. The returned message is always fully decoded
 // returns NULL immediately if there is no message to read in
 BufferItem *read_message(void);
 
+// fills in how many messages are waiting at each stage of the receive pipeline
+void get_pipeline_depths(PipelineDepths *depths);
+
 // returns a list of IP addresses (sockaddr_in) we are currently connected to
 GSList *get_connected_list(void);
 
+// returns a list of the node ids (use GPOINTER_TO_UINT) heard from on the open connections. Free with g_slist_free.
+// Nodes behind a relay stay in the list until the relay's connection closes
+GSList *get_connected_nodes(void);
+
+// finds the address of the connection a node was last heard from on (the relay's address for nodes behind a relay).
+// Returns false if the node isn't connected
+bool get_node_address(uint32_t node_id, struct in_addr *address);
+
+// fills in the sequence number counts for everything received since the server started
+void get_sequence_stats(SequenceStats *stats);
+
+// fills in the sequence number counts for one node. These outlive its connections. Returns false if it is unknown
+bool get_node_sequence_stats(uint32_t node_id, SequenceStats *stats);
+
+// returns a list of ConnectionStats for the open connections. Free with g_slist_free_full(list, free)
+GSList *get_connection_stats(void);
+
 // stop the server safely
 void stop_server(void);
 
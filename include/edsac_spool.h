@@ -0,0 +1,49 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * edsac_spool.h
+ * Append-only on-disk queue of encoded messages, used by the sender while it can't reach the server
+ */
+
+#ifndef EDSAC_SPOOL_H
+#define EDSAC_SPOOL_H
+
+// link properly with C++
+#ifdef _cplusplus
+extern "C" {
+#endif // _cplusplus
+
+// includes
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/uio.h>
+
+// declarations
+
+// a spool directory. Not thread safe: callers do their own locking
+typedef struct Spool Spool;
+
+// open (creating if needed) the spool in dir. Records left by an earlier run are recovered.
+// Segment files are segment_size bytes and there are at most max_segments of them. Returns NULL on failure
+Spool *spool_open(const char *dir, size_t segment_size, unsigned int max_segments);
+
+// append a record. Fails if it doesn't fit in a segment or the spool is full
+bool spool_append(Spool *spool, const char *data, size_t len);
+
+// fills out with (up to max of) the oldest records which haven't been consumed. Returns how many.
+// The records stay valid until they are consumed
+size_t spool_peek(Spool *spool, struct iovec *out, size_t max);
+
+// marks the oldest count records as sent. Segments which have been completely sent are deleted
+void spool_consume(Spool *spool, size_t count);
+
+// number of records waiting to be consumed
+size_t spool_pending(const Spool *spool);
+
+// unmaps and closes the spool. Anything not consumed is still there the next time it is opened
+void spool_close(Spool *spool);
+
+#ifdef _cplusplus
+}
+#endif // _cplusplus
+#endif // EDSAC_SPOOL_H
@@ -22,6 +22,7 @@ typedef void (*timer_handler_t)(union sigval *sig_event);
 
 // declarations
 bool create_timer(timer_handler_t handler, timer_t *timer_id, time_t seconds);
+bool create_timer_ms(timer_handler_t handler, timer_t *timer_id, unsigned int ms);
 bool stop_timer(timer_t timer_id);
 
 #ifdef _cplusplus
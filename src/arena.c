@@ -0,0 +1,185 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * arena.c
+ * Per-thread bump allocator used for cJSON's allocations while encoding and decoding
+ */
+
+/* cJSON makes a dozen or so small allocations to build or parse a message and frees them all together with cJSON_Delete.
+Inside an arena scope these come from a per-thread chunk by bumping a pointer and freeing them does nothing.
+The end of the scope releases everything by resetting the pointer.
+If a scope needs more than one chunk then the chunks are replaced by a single bigger one when it ends, so in steady state
+no allocations reach malloc at all.
+*/
+
+// includes
+#include "config.h"
+#include "edsac_arena.h"
+#include "contrib/cJSON.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+
+// all arena allocations are aligned to this
+#define ARENA_ALIGN 16
+
+// a block of memory allocations are bumped out of
+typedef struct Chunk {
+    struct Chunk *next; // older chunk
+    size_t cap; // size of data
+    size_t used; // bytes of data handed out
+    _Alignas(ARENA_ALIGN) char data[];
+} Chunk;
+
+// a thread's arena
+typedef struct {
+    Chunk *chunks; // newest first
+    unsigned int depth; // nesting of arena_begin
+    ArenaStats stats;
+} Arena;
+
+static pthread_key_t arena_key;
+static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
+
+// free every chunk in a list
+static void free_chunks(Chunk *chunk) {
+    while (NULL != chunk) {
+        Chunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+}
+
+// called when a thread with an arena exits
+static void free_arena(void *arena) {
+    free_chunks(((Arena *) arena)->chunks);
+    free(arena);
+}
+
+static Chunk *new_chunk(Arena *arena, size_t cap) {
+    Chunk *chunk = malloc(sizeof(Chunk) + cap);
+    if (NULL == chunk)
+        return NULL;
+
+    chunk->cap = cap;
+    chunk->used = 0;
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+    arena->stats.chunk_allocs++;
+    return chunk;
+}
+
+// returns the calling thread's arena, creating it if need be
+static Arena *get_arena(bool create) {
+    Arena *arena = pthread_getspecific(arena_key);
+    if ((NULL != arena) || !create)
+        return arena;
+
+    arena = calloc(1, sizeof(Arena));
+    if (NULL == arena)
+        return NULL;
+    if (0 != pthread_setspecific(arena_key, arena)) {
+        free(arena);
+        return NULL;
+    }
+    return arena;
+}
+
+// is ptr inside one of the arena's chunks?
+static bool arena_owns(const Arena *arena, const void *ptr) {
+    for (const Chunk *chunk = arena->chunks; NULL != chunk; chunk = chunk->next) {
+        if (((const char *) ptr >= chunk->data) && ((const char *) ptr < chunk->data + chunk->cap))
+            return true;
+    }
+    return false;
+}
+
+// cJSON malloc hook
+static void *arena_malloc(size_t size) {
+    Arena *arena = get_arena(false);
+    if ((NULL == arena) || (0 == arena->depth)) {
+        if (NULL != arena)
+            arena->stats.heap_allocs++;
+        return malloc(size);
+    }
+
+    size_t rounded = (size + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1);
+    Chunk *chunk = arena->chunks;
+    if ((NULL == chunk) || (chunk->cap - chunk->used < rounded)) {
+        size_t cap = (NULL == chunk) ? ARENA_CHUNK_SIZE : 2 * chunk->cap;
+        while (cap < rounded)
+            cap *= 2;
+        chunk = new_chunk(arena, cap);
+        if (NULL == chunk)
+            return NULL;
+    }
+
+    void *ret = chunk->data + chunk->used;
+    chunk->used += rounded;
+    arena->stats.arena_allocs++;
+    return ret;
+}
+
+// cJSON free hook: arena memory is released by arena_end
+static void arena_free(void *ptr) {
+    if (NULL == ptr)
+        return;
+
+    Arena *arena = get_arena(false);
+    if ((NULL != arena) && arena_owns(arena, ptr))
+        return;
+
+    free(ptr);
+}
+
+static void init_arenas(void) {
+    pthread_key_create(&arena_key, free_arena);
+
+    cJSON_Hooks hooks = {arena_malloc, arena_free};
+    cJSON_InitHooks(&hooks);
+}
+
+void arena_begin(void) {
+    pthread_once(&arena_once, init_arenas);
+
+    Arena *arena = get_arena(true);
+    if (NULL != arena)
+        arena->depth++;
+}
+
+void arena_end(void) {
+    Arena *arena = get_arena(false);
+    if ((NULL == arena) || (0 == arena->depth))
+        return;
+
+    if (0 != --arena->depth)
+        return;
+
+    Chunk *chunk = arena->chunks;
+    if ((NULL != chunk) && (NULL != chunk->next)) {
+        // this scope outgrew the first chunk: swap them all for one big enough for next time
+        size_t total = 0;
+        for (Chunk *c = chunk; NULL != c; c = c->next)
+            total += c->cap;
+        free_chunks(chunk);
+        arena->chunks = NULL;
+        new_chunk(arena, total);
+    } else if (NULL != chunk) {
+        chunk->used = 0;
+    }
+}
+
+void arena_get_stats(ArenaStats *stats) {
+    if (NULL == stats)
+        return;
+
+    pthread_once(&arena_once, init_arenas);
+
+    Arena *arena = get_arena(false);
+    if (NULL == arena)
+        memset(stats, 0, sizeof(*stats));
+    else
+        *stats = arena->stats;
+}
@@ -91,7 +91,7 @@ struct sockaddr *get_args(int *argc, char ***argv, GOptionGroup *other_group, GO
     }
     g_option_context_free(context);
     g_option_group_unref(networking_group);
-    if (NULL != other_entries) {
+    if (NULL != other_group) {
         g_option_group_unref(other_group);
     }
 
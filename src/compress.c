@@ -0,0 +1,163 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * compress.c
+ * Small block compressor for batch frames, writing the LZ4 block format
+ */
+
+/* A block is a list of sequences. Each starts with a token byte: the high nibble is the number of literals and the low
+nibble the length of the match after them less MIN_MATCH. A nibble of 15 means more length bytes follow, added up until
+one isn't 255. Then come the literals and a 16 bit little endian offset back to the start of the match. The last
+sequence is just literals and has no offset.
+
+The compressor is greedy with a single hash table of 4 byte sequences, which is plenty for alert texts: they repeat
+whole phrases. As in LZ4 the last LAST_LITERALS bytes are always literals and no match starts in the last MATCH_LIMIT
+bytes, so blocks can be read by any LZ4 block decoder.
+*/
+
+// includes
+#include "config.h"
+#include "edsac_compress.h"
+#include <stdint.h>
+#include <string.h>
+
+#define HASH_BITS 12
+#define MIN_MATCH 4
+#define LAST_LITERALS 5
+#define MATCH_LIMIT 12
+
+static uint32_t read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static unsigned int hash4(uint32_t v) {
+    return (unsigned int) ((v * 2654435761u) >> (32 - HASH_BITS));
+}
+
+// the length bytes which follow a nibble of 15
+static unsigned char *put_length(unsigned char *out, size_t len) {
+    len -= 15;
+    while (len >= 255) {
+        *out++ = 255;
+        len -= 255;
+    }
+    *out++ = (unsigned char) len;
+    return out;
+}
+
+// one sequence. match_len is 0 for the last one
+static unsigned char *put_sequence(unsigned char *out, const unsigned char *literals, size_t num_literals, size_t offset,
+        size_t match_len) {
+    unsigned char *token = out++;
+    *token = (unsigned char) (((num_literals >= 15) ? 15 : num_literals) << 4);
+    if (num_literals >= 15)
+        out = put_length(out, num_literals);
+    memcpy(out, literals, num_literals);
+    out += num_literals;
+
+    if (0 == match_len)
+        return out;
+
+    *out++ = (unsigned char) (offset & 0xff);
+    *out++ = (unsigned char) (offset >> 8);
+    size_t extra = match_len - MIN_MATCH;
+    *token |= (unsigned char) ((extra >= 15) ? 15 : extra);
+    if (extra >= 15)
+        out = put_length(out, extra);
+    return out;
+}
+
+size_t compress_block(const char *src, size_t src_len, char *dst) {
+    const unsigned char *in = (const unsigned char *) src;
+    unsigned char *out = (unsigned char *) dst;
+    size_t anchor = 0; // start of the literals not yet written
+
+    if (src_len > MATCH_LIMIT) {
+        // positions are below 65536. A stale or empty slot only costs a comparison
+        uint16_t table[1 << HASH_BITS];
+        memset(table, 0, sizeof(table));
+
+        size_t pos = 0;
+        while (pos < src_len - MATCH_LIMIT) {
+            uint32_t v = read32(in + pos);
+            unsigned int h = hash4(v);
+            size_t candidate = table[h];
+            table[h] = (uint16_t) pos;
+
+            if ((candidate < pos) && (read32(in + candidate) == v)) {
+                size_t len = MIN_MATCH;
+                size_t max = src_len - LAST_LITERALS - pos;
+                while ((len < max) && (in[candidate + len] == in[pos + len]))
+                    len++;
+
+                out = put_sequence(out, in + anchor, pos - anchor, pos - candidate, len);
+                pos += len;
+                anchor = pos;
+            } else {
+                pos++;
+            }
+        }
+    }
+
+    out = put_sequence(out, in + anchor, src_len - anchor, 0, 0);
+    return (size_t) (out - (unsigned char *) dst);
+}
+
+// adds up the length bytes which follow a nibble of 15
+static bool get_length(const unsigned char **in, const unsigned char *end, size_t *len) {
+    unsigned char b;
+    do {
+        if (*in >= end)
+            return false;
+        b = *(*in)++;
+        *len += b;
+    } while (255 == b);
+    return true;
+}
+
+bool decompress_block(const char *src, size_t src_len, char *dst, size_t dst_len) {
+    const unsigned char *in = (const unsigned char *) src;
+    const unsigned char *end = in + src_len;
+    unsigned char *out = (unsigned char *) dst;
+    size_t done = 0;
+
+    while (in < end) {
+        unsigned int token = *in++;
+
+        size_t num_literals = token >> 4;
+        if ((15 == num_literals) && !get_length(&in, end, &num_literals))
+            return false;
+        if (((size_t) (end - in) < num_literals) || (dst_len - done < num_literals))
+            return false;
+        memcpy(out + done, in, num_literals);
+        in += num_literals;
+        done += num_literals;
+
+        // the last sequence has no match
+        if (in == end)
+            break;
+
+        if (end - in < 2)
+            return false;
+        size_t offset = (size_t) in[0] | ((size_t) in[1] << 8);
+        in += 2;
+        if ((0 == offset) || (offset > done))
+            return false;
+
+        size_t match_len = token & 0xf;
+        if ((15 == match_len) && !get_length(&in, end, &match_len))
+            return false;
+        match_len += MIN_MATCH;
+        if (dst_len - done < match_len)
+            return false;
+
+        // the match may overlap what it is copying so go a byte at a time
+        for (size_t i = 0; i < match_len; i++)
+            out[done + i] = out[done - offset + i];
+        done += match_len;
+    }
+
+    return done == dst_len;
+}
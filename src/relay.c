@@ -0,0 +1,145 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * relay.c
+ * Relay which forwards messages from the monitors on one host or subnet to the server over one connection
+ */
+
+/* The relay is a server (server.c) for the monitors and a sender (sending.c) to the real server. A forwarding thread
+takes each message off the server's queue, sets its origin to the monitor's address and queues it for the async
+writer, which batches whatever has built up into one writev. KEEP_ALIVEs end at the relay (the server never queues
+them) and the sender's own timer keeps the upstream connection alive, so the real server sees one connection and one
+heartbeat per relay however many monitors there are.
+
+The server runs its handlers on whichever thread receives its signals. Handlers which interrupt a thread inside
+malloc can deadlock, so the forwarding and writer threads are started with all signals blocked and the handlers run
+on the (idle) thread which started the relay.
+*/
+
+// includes
+#include "config.h"
+#include "edsac_relay.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <assert.h>
+
+// how long the forwarding thread sleeps when there is nothing to forward
+#define RELAY_POLL_NS 1000000
+
+static pthread_t forwarder;
+static bool running = false;
+static atomic_bool stopping = false;
+
+void default_relay_options(RelayOptions *opts) {
+    if (NULL == opts)
+        return;
+
+    default_server_options(&opts->server);
+    default_sending_options(&opts->sending);
+    opts->sending.async = true;
+}
+
+// send one received message on to the server
+static void forward(const BufferItem *item) {
+    // shallow copy: only the origin, node and sequence number change
+    Message msg = item->msg;
+    msg.origin = item->address;
+    msg.node_id = item->node_id;
+    // monitors without a node id all look the same upstream, so their messages are numbered by the relay instead
+    if (0 == msg.node_id)
+        msg.seq = 0;
+
+    // borrowed text has to be put back into the message
+    GString *text = NULL;
+    if (NULL != item->text) {
+        text = g_string_new(item->text);
+        if (SOFT_ERROR == msg.type)
+            msg.data.software.message = text;
+        else if (HARD_ERROR_OTHER == msg.type)
+            msg.data.hardware_other.message = text;
+        else if (HARD_ERROR_VALVE == msg.type)
+            msg.data.hardware_valve.message = text;
+    }
+
+    if (!send_message(&msg))
+        fprintf(stderr, "relay: dropped a message from %s\n", inet_ntoa(item->address));
+
+    if (NULL != text)
+        g_string_free(text, true);
+}
+
+static void *forward_thread(__attribute__((unused)) void *arg) {
+    const struct timespec poll_interval = {.tv_sec = 0, .tv_nsec = RELAY_POLL_NS};
+
+    while (true) {
+        BufferItem *item = read_message();
+        if (NULL == item) {
+            // everything received so far has been forwarded
+            if (atomic_load(&stopping))
+                break;
+            nanosleep(&poll_interval, NULL);
+            continue;
+        }
+
+        forward(item);
+        free_bufferitem(item);
+    }
+
+    return NULL;
+}
+
+bool start_relay(const struct sockaddr *listen_addr, socklen_t listen_addrlen, const struct sockaddr *upstream_addr,
+        socklen_t upstream_addrlen, const RelayOptions *opts) {
+    if ((NULL == opts) || running)
+        return false;
+
+    SendingOptions sending = opts->sending;
+    sending.async = true; // batches whatever builds up while writing
+
+    // threads started from here inherit the blocked signals (see the top of this file)
+    sigset_t mask, old_mask;
+    sigfillset(&mask);
+
+    // only accept monitors once there is somewhere to send their messages
+    pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+    bool ret = start_sending_opts(upstream_addr, upstream_addrlen, &sending);
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    if (!ret)
+        return false;
+
+    if (!start_server_opts(listen_addr, listen_addrlen, &opts->server)) {
+        stop_sending();
+        return false;
+    }
+
+    atomic_store(&stopping, false);
+    pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+    ret = (0 == pthread_create(&forwarder, NULL, forward_thread, NULL));
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    if (!ret) {
+        stop_server();
+        stop_sending();
+        return false;
+    }
+
+    running = true;
+    return true;
+}
+
+void stop_relay(void) {
+    if (!running)
+        return;
+
+    // forward what has been received so far. The sender writes it before closing
+    atomic_store(&stopping, true);
+    pthread_join(forwarder, NULL);
+
+    stop_server();
+    stop_sending();
+    running = false;
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * relay_daemon.c
+ * Runs a relay: monitors connect to it and it forwards their messages to the server over one connection
+ */
+
+// includes
+#include "config.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <signal.h>
+#include <unistd.h>
+#include "edsac_relay.h"
+#include "edsac_arguments.h"
+
+static volatile sig_atomic_t stop = 0;
+
+// SIGINT and SIGTERM
+static void stop_handler(__attribute__((unused)) int sig) {
+    stop = 1;
+}
+
+int main(int argc, char **argv) {
+    // -a and -p are where the monitors connect to
+    char *upstream_str = NULL;
+    gint upstream_port = 2000;
+    GOptionEntry entries[] = {
+        {"upstream-address", 'u', G_OPTION_FLAG_NONE, G_OPTION_ARG_STRING, &upstream_str, "IPv4 address of the server", "w.x.y.z"},
+        {"upstream-port", 'P', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT, &upstream_port, "TCP port of the server", "PORT"},
+        {NULL}
+    };
+    struct sockaddr *listen_addr = get_args(&argc, &argv, NULL, entries);
+    struct sockaddr *upstream_addr = alloc_addr((NULL == upstream_str) ? "127.0.0.1" : upstream_str, (uint16_t) upstream_port);
+    g_free(upstream_str);
+    if ((NULL == listen_addr) || (NULL == upstream_addr)) {
+        fputs("Invalid address\n", stderr);
+        return EXIT_FAILURE;
+    }
+
+    signal(SIGINT, stop_handler);
+    signal(SIGTERM, stop_handler);
+
+    // reconnect to the server rather than give up on it
+    RelayOptions opts;
+    default_relay_options(&opts);
+    opts.sending.reconnect = true;
+    opts.sending.lazy_connect = true;
+    opts.sending.sequence_numbers = true;
+    if (!start_relay(listen_addr, sizeof(struct sockaddr_in), upstream_addr, sizeof(struct sockaddr_in), &opts)) {
+        perror("Could not start the relay");
+        free(listen_addr);
+        free(upstream_addr);
+        return EXIT_FAILURE;
+    }
+    free(listen_addr);
+    free(upstream_addr);
+    puts("Relaying");
+
+    // the server's signal handlers run here (see edsac_relay.h)
+    while (!stop)
+        pause();
+
+    stop_relay();
+    return EXIT_SUCCESS;
+}
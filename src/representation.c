@@ -10,8 +10,12 @@
 #include <stdio.h>
 #include <assert.h>
 #include "contrib/cJSON.h"
+#include "edsac_arena.h"
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <limits.h>
+#include <arpa/inet.h>
 
 // shorthand for the initialisation functions
 #define PRINTABLE_MSG(_message, _string, _data_type, _type) \
@@ -19,6 +23,11 @@
         return; \
     } \
     _message->type = _type; \
+    memset(&(_message->repeat), 0, sizeof(_message->repeat)); \
+    _message->origin.s_addr = INADDR_ANY; \
+    _message->node_id = 0; \
+    _message->seq = 0; \
+    _message->caps = 0; \
     _message->data._data_type.message = g_string_new(_string); // if _string is NULL then g_string_new will just return NULL
 
 // initialises a hardware error valve message
@@ -44,6 +53,87 @@ void keep_alive(Message *message) {
         return;
 
     message->type = KEEP_ALIVE;
+    memset(&(message->repeat), 0, sizeof(message->repeat));
+    message->origin.s_addr = INADDR_ANY;
+    message->node_id = 0;
+    message->seq = 0;
+    message->caps = 0;
+}
+
+// initialises an acknowledgement
+void ack_message(Message *message, uint64_t seq) {
+    if (NULL == message)
+        return;
+
+    keep_alive(message);
+    message->type = ACK;
+    message->seq = seq;
+}
+
+// initialises a grant of credit
+void credit_message(Message *message, uint64_t limit) {
+    if (NULL == message)
+        return;
+
+    keep_alive(message);
+    message->type = CREDIT;
+    message->seq = limit;
+}
+
+// message type table
+// Adding a message type is a MessageType value, its constructor, one entry here (its name on the wire and which data
+// fields it has and where they are kept in a Message) and its name's slot in type_slots. Encoding, decoding and
+// freeing all work from this table. Names are found through the perfect hash in type_slots (see TYPE_SEED)
+
+// fields a data object must contain
+#define FIELD_MESSAGE  0x1 // "message" string
+#define FIELD_VALVE_NO 0x2 // "valve_no" number
+
+typedef struct {
+    const char *name; // as it appears in the "type" field
+    unsigned int fields; // FIELD_* flags
+    size_t text_offset; // of the GString * in a Message, for FIELD_MESSAGE
+    size_t valve_no_offset; // of the int in a Message, for FIELD_VALVE_NO
+} MessageTypeInfo;
+
+#define TEXT_AT(_data_type) offsetof(Message, data._data_type.message)
+#define VALVE_NO_AT(_data_type) offsetof(Message, data._data_type.valve_no)
+
+// indexed by MessageType
+static const MessageTypeInfo message_types[INVALID] = {
+    [HARD_ERROR_VALVE] = {"HARD_ERROR_VALVE", FIELD_MESSAGE | FIELD_VALVE_NO, TEXT_AT(hardware_valve),
+                          VALVE_NO_AT(hardware_valve)},
+    [HARD_ERROR_OTHER] = {"HARD_ERROR_OTHER", FIELD_MESSAGE, TEXT_AT(hardware_other), 0},
+    [SOFT_ERROR] = {"SOFT_ERROR", FIELD_MESSAGE, TEXT_AT(software), 0},
+    [KEEP_ALIVE] = {"KEEP_ALIVE", 0, 0, 0},
+    [ACK] = {"ACK", 0, 0, 0},
+    [CREDIT] = {"CREDIT", 0, 0, 0},
+};
+
+// the table entry for a type, NULL for INVALID or anything else
+static const MessageTypeInfo *type_info(MessageType type) {
+    if ((type < 0) || (type >= INVALID))
+        return NULL;
+    return &message_types[type];
+}
+
+// where a message keeps its data fields
+static GString **text_field(Message *message, const MessageTypeInfo *info) {
+    return (GString **) (void *) ((char *) message + info->text_offset);
+}
+
+static int *valve_no_field(Message *message, const MessageTypeInfo *info) {
+    return (int *) (void *) ((char *) message + info->valve_no_offset);
+}
+
+// initialise a message from its data fields (those its type doesn't have are ignored)
+static void init_message(Message *message, const MessageTypeInfo *info, int valve_no, const char *text) {
+    keep_alive(message);
+    message->type = (MessageType) (info - message_types);
+    if (info->fields & FIELD_MESSAGE)
+        *text_field(message, info) = g_string_new(text);
+    if (info->fields & FIELD_VALVE_NO)
+        *valve_no_field(message, info) = valve_no;
 }
 
 // shorthand to bail if a pointer is NULL
@@ -53,20 +143,10 @@ void keep_alive(Message *message) {
         return _ret_val; \
     }
 
-// shorthand for decoding similar messages
-#define PRINTABLE_MSG_DECODE(_data_type, _type) \
-    /* message type */ \
-    cJSON *_data_type##_t = cJSON_CreateString(_type); \
-    NULL_CHECK(_data_type##_t, root, -1) \
-    cJSON_AddItemToObject(root, "type", _data_type##_t); \
-    /* message */ \
-    cJSON *cjson_message_##_data_type = cJSON_CreateString(message->data._data_type.message->str); \
-    NULL_CHECK(cjson_message_##_data_type, root, -1) \
-    cJSON_AddItemToObject(data, "message", cjson_message_##_data_type); 
-
 // encode a message structure into a format to be transmitted
+// *encoded_message is allocated from the arena so is only valid until arena_end
 // returns the length of the encoded_message string
-ssize_t encode_message(const Message *message, char **encoded_message) {
+static ssize_t encode_tree(const Message *message, char **encoded_message) {
     // arguments check
     if ((NULL == message) || (NULL == encoded_message))
         return -1;
@@ -87,36 +167,67 @@ ssize_t encode_message(const Message *message, char **encoded_message) {
     cJSON_AddItemToObject(root, "data", data);
 
     // the rest depends on the message type
-    switch (message->type) {
-        // hardware error valve
-        case HARD_ERROR_VALVE: ;  // ; is because C won't define a variable as the first statement after a goto
-            PRINTABLE_MSG_DECODE(hardware_valve, "HARD_ERROR_VALVE")
-
-            // valve_no
-            cJSON *valve_no = cJSON_CreateNumber((double) message->data.hardware_valve.valve_no);
-            NULL_CHECK(valve_no, root, -1)
-            cJSON_AddItemToObject(data, "valve_no", valve_no);
-            break;
-
-        case HARD_ERROR_OTHER: ;
-            PRINTABLE_MSG_DECODE(hardware_other, "HARD_ERROR_OTHER")
-            break;
-
-        case SOFT_ERROR: ;
-            PRINTABLE_MSG_DECODE(software, "SOFT_ERROR")
-            break;
-
-        case KEEP_ALIVE: ;
-            // message type
-            cJSON *keep_alive_type = cJSON_CreateString("KEEP_ALIVE");
-            NULL_CHECK(keep_alive_type, root, -1)
-            cJSON_AddItemToObject(root, "type", keep_alive_type);
-            break;
-
-        case INVALID: // invalid message
-        default: // or anything else
-            cJSON_Delete(root); 
-            return -1;           
+    const MessageTypeInfo *info = type_info(message->type);
+    NULL_CHECK(info, root, -1)
+    cJSON *type = cJSON_CreateString(info->name);
+    NULL_CHECK(type, root, -1)
+    cJSON_AddItemToObject(root, "type", type);
+
+    if (info->fields & FIELD_MESSAGE) {
+        cJSON *text = cJSON_CreateString((*text_field((Message *) message, info))->str);
+        NULL_CHECK(text, root, -1)
+        cJSON_AddItemToObject(data, "message", text);
+    }
+
+    if (info->fields & FIELD_VALVE_NO) {
+        cJSON *valve_no = cJSON_CreateNumber((double) *valve_no_field((Message *) message, info));
+        NULL_CHECK(valve_no, root, -1)
+        cJSON_AddItemToObject(data, "valve_no", valve_no);
+    }
+
+    // ACK and CREDIT carry their number as the sequence number, added below
+
+    // relayed messages say where they came from
+    if (INADDR_ANY != message->origin.s_addr) {
+        char origin[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &(message->origin), origin, sizeof(origin));
+        cJSON *origin_item = cJSON_CreateString(origin);
+        NULL_CHECK(origin_item, root, -1)
+        cJSON_AddItemToObject(root, "origin", origin_item);
+    }
+
+    // logical node
+    if (0 != message->node_id) {
+        cJSON *node = cJSON_CreateNumber((double) message->node_id);
+        NULL_CHECK(node, root, -1)
+        cJSON_AddItemToObject(root, "node", node);
+    }
+
+    // capabilities
+    if (0 != message->caps) {
+        cJSON *caps = cJSON_CreateNumber((double) message->caps);
+        NULL_CHECK(caps, root, -1)
+        cJSON_AddItemToObject(root, "caps", caps);
+    }
+
+    // sequence number
+    if (0 != message->seq) {
+        cJSON *seq = cJSON_CreateNumber((double) message->seq);
+        NULL_CHECK(seq, root, -1)
+        cJSON_AddItemToObject(root, "seq", seq);
+    }
+
+    // coalesced repeats
+    if (0 != message->repeat.count) {
+        cJSON *repeat = cJSON_CreateNumber((double) message->repeat.count);
+        NULL_CHECK(repeat, root, -1)
+        cJSON_AddItemToObject(data, "repeat", repeat);
+        cJSON *first_seen = cJSON_CreateNumber((double) message->repeat.first_ms);
+        NULL_CHECK(first_seen, root, -1)
+        cJSON_AddItemToObject(data, "first_seen", first_seen);
+        cJSON *last_seen = cJSON_CreateNumber((double) message->repeat.last_ms);
+        NULL_CHECK(last_seen, root, -1)
+        cJSON_AddItemToObject(data, "last_seen", last_seen);
     }
 
     // encode JSON as string
@@ -132,6 +243,169 @@ ssize_t encode_message(const Message *message, char **encoded_message) {
     return len;
 }
 
+// encode a message structure into a format to be transmitted
+// returns the length of the encoded_message string
+ssize_t encode_message(const Message *message, char **encoded_message) {
+    // arguments check
+    if ((NULL == message) || (NULL == encoded_message))
+        return -1;
+
+    // cJSON's allocations come from the arena so only the result is malloc'ed
+    arena_begin();
+    char *printed = NULL;
+    ssize_t len = encode_tree(message, &printed);
+    if (-1 != len) {
+        size_t size = strlen(printed) + 1;
+        *encoded_message = malloc(size);
+        if (NULL == *encoded_message)
+            len = -1;
+        else
+            memcpy(*encoded_message, printed, size);
+    }
+    arena_end();
+
+    return len;
+}
+
+// encode a message into a caller supplied buffer (see edsac_representation.h)
+ssize_t encode_message_buf(const Message *message, char *buf, size_t buflen) {
+    // arguments check
+    if ((NULL == message) || (NULL == buf))
+        return -1;
+
+    arena_begin();
+    char *printed = NULL;
+    ssize_t len = -1;
+    if (-1 != encode_tree(message, &printed)) {
+        size_t printed_len = strlen(printed);
+        if (printed_len < buflen) {
+            memcpy(buf, printed, printed_len + 1);
+            len = (ssize_t) printed_len;
+        }
+    }
+    arena_end();
+
+    return len;
+}
+
+// templates
+// The message is encoded with a placeholder valve_no and split around it so rendering is two memcpys and an itoa
+
+struct MessageTemplate {
+    MessageType type;
+    char *encoded; // the whole message, with the placeholder valve_no
+    size_t prefix_len; // bytes before the valve_no (the whole length if there is no slot)
+    const char *suffix; // bytes after it
+    size_t suffix_len;
+};
+
+// unlikely to be a real valve number but any value would do: it is found by its key
+#define TEMPLATE_PLACEHOLDER 123456789
+#define TEMPLATE_KEY "\"valve_no\":"
+
+// compile a message into a template (see edsac_representation.h)
+MessageTemplate *compile_template(const Message *message) {
+    if (NULL == message)
+        return NULL;
+
+    MessageTemplate *tmpl = calloc(1, sizeof(MessageTemplate));
+    if (NULL == tmpl)
+        return NULL;
+    tmpl->type = message->type;
+
+    const MessageTypeInfo *info = type_info(message->type);
+    bool has_valve_no = (NULL != info) && (info->fields & FIELD_VALVE_NO);
+    Message placeholder = *message;
+    if (has_valve_no)
+        *valve_no_field(&placeholder, info) = TEMPLATE_PLACEHOLDER;
+    ssize_t len = encode_message(&placeholder, &tmpl->encoded);
+    if (-1 == len) {
+        free(tmpl);
+        return NULL;
+    }
+    len = (ssize_t) strlen(tmpl->encoded);
+
+    tmpl->prefix_len = (size_t) len;
+    tmpl->suffix = tmpl->encoded + len;
+    tmpl->suffix_len = 0;
+    if (has_valve_no) {
+        // quotes inside the message text are escaped so this can only be the key itself
+        const char *key = strstr(tmpl->encoded, TEMPLATE_KEY);
+        if (NULL == key) {
+            free_template(tmpl);
+            return NULL;
+        }
+        const char *number = key + strlen(TEMPLATE_KEY);
+        char *number_end = NULL;
+        if (TEMPLATE_PLACEHOLDER != strtol(number, &number_end, 10)) {
+            free_template(tmpl);
+            return NULL;
+        }
+        tmpl->prefix_len = (size_t) (number - tmpl->encoded);
+        tmpl->suffix = number_end;
+        tmpl->suffix_len = (size_t) (tmpl->encoded + len - number_end);
+    }
+
+    return tmpl;
+}
+
+// render a template (see edsac_representation.h)
+ssize_t render_template(const MessageTemplate *tmpl, int valve_no, char *buf, size_t buflen) {
+    if ((NULL == tmpl) || (NULL == buf))
+        return -1;
+
+    // the digits are written backwards from the end of this
+    char digits[16];
+    size_t ndigits = 0;
+    if (type_info(tmpl->type)->fields & FIELD_VALVE_NO) {
+        // unsigned so that INT_MIN can be negated
+        unsigned int magnitude = (valve_no < 0) ? 0u - (unsigned int) valve_no : (unsigned int) valve_no;
+        do {
+            digits[sizeof(digits) - 1 - ndigits++] = (char) ('0' + magnitude % 10);
+            magnitude /= 10;
+        } while (0 != magnitude);
+        if (valve_no < 0)
+            digits[sizeof(digits) - 1 - ndigits++] = '-';
+    }
+
+    size_t len = tmpl->prefix_len + ndigits + tmpl->suffix_len;
+    if (len >= buflen)
+        return -1;
+
+    memcpy(buf, tmpl->encoded, tmpl->prefix_len);
+    memcpy(buf + tmpl->prefix_len, &digits[sizeof(digits) - ndigits], ndigits);
+    memcpy(buf + tmpl->prefix_len + ndigits, tmpl->suffix, tmpl->suffix_len);
+    buf[len] = '\0';
+
+    return (ssize_t) len;
+}
+
+MessageType template_type(const MessageTemplate *tmpl) {
+    return (NULL == tmpl) ? INVALID : tmpl->type;
+}
+
+bool template_message(const MessageTemplate *tmpl, int valve_no, Message *message) {
+    if ((NULL == tmpl) || (NULL == message))
+        return false;
+
+    size_t buflen = tmpl->prefix_len + tmpl->suffix_len + 16; // room for any int
+    char *buf = malloc(buflen);
+    if (NULL == buf)
+        return false;
+
+    bool ret = (-1 != render_template(tmpl, valve_no, buf, buflen)) && decode_message(buf, message);
+    free(buf);
+    return ret;
+}
+
+void free_template(MessageTemplate *tmpl) {
+    if (NULL == tmpl)
+        return;
+
+    free(tmpl->encoded);
+    free(tmpl);
+}
+
 // shorthand to check the type of a node in the cJSON tree
 #define EXPECT_TYPE(_ptr, _type) \
     if (!cJSON_Is##_type(_ptr)) { \
@@ -139,18 +413,62 @@ ssize_t encode_message(const Message *message, char **encoded_message) {
         return false; \
     } \
 
-// shorthand for decoding similar message types
-#define PRINTABLE_MSG_ENCODE(_type) \
-    if (0 == strncmp(_type, type->valuestring, strlen(_type))) { \
-        /* it was a software error packet */ \
-        /* get description string */ \
-        cJSON *description = cJSON_GetObjectItem(data, "message"); \
-        NULL_CHECK(description, root, false) \
-        EXPECT_TYPE(description, String)
+// number of slots in the hash table. Must be a power of 2 comfortably bigger than the number of types
+#define TYPE_HASH_SIZE 32
+_Static_assert(INVALID < TYPE_HASH_SIZE, "more message types than TYPE_HASH_SIZE can hash without collisions");
 
-// decode a string into a message structure
+// FNV-1a perturbed by seed
+static unsigned int type_hash(const char *name, size_t len, uint32_t seed) {
+    uint32_t h = 2166136261u ^ seed;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char) name[i];
+        h *= 16777619u;
+    }
+    return h & (TYPE_HASH_SIZE - 1);
+}
+
+// a perfect hash of the names in message_types, worked out when the table last changed: TYPE_SEED is the first seed
+// for which no two names share a slot and each name's type is in slot type_hash(name, TYPE_SEED). Adding a type means
+// finding them again; representation.test fails until every name finds its own type
+#define TYPE_SEED 0
+
+// slot -> MessageType + 1 (0 is an empty slot)
+static const unsigned char type_slots[TYPE_HASH_SIZE] = {
+    [2] = ACK + 1,
+    [4] = CREDIT + 1,
+    [8] = SOFT_ERROR + 1,
+    [20] = HARD_ERROR_OTHER + 1,
+    [22] = KEEP_ALIVE + 1,
+    [28] = HARD_ERROR_VALVE + 1,
+};
+
+// look up a message type by name (see edsac_representation.h)
+MessageType message_type_from_name(const char *name, size_t len) {
+    if (NULL == name)
+        return INVALID;
+
+    unsigned int slot = type_slots[type_hash(name, len, TYPE_SEED)];
+    if (0 == slot)
+        return INVALID;
+
+    // the hash is perfect for the names we know but anything could have been sent
+    MessageType type = (MessageType) (slot - 1);
+    const char *expected = message_types[type].name;
+    if ((strlen(expected) != len) || (0 != memcmp(expected, name, len)))
+        return INVALID;
+
+    return type;
+}
+
+// the name of a message type on the wire
+const char *message_type_name(MessageType type) {
+    const MessageTypeInfo *info = type_info(type);
+    return (NULL == info) ? NULL : info->name;
+}
+
+// decode a string into a message structure. The caller sets up the arena. The version is only looked at if check_version
 // returns success
-bool decode_message(const char* encoded_message, Message *message) {
+static bool decode_tree(const char* encoded_message, Message *message, bool check_version) {
     // arguments check
     if ((NULL == encoded_message) || (NULL == message))
         return false;
@@ -161,12 +479,14 @@ bool decode_message(const char* encoded_message, Message *message) {
         return false;
 
     // check the version number
-    cJSON *version = cJSON_GetObjectItem(root, "version");
-    NULL_CHECK(version, root, false)
-    EXPECT_TYPE(version, Number)
-    if (DATA_FORMAT_VERSION != version->valuedouble) {
-        cJSON_Delete(root);
-        return false;
+    if (check_version) {
+        cJSON *version = cJSON_GetObjectItem(root, "version");
+        NULL_CHECK(version, root, false)
+        EXPECT_TYPE(version, Number)
+        if (DATA_FORMAT_VERSION != version->valuedouble) {
+            cJSON_Delete(root);
+            return false;
+        }
     }
 
     // data subroot
@@ -174,57 +494,670 @@ bool decode_message(const char* encoded_message, Message *message) {
     NULL_CHECK(data, root, false)
 
     // message type
-    cJSON *type = cJSON_GetObjectItem(root, "type");
-    NULL_CHECK(type, root, false)
-    EXPECT_TYPE(type, String)
-
-    PRINTABLE_MSG_ENCODE("SOFT_ERR")
-        /* initialise message */
-        /* GLIB makes a copy so we don't need to worry when calling cJSON_Delete */
-        software_error(message, description->valuestring);
-    } else PRINTABLE_MSG_ENCODE("HARD_ERROR_OTHER")
-        // it was a hardware error other packet
-        // initialise message
-        // GLIB copies the message so we don't need to worry about cJSON_Delete
-        hardware_error_other(message, description->valuestring);
-    } else PRINTABLE_MSG_ENCODE("HARD_ERROR_VALVE")
-        // it was a hardware error valve packet
-
-        // valve_no
-        cJSON *valve_no = cJSON_GetObjectItem(data, "valve_no");
-        NULL_CHECK(valve_no, root, false)
-        EXPECT_TYPE(valve_no, Number)
-
-        // initialize message
-        hardware_error_valve(message, valve_no->valueint, description->valuestring);
-    } else if (0 == strncmp("KEEP_ALIVE", type->valuestring, 11)) {
-        // it was a KEEP_ALIVE packet
-        keep_alive(message);
-    } else {
+    cJSON *type_item = cJSON_GetObjectItem(root, "type");
+    NULL_CHECK(type_item, root, false)
+    EXPECT_TYPE(type_item, String)
+    MessageType type = message_type_from_name(type_item->valuestring, strlen(type_item->valuestring));
+    if (INVALID == type) {
         // we don't know what kind of packet that is
         cJSON_Delete(root);
         return false;
     }
-    
+    const MessageTypeInfo *info = &message_types[type];
+
+    // get the fields this type needs
+    const char *text = NULL;
+    if (info->fields & FIELD_MESSAGE) {
+        cJSON *description = cJSON_GetObjectItem(data, "message");
+        NULL_CHECK(description, root, false)
+        EXPECT_TYPE(description, String)
+        text = description->valuestring;
+    }
+
+    int valve_no = 0;
+    if (info->fields & FIELD_VALVE_NO) {
+        cJSON *valve_no_item = cJSON_GetObjectItem(data, "valve_no");
+        NULL_CHECK(valve_no_item, root, false)
+        EXPECT_TYPE(valve_no_item, Number)
+        valve_no = valve_no_item->valueint;
+    }
+
+    // initialise message
+    // GLIB copies the message so we don't need to worry about cJSON_Delete
+    init_message(message, info, valve_no, text);
+
+    // optional origin
+    cJSON *origin = cJSON_GetObjectItem(root, "origin");
+    if (cJSON_IsString(origin) && (1 != inet_pton(AF_INET, origin->valuestring, &(message->origin))))
+        message->origin.s_addr = INADDR_ANY;
+
+    // optional node
+    cJSON *node = cJSON_GetObjectItem(root, "node");
+    if (cJSON_IsNumber(node) && (node->valuedouble >= 1) && (node->valuedouble <= UINT32_MAX))
+        message->node_id = (uint32_t) node->valuedouble;
+
+    // optional capabilities
+    cJSON *caps = cJSON_GetObjectItem(root, "caps");
+    if (cJSON_IsNumber(caps) && (caps->valuedouble >= 1) && (caps->valuedouble <= UINT32_MAX))
+        message->caps = (uint32_t) caps->valuedouble;
+
+    // optional sequence number
+    cJSON *seq = cJSON_GetObjectItem(root, "seq");
+    if (cJSON_IsNumber(seq) && (seq->valuedouble >= 1) && (seq->valuedouble <= MAX_SEQ))
+        message->seq = (uint64_t) seq->valuedouble;
+
+    // optional repeat count
+    cJSON *repeat = cJSON_GetObjectItem(data, "repeat");
+    cJSON *first_seen = cJSON_GetObjectItem(data, "first_seen");
+    cJSON *last_seen = cJSON_GetObjectItem(data, "last_seen");
+    if (cJSON_IsNumber(repeat) && cJSON_IsNumber(first_seen) && cJSON_IsNumber(last_seen) && (repeat->valuedouble >= 1)) {
+        message->repeat.count = (repeat->valuedouble >= UINT32_MAX) ? UINT32_MAX : (uint32_t) repeat->valuedouble;
+        message->repeat.first_ms = (int64_t) first_seen->valuedouble;
+        message->repeat.last_ms = (int64_t) last_seen->valuedouble;
+    }
+
     cJSON_Delete(root);
     return true;
 }
 
+// decode a string into a message structure
+// returns success
+bool decode_message(const char* encoded_message, Message *message) {
+    // the cJSON tree only lives as long as this call so it comes from the arena
+    arena_begin();
+    bool ret = decode_tree(encoded_message, message, true);
+    arena_end();
+
+    return ret;
+}
+
+// decode_message for a connection which agreed the version (see edsac_representation.h)
+bool decode_agreed_message(const char* encoded_message, Message *message) {
+    arena_begin();
+    bool ret = decode_tree(encoded_message, message, false);
+    arena_end();
+
+    return ret;
+}
+
+// in-place decoding
+// A small scanner for our flat message schema which works on a length-bounded buffer.
+// Nothing is copied: the message text is unescaped where it lies and NUL-terminated inside the frame
+
+// skip JSON whitespace
+static const char *skip_ws(const char *p, const char *end) {
+    while ((p < end) && ((' ' == *p) || ('\t' == *p) || ('\n' == *p) || ('\r' == *p)))
+        p++;
+    return p;
+}
+
+// scan a string starting at its opening quote
+// *start and *stop delimit the raw (still escaped) contents. Returns the position after the closing quote or NULL
+static const char *scan_string(const char *p, const char *end, const char **start, const char **stop) {
+    if ((p >= end) || ('"' != *p))
+        return NULL;
+
+    *start = ++p;
+    while (p < end) {
+        if ('\\' == *p) {
+            p += 2;
+        } else if ('"' == *p) {
+            *stop = p;
+            return p + 1;
+        } else {
+            p++;
+        }
+    }
+
+    return NULL;
+}
+
+// parse a number token. Returns the position after it or NULL
+static const char *scan_number(const char *p, const char *end, double *out) {
+    char token[32];
+    size_t len = 0;
+    while ((p + len < end) && (len < sizeof(token) - 1) && (NULL != strchr("+-0123456789.eE", p[len])) && ('\0' != p[len]))
+        len++;
+    if (0 == len)
+        return NULL;
+
+    memcpy(token, p, len);
+    token[len] = '\0';
+
+    char *token_end = NULL;
+    *out = strtod(token, &token_end);
+    if (token_end != token + len)
+        return NULL;
+
+    return p + len;
+}
+
+// skip over any JSON value. Returns the position after it or NULL
+static const char *skip_value(const char *p, const char *end) {
+    p = skip_ws(p, end);
+    if (p >= end)
+        return NULL;
+
+    if ('"' == *p) {
+        const char *start, *stop;
+        return scan_string(p, end, &start, &stop);
+    }
+
+    if (('{' == *p) || ('[' == *p)) {
+        // nested containers: only the nesting depth matters, strings may contain brackets
+        int depth = 0;
+        while (p < end) {
+            if ('"' == *p) {
+                const char *start, *stop;
+                p = scan_string(p, end, &start, &stop);
+                if (NULL == p)
+                    return NULL;
+                continue;
+            }
+            if (('{' == *p) || ('[' == *p))
+                depth++;
+            else if (('}' == *p) || (']' == *p))
+                depth--;
+            p++;
+            if (0 == depth)
+                return p;
+        }
+        return NULL;
+    }
+
+    // number, true, false or null
+    while ((p < end) && (NULL == strchr(",}] \t\r\n", *p)) && ('\0' != *p))
+        p++;
+    return p;
+}
+
+// compare a raw key to a C string
+#define KEY_IS(_start, _stop, _key) \
+    (((size_t) ((_stop) - (_start)) == strlen(_key)) && (0 == memcmp(_start, _key, strlen(_key))))
+
+// write the UTF-8 encoding of code point c to out. Returns the number of bytes written
+static size_t put_utf8(char *out, unsigned long c) {
+    if (c < 0x80) {
+        out[0] = (char) c;
+        return 1;
+    } else if (c < 0x800) {
+        out[0] = (char) (0xC0 | (c >> 6));
+        out[1] = (char) (0x80 | (c & 0x3F));
+        return 2;
+    } else if (c < 0x10000) {
+        out[0] = (char) (0xE0 | (c >> 12));
+        out[1] = (char) (0x80 | ((c >> 6) & 0x3F));
+        out[2] = (char) (0x80 | (c & 0x3F));
+        return 3;
+    }
+    out[0] = (char) (0xF0 | (c >> 18));
+    out[1] = (char) (0x80 | ((c >> 12) & 0x3F));
+    out[2] = (char) (0x80 | ((c >> 6) & 0x3F));
+    out[3] = (char) (0x80 | (c & 0x3F));
+    return 4;
+}
+
+// read 4 hex digits
+static bool parse_hex4(const char *p, const char *end, unsigned long *out) {
+    if (end - p < 4)
+        return false;
+
+    *out = 0;
+    for (int i = 0; i < 4; i++) {
+        char c = p[i];
+        unsigned long digit;
+        if ((c >= '0') && (c <= '9'))
+            digit = (unsigned long) (c - '0');
+        else if ((c >= 'a') && (c <= 'f'))
+            digit = (unsigned long) (c - 'a' + 10);
+        else if ((c >= 'A') && (c <= 'F'))
+            digit = (unsigned long) (c - 'A' + 10);
+        else
+            return false;
+        *out = (*out << 4) | digit;
+    }
+
+    return true;
+}
+
+// expand escapes between start and stop in place and NUL terminate the result
+// the result is never longer than the input so this always fits
+static bool unescape_inplace(char *start, char *stop) {
+    char *in = start;
+    char *out = start;
+
+    while (in < stop) {
+        if ('\\' != *in) {
+            *out++ = *in++;
+            continue;
+        }
+
+        in++;
+        if (in >= stop)
+            return false;
+
+        switch (*in) {
+            case '"': *out++ = '"'; break;
+            case '\\': *out++ = '\\'; break;
+            case '/': *out++ = '/'; break;
+            case 'b': *out++ = '\b'; break;
+            case 'f': *out++ = '\f'; break;
+            case 'n': *out++ = '\n'; break;
+            case 'r': *out++ = '\r'; break;
+            case 't': *out++ = '\t'; break;
+            case 'u': ;
+                unsigned long c;
+                if (!parse_hex4(in + 1, stop, &c))
+                    return false;
+                in += 4;
+                // surrogate pair
+                if ((c >= 0xD800) && (c <= 0xDBFF)) {
+                    unsigned long low;
+                    if ((stop - in < 7) || ('\\' != in[1]) || ('u' != in[2]) || !parse_hex4(in + 3, stop, &low))
+                        return false;
+                    if ((low < 0xDC00) || (low > 0xDFFF))
+                        return false;
+                    c = 0x10000 + (((c & 0x3FF) << 10) | (low & 0x3FF));
+                    in += 6;
+                }
+                // \uXXXX is 6 bytes and UTF-8 is at most 3 (or 4 for a 12 byte pair) so out never overtakes in
+                out += put_utf8(out, c);
+                break;
+            default:
+                return false;
+        }
+        in++;
+    }
+
+    *out = '\0';
+    return true;
+}
+
+// the parts of a frame found by scan_frame
+typedef struct {
+    bool have_version;
+    double version;
+    const char *type_start, *type_stop; // raw type string
+    const char *text_start, *text_stop; // raw (escaped) message text
+    bool have_valve_no;
+    double valve_no;
+    bool have_repeat; // all three of repeat, first_seen and last_seen
+    double repeat, first_seen, last_seen;
+    const char *origin_start, *origin_stop; // raw origin address
+    bool have_node;
+    double node;
+    bool have_seq;
+    double seq;
+    bool have_caps;
+    double caps;
+} FrameFields;
+
+// find the members of a frame. If header_only then the data object is skipped without being looked at. The version is
+// only parsed and checked if check_version
+static bool scan_frame(const char *frame, size_t len, bool header_only, bool check_version, FrameFields *fields) {
+    memset(fields, 0, sizeof(*fields));
+
+    const char *end = frame + len;
+    const char *p = skip_ws(frame, end);
+    if ((p >= end) || ('{' != *p))
+        return false;
+    unsigned int repeat_fields = 0; // which of the repeat fields have been seen
+    p = skip_ws(p + 1, end);
+
+    // top level members
+    while ((p < end) && ('}' != *p)) {
+        const char *key_start, *key_stop;
+        p = scan_string(p, end, &key_start, &key_stop);
+        if (NULL == p)
+            return false;
+        p = skip_ws(p, end);
+        if ((p >= end) || (':' != *p))
+            return false;
+        p = skip_ws(p + 1, end);
+
+        if (check_version && KEY_IS(key_start, key_stop, "version")) {
+            p = scan_number(p, end, &fields->version);
+            fields->have_version = (NULL != p);
+        } else if (KEY_IS(key_start, key_stop, "type")) {
+            p = scan_string(p, end, &fields->type_start, &fields->type_stop);
+        } else if (KEY_IS(key_start, key_stop, "node")) {
+            p = scan_number(p, end, &fields->node);
+            fields->have_node = (NULL != p) && (fields->node >= 1) && (fields->node <= UINT32_MAX);
+        } else if (KEY_IS(key_start, key_stop, "seq")) {
+            p = scan_number(p, end, &fields->seq);
+            fields->have_seq = (NULL != p) && (fields->seq >= 1) && (fields->seq <= MAX_SEQ);
+        } else if (KEY_IS(key_start, key_stop, "caps")) {
+            p = scan_number(p, end, &fields->caps);
+            fields->have_caps = (NULL != p) && (fields->caps >= 1) && (fields->caps <= UINT32_MAX);
+        } else if (!header_only && KEY_IS(key_start, key_stop, "origin")) {
+            p = scan_string(p, end, &fields->origin_start, &fields->origin_stop);
+        } else if (!header_only && KEY_IS(key_start, key_stop, "data") && (p < end) && ('{' == *p)) {
+            // data members
+            p = skip_ws(p + 1, end);
+            while ((p < end) && ('}' != *p)) {
+                const char *data_key_start, *data_key_stop;
+                p = scan_string(p, end, &data_key_start, &data_key_stop);
+                if (NULL == p)
+                    return false;
+                p = skip_ws(p, end);
+                if ((p >= end) || (':' != *p))
+                    return false;
+                p = skip_ws(p + 1, end);
+
+                if (KEY_IS(data_key_start, data_key_stop, "message")) {
+                    p = scan_string(p, end, &fields->text_start, &fields->text_stop);
+                } else if (KEY_IS(data_key_start, data_key_stop, "valve_no")) {
+                    p = scan_number(p, end, &fields->valve_no);
+                    fields->have_valve_no = (NULL != p);
+                } else if (KEY_IS(data_key_start, data_key_stop, "repeat")) {
+                    p = scan_number(p, end, &fields->repeat);
+                    repeat_fields |= 0x1;
+                } else if (KEY_IS(data_key_start, data_key_stop, "first_seen")) {
+                    p = scan_number(p, end, &fields->first_seen);
+                    repeat_fields |= 0x2;
+                } else if (KEY_IS(data_key_start, data_key_stop, "last_seen")) {
+                    p = scan_number(p, end, &fields->last_seen);
+                    repeat_fields |= 0x4;
+                } else {
+                    p = skip_value(p, end);
+                }
+                if (NULL == p)
+                    return false;
+
+                p = skip_ws(p, end);
+                if ((p < end) && (',' == *p))
+                    p = skip_ws(p + 1, end);
+            }
+            if (p >= end)
+                return false;
+            p++; // closing brace of data
+            fields->have_repeat = (0x7 == repeat_fields) && (fields->repeat >= 1);
+        } else {
+            p = skip_value(p, end);
+        }
+        if (NULL == p)
+            return false;
+
+        p = skip_ws(p, end);
+        if ((p < end) && (',' == *p))
+            p = skip_ws(p + 1, end);
+    }
+    if (p >= end)
+        return false;
+
+    // check the version number
+    if (check_version && (!fields->have_version || (DATA_FORMAT_VERSION != fields->version)))
+        return false;
+    return NULL != fields->type_start;
+}
+
+// decode only the version and type of a message (see edsac_representation.h)
+bool decode_message_header(const char *frame, size_t len, MessageType *type) {
+    if (NULL == type)
+        return false;
+
+    MessageRoute route;
+    bool ret = decode_message_route(frame, len, &route);
+    *type = route.type;
+    return ret;
+}
+
+// helper for decode_message_route and decode_agreed_message_route
+static bool route_frame(const char *frame, size_t len, bool check_version, MessageRoute *route) {
+    if (NULL == route)
+        return false;
+    route->type = INVALID;
+    if (NULL == frame)
+        return false;
+
+    FrameFields fields;
+    if (!scan_frame(frame, len, true, check_version, &fields))
+        return false;
+
+    route->type = message_type_from_name(fields.type_start, (size_t) (fields.type_stop - fields.type_start));
+    route->node_id = fields.have_node ? (uint32_t) fields.node : 0;
+    route->seq = fields.have_seq ? (uint64_t) fields.seq : 0;
+    route->caps = fields.have_caps ? (uint32_t) fields.caps : 0;
+    return INVALID != route->type;
+}
+
+// decode only the version, type, node, sequence number and capabilities of a message (see edsac_representation.h)
+bool decode_message_route(const char *frame, size_t len, MessageRoute *route) {
+    return route_frame(frame, len, true, route);
+}
+
+// decode_message_route for a connection which agreed the version (see edsac_representation.h)
+bool decode_agreed_message_route(const char *frame, size_t len, MessageRoute *route) {
+    return route_frame(frame, len, false, route);
+}
+
+// start reading a JSON batch (see edsac_representation.h)
+bool batch_begin(const char *frame, size_t len, BatchReader *reader) {
+    if ((NULL == frame) || (NULL == reader))
+        return false;
+    memset(reader, 0, sizeof(*reader));
+
+    const char *end = frame + len;
+    const char *p = skip_ws(frame, end);
+    if ((p >= end) || ('{' != *p))
+        return false;
+    p = skip_ws(p + 1, end);
+
+    bool have_version = false;
+    double version = 0;
+    bool is_batch = false;
+    const char *messages = NULL; // the opening bracket of the array
+    const char *messages_end = NULL; // just past its closing bracket
+
+    while ((p < end) && ('}' != *p)) {
+        const char *key_start, *key_stop;
+        p = scan_string(p, end, &key_start, &key_stop);
+        if (NULL == p)
+            return false;
+        p = skip_ws(p, end);
+        if ((p >= end) || (':' != *p))
+            return false;
+        p = skip_ws(p + 1, end);
+
+        if (KEY_IS(key_start, key_stop, "version")) {
+            p = scan_number(p, end, &version);
+            have_version = (NULL != p);
+        } else if (KEY_IS(key_start, key_stop, "type")) {
+            const char *type_start, *type_stop;
+            p = scan_string(p, end, &type_start, &type_stop);
+            is_batch = (NULL != p) && KEY_IS(type_start, type_stop, "BATCH");
+        } else if (KEY_IS(key_start, key_stop, "data") && (p < end) && ('{' == *p)) {
+            p = skip_ws(p + 1, end);
+            while ((p < end) && ('}' != *p)) {
+                const char *data_key_start, *data_key_stop;
+                p = scan_string(p, end, &data_key_start, &data_key_stop);
+                if (NULL == p)
+                    return false;
+                p = skip_ws(p, end);
+                if ((p >= end) || (':' != *p))
+                    return false;
+                p = skip_ws(p + 1, end);
+
+                if (KEY_IS(data_key_start, data_key_stop, "messages") && (p < end) && ('[' == *p))
+                    messages = p;
+                p = skip_value(p, end);
+                if (NULL == p)
+                    return false;
+                if ((NULL != messages) && (NULL == messages_end))
+                    messages_end = p;
+
+                p = skip_ws(p, end);
+                if ((p < end) && (',' == *p))
+                    p = skip_ws(p + 1, end);
+            }
+            if (p >= end)
+                return false;
+            p++; // closing brace of data
+        } else {
+            p = skip_value(p, end);
+        }
+        if (NULL == p)
+            return false;
+
+        p = skip_ws(p, end);
+        if ((p < end) && (',' == *p))
+            p = skip_ws(p + 1, end);
+    }
+    if ((p >= end) || !have_version || (DATA_FORMAT_VERSION != version) || !is_batch || (NULL == messages))
+        return false;
+
+    // inside the brackets
+    reader->p = messages + 1;
+    reader->end = messages_end - 1;
+    return true;
+}
+
+// start reading a binary batch (see edsac_representation.h)
+bool binary_batch_begin(const char *frame, size_t len, BatchReader *reader) {
+    if ((NULL == frame) || (NULL == reader) || (len < BINARY_BATCH_HEADER_LEN) || (BINARY_BATCH != frame[0]))
+        return false;
+    memset(reader, 0, sizeof(*reader));
+
+    const unsigned char *header = (const unsigned char *) frame;
+    size_t body_len = ((size_t) header[1] << 8) | header[2];
+    if (BINARY_BATCH_HEADER_LEN + body_len != len)
+        return false;
+
+    reader->p = frame + BINARY_BATCH_HEADER_LEN;
+    reader->end = frame + len;
+    reader->binary = true;
+    return true;
+}
+
+// the next message in a batch (see edsac_representation.h)
+bool batch_next(BatchReader *reader, const char **msg, size_t *len) {
+    if ((NULL == reader) || (NULL == msg) || (NULL == len) || reader->error)
+        return false;
+
+    if (reader->binary) {
+        if (reader->p == reader->end)
+            return false;
+        if (reader->end - reader->p < 2) {
+            reader->error = true;
+            return false;
+        }
+        const unsigned char *header = (const unsigned char *) reader->p;
+        size_t msg_len = ((size_t) header[0] << 8) | header[1];
+        if ((size_t) (reader->end - reader->p) - 2 < msg_len) {
+            reader->error = true;
+            return false;
+        }
+        *msg = reader->p + 2;
+        *len = msg_len;
+        reader->p += 2 + msg_len;
+        return true;
+    }
+
+    const char *p = skip_ws(reader->p, reader->end);
+    if (p >= reader->end)
+        return false;
+
+    // messages are objects separated by commas
+    const char *start = p;
+    if ('{' != *p) {
+        reader->error = true;
+        return false;
+    }
+    p = skip_value(p, reader->end);
+    if (NULL == p) {
+        reader->error = true;
+        return false;
+    }
+    *msg = start;
+    *len = (size_t) (p - start);
+
+    p = skip_ws(p, reader->end);
+    if ((p < reader->end) && (',' == *p))
+        p++;
+    else if (p < reader->end)
+        reader->error = true; // the next call reports it
+    reader->p = p;
+    return true;
+}
+
+// helper for decode_message_inplace and decode_agreed_message_inplace
+static bool decode_frame(char *frame, size_t len, bool check_version, Message *message, const char **text) {
+    if ((NULL == frame) || (NULL == message) || (NULL == text))
+        return false;
+
+    FrameFields fields;
+    if (!scan_frame(frame, len, false, check_version, &fields))
+        return false;
+
+    MessageType type = message_type_from_name(fields.type_start, (size_t) (fields.type_stop - fields.type_start));
+    if (INVALID == type)
+        return false;
+    const MessageTypeInfo *info = &message_types[type];
+
+    // check for the fields this type needs
+    if ((info->fields & FIELD_VALVE_NO) && !fields.have_valve_no)
+        return false;
+    if ((info->fields & FIELD_MESSAGE) && (NULL == fields.text_start))
+        return false;
+
+    // frame is ours to modify so casting away the scanner's const is fine
+    char *text_start = (char *) fields.text_start;
+    if ((info->fields & FIELD_MESSAGE) && !unescape_inplace(text_start, (char *) fields.text_stop))
+        return false;
+
+    // the text is borrowed so there is no GString
+    memset(&(message->data), 0, sizeof(message->data));
+    message->type = type;
+    if (info->fields & FIELD_VALVE_NO) {
+        double valve_no = fields.valve_no;
+        *valve_no_field(message, info) =
+            (valve_no >= INT_MAX) ? INT_MAX : (valve_no <= INT_MIN) ? INT_MIN : (int) valve_no;
+    }
+    *text = (info->fields & FIELD_MESSAGE) ? text_start : NULL;
+
+    message->origin.s_addr = INADDR_ANY;
+    if ((NULL != fields.origin_start) && (fields.origin_stop - fields.origin_start < INET_ADDRSTRLEN)) {
+        char origin[INET_ADDRSTRLEN];
+        memcpy(origin, fields.origin_start, (size_t) (fields.origin_stop - fields.origin_start));
+        origin[fields.origin_stop - fields.origin_start] = '\0';
+        if (1 != inet_pton(AF_INET, origin, &(message->origin)))
+            message->origin.s_addr = INADDR_ANY;
+    }
+
+    message->node_id = fields.have_node ? (uint32_t) fields.node : 0;
+    message->seq = fields.have_seq ? (uint64_t) fields.seq : 0;
+    message->caps = fields.have_caps ? (uint32_t) fields.caps : 0;
+
+    memset(&(message->repeat), 0, sizeof(message->repeat));
+    if (fields.have_repeat) {
+        message->repeat.count = (fields.repeat >= UINT32_MAX) ? UINT32_MAX : (uint32_t) fields.repeat;
+        message->repeat.first_ms = (int64_t) fields.first_seen;
+        message->repeat.last_ms = (int64_t) fields.last_seen;
+    }
+
+    return true;
+}
+
+// decode a message in place (see edsac_representation.h)
+bool decode_message_inplace(char *frame, size_t len, Message *message, const char **text) {
+    return decode_frame(frame, len, true, message, text);
+}
+
+// decode_message_inplace for a connection which agreed the version (see edsac_representation.h)
+bool decode_agreed_message_inplace(char *frame, size_t len, Message *message, const char **text) {
+    return decode_frame(frame, len, false, message, text);
+}
+
 // frees dynamically allocated memory *within* a message (aka this will not free the message structure itself)
 void free_message(Message *msg) {
     if (!msg)
         return;
 
-    // free the description strings if they are present
-    if (SOFT_ERROR == msg->type) {
-        g_string_free(msg->data.software.message, true);
-        msg->data.software.message = NULL;
-    } else if (HARD_ERROR_OTHER == msg->type) {
-        g_string_free(msg->data.hardware_other.message, true);
-        msg->data.hardware_other.message = NULL;
-    } else if (HARD_ERROR_VALVE == msg->type) {
-        g_string_free(msg->data.hardware_valve.message, true);
-        msg->data.hardware_valve.message = NULL;
+    // free the description string if there is one (messages decoded in place borrow their text so have none)
+    const MessageTypeInfo *info = type_info(msg->type);
+    if ((NULL != info) && (info->fields & FIELD_MESSAGE) && (NULL != *text_field(msg, info))) {
+        g_string_free(*text_field(msg, info), true);
+        *text_field(msg, info) = NULL;
     }
 
     // mark the message as free'ed
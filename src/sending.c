@@ -5,6 +5,86 @@
  * functions related to sending data to a remote host
  */
 
+/* There are two ways of sending.
+By default send_message encodes and writes the message on the caller's thread, serialised by fd_mux.
+In async mode (SendingOptions.async) send_message encodes the message and puts it on a bounded queue (the ring) then
+returns straight away. A writer thread owns the socket: it takes everything waiting on the ring and writes it
+with a single writev so that bursts of messages cost few system calls.
+Messages are encoded into a per-thread buffer and copied into a slot of the ring, so sending doesn't allocate. The ring
+is lock-free for producers: a slot is claimed with a compare-and-swap and published by its sequence number. Producers
+only take the ring's mutex to wake the writer when it has said it is about to sleep.
+
+The socket is non-blocking. Writes are retried until everything is written, waiting (up to send_timeout_ms) for the
+socket to become writable whenever the kernel buffer is full.
+The periodic KEEP_ALIVE does not get its own write if it can help it: the timer just marks it as due and it is added to
+the next batch (async) or the next message (sync). The timer only writes it itself if nothing else is being sent.
+The server counts any frame as a sign of life so no KEEP_ALIVE is sent at all if something was written during the last
+KEEP_ALIVE_INTERVAL.
+
+With SendingOptions.reconnect a failed write closes the connection and the writer thread (which then runs in sync mode
+too) reconnects with jittered exponential backoff. Frames which were not completely written stay queued and the ring
+doubles as the replay queue: in sync mode send_message queues its message there while the connection is down.
+The uplink is only marked up again once the writer has emptied the ring, holding fd_mux for the last of it, so sync
+senders can't overtake queued messages.
+
+With SendingOptions.spool_dir messages go to an on-disk spool (see spool.c) instead while the connection is down or
+the ring is full. Once anything is spooled everything after it is too until the spool is empty, so the ring only ever
+holds messages older than those in the spool. The writer sends the ring first and then drains the spool at
+spool_drain_rate messages per second. stop_sending leaves whatever is still spooled for next time.
+
+start_sending_multi connects to several servers, each through its own Uplink with its own queue and writer thread
+(several uplinks are always async and reconnect). UPLINK_MIRROR queues every message on every uplink. UPLINK_FAILOVER
+queues each message on the first uplink whose last write worked, so uplinks after the first are only used while it is
+failing. An uplink which can't be reached at the start is started unhealthy and left for its writer to connect, so
+start_sending_multi only fails if none of them can be.
+
+With SendingOptions.node_id every new connection starts with a KEEP_ALIVE carrying the node id, so that the server can
+tell apart nodes which share an address. Messages only carry a node id of their own if the caller set one. The same
+KEEP_ALIVE carries the CAP_* flags for what the writer reads back (acks, flow_control): the server only writes ACKs
+and CREDIT to a connection which asked for them, as a client which never reads would have its connection reset.
+
+With SendingOptions.handshake the hello also asks for the encodings the options turn on (ENCODING_CAPS) and
+open_connection waits for the server's reply before the connection is used, leaving Uplink.caps holding what was
+agreed. write_frames and keep_alive_iov go by Uplink.caps rather than the options, so a server which never replies
+just gets plain frames. Without a handshake Uplink.caps is everything the options ask for.
+
+SendingOptions.sequence_numbers gives each message the next number from a counter as it is encoded. Threads which
+send at the same time can queue their messages in the other order, which the server counts as reordering.
+
+With SendingOptions.acks the ring also holds what has been written until the server acknowledges it: the writer's
+sent cursor sits between head and tail and slots are only released once an ACK covers their number. The writer reads
+the ACKs itself, without blocking, between writes (waking every CONTROL_POLL_MS while anything is waiting for one). After
+reconnecting it goes back to head and writes everything unacknowledged again. The server drops the duplicates. A
+connection which acknowledges nothing for ack_timeout_ms is treated as broken. Whether frames wait for an ACK goes by
+Uplink.caps, so a connection whose handshake left out CAP_ACKS releases them as they are written.
+
+With SendingOptions.flow_control the writer also reads the server's CREDIT frames, each of which says how many messages
+may have been written on the connection in all. Once that many have been the writer stops taking frames off the ring
+and waits (polling the socket) for more, writing only KEEP_ALIVEs. Producers carry on queuing until the ring is full.
+The hello on each new connection asks for credit and the writer waits for the first CREDIT. A server which sends none
+within FIRST_CREDIT_WAIT_MS is taken to have no flow control and is written to as fast as it reads. One whose handshake
+left out CAP_CREDIT is written to that way straight away.
+
+With SendingOptions.batch write_frames packs the frames the writer took off the ring together into batch frames. The
+batch's header, separators (or lengths) and suffix are iovecs of their own, so the encoded frames aren't copied. A batch
+which was only partly written is written again in full, like a single frame.
+
+SendingOptions.compress also runs each batch through compress_block into a COMPRESSED_FRAME, which replaces the batch
+only if it came out smaller. The batch is gathered into batch_buf first, so that is the one copy compression costs.
+COMPRESS_AUTO leaves loopback connections alone, where the bytes are free and the time is not. The hello carries
+CAP_COMPRESS as the server refuses compressed frames from anyone who didn't announce them.
+
+With SendingOptions.coalesce_window a message which is the same as the last one (type, valve number and text) is not
+sent straight away. The first is sent as usual and opens a window; repeats during the window are only counted. When
+the window closes, or a different message is sent, one copy goes out with the repeat count and the times of the first
+and last repeat. If there were repeats the next window starts straight away so a persistent fault costs one message
+per window.
+
+SendingOptions.rate_limits puts a token bucket in front of each message type. Messages which find their bucket empty
+are dropped and counted, and once a second the count is sent as a single "N SOFT_ERRORs suppressed" message of the
+same type which does not need a token. HARD_ERROR_VALVE is never limited.
+*/
+
 // includes
 #include "config.h"
 #include "edsac_sending.h"
@@ -12,94 +92,1659 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <stdatomic.h>
 #include <string.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <errno.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/stat.h>
 #include "edsac_timer.h"
+#include "edsac_spool.h"
+#include "edsac_compress.h"
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #include <assert.h>
 
-// file descriptor for the TCP connection to the remote host
-static int sending_fd = -1;
-static pthread_mutex_t fd_mux = PTHREAD_MUTEX_INITIALIZER;
+// most frames written by one writev (plus a KEEP_ALIVE)
+#define MAX_BATCH 64
+
+// how often the writer looks for ACKs or CREDIT while it is waiting for them (see SendingOptions.acks, flow_control)
+#define CONTROL_POLL_MS 10
+
+// longest batch frame write_frames gathers to compress: MAX_BATCH_LEN of messages plus the batch's own bytes
+#define MAX_GATHER_LEN (MAX_BATCH_LEN + sizeof(BATCH_PREFIX) + sizeof(BATCH_SUFFIX))
+
+// how long stop_sending waits for the server to close the connection after the last write (see close_control)
+#define CLOSE_WAIT_MS 1000
+
+// how long a new connection waits for the server's first CREDIT before taking it for a server without flow control
+#define FIRST_CREDIT_WAIT_MS 1000
+
+// how long a new connection waits for the reply to its hello before taking it for a server without handshakes
+#define HANDSHAKE_WAIT_MS 1000
+
+// the CAP_* which only change what is written, so a server which doesn't reply to a handshake is taken to refuse them
+#define ENCODING_CAPS (CAP_COMPRESS | CAP_COMPACT_KEEP_ALIVE | CAP_BATCH_JSON | CAP_BATCH_BINARY)
+
+// most bytes of control frames read at once
+#define CONTROL_BUF_LEN 256
+
+// an encoded message waiting to be written
+typedef struct {
+    const char *data;
+    size_t len;
+    bool spooled; // data is in the spool and should be consumed once written, otherwise it is in a ring slot
+} QueuedFrame;
+
+// one frame on the ring. Frames which don't fit in data are copied to the heap instead
+typedef struct {
+    atomic_size_t seq; // pos + 1 once the frame for position pos is published, pos while it is free for pos
+    uint64_t msg_seq; // the message's sequence number if we numbered it, otherwise 0 (see SendingOptions.acks)
+    size_t len;
+    char *heap;
+    char data[MAX_ENCODED_LEN + 1];
+} RingSlot;
+
+// bounded lock-free multi-producer single-consumer queue of frames
+typedef struct {
+    RingSlot *slots;
+    size_t cap;
+    atomic_size_t tail; // next position to push to
+    size_t head; // oldest position not yet released. Writer thread only
+    size_t sent; // oldest position not yet written. Only differs from head with acks. Writer thread only
+    atomic_bool sleeping; // the writer is (about to be) waiting on not_empty
+    pthread_mutex_t mux; // protects waking the writer and the uplink state (see Uplink)
+    pthread_cond_t not_empty;
+} SendRing;
+
+// the connection to a server and everything used to write to it
+typedef struct {
+    int fd; // file descriptor for the TCP connection to the remote host. -1 while disconnected
+    pthread_mutex_t fd_mux; // serialises sync mode writes
+    struct sockaddr_storage addr; // where to (re)connect to
+    socklen_t addrlen;
+    bool up; // sync mode: send_message may write directly. Changed with both fd_mux and the ring locked
+    SendRing ring; // async or reconnect mode only
+    pthread_t writer;
+    bool writer_running;
+    bool stopping; // tells the writer to finish what is queued then exit
+    unsigned int seed; // for backoff jitter
+    Spool *spool; // NULL unless spooling. Used with the ring locked
+    bool spool_active; // new messages go to the spool until it has been drained
+    atomic_bool keep_alive_due; // a KEEP_ALIVE should go out with the next write
+    atomic_long last_write; // when something was last written to the server (CLOCK_MONOTONIC seconds)
+    atomic_bool healthy; // the last write (or connection attempt) worked
+    char control_buf[CONTROL_BUF_LEN]; // control frames read from the server but not yet handled. Writer thread only
+    size_t control_len;
+    int64_t ack_progress_ms; // when the frames waiting for an ACK last started waiting or were acknowledged
+    uint64_t written_msgs; // messages written on this connection (see SendingOptions.flow_control). Writer thread only
+    uint64_t credit_limit; // how many the server allows, UINT64_MAX if it doesn't grant credit
+    bool credited; // a CREDIT has arrived on this connection (or FIRST_CREDIT_WAIT_MS has passed). Writer thread only
+    bool control_closed; // the server closed the connection and there is no reconnecting. Writer thread only
+    uint32_t agreed; // CAP_* in the server's reply to the hello, 0 until it arrives (see SendingOptions.handshake)
+    uint32_t caps; // CAP_* in use on the connection. Changed with the connection (see open_connection)
+    bool compress; // compress batch frames (see SendingOptions.compress)
+    char *batch_buf; // a batch gathered together to be compressed (MAX_GATHER_LEN). Writer thread only
+    char *compressed; // compressed batches waiting to be written (compressed_cap). Writer thread only
+    size_t compressed_cap;
+} Uplink;
+
+static Uplink *uplinks = NULL;
+static size_t num_uplinks = 0;
 static timer_t timer;
+static SendingOptions sending_options;
+
+// the last message sent, for coalescing repeats of it
+typedef struct {
+    bool active; // a window is open
+    MessageType type;
+    int valve_no;
+    GString *text;
+    long window_start; // CLOCK_MONOTONIC seconds
+    MessageRepeat repeat; // repeats held back during this window
+} Coalescer;
+
+static Coalescer coalescer;
+static pthread_mutex_t coalesce_mux = PTHREAD_MUTEX_INITIALIZER;
+
+// token bucket for one message type
+typedef struct {
+    double tokens;
+    double last_refill; // CLOCK_MONOTONIC seconds
+    uint32_t suppressed; // messages dropped since the last summary
+} TokenBucket;
+
+static TokenBucket buckets[INVALID];
+static pthread_mutex_t bucket_mux = PTHREAD_MUTEX_INITIALIZER;
+
+// once a second for coalescing and rate limiting. tick_mux is held while a tick runs so that stop_sending can wait for
+// one which has already started
+static bool ticking = false;
+static timer_t tick_timer;
+static pthread_mutex_t tick_mux = PTHREAD_MUTEX_INITIALIZER;
+static void sending_tick(void *compulsory);
+
+// the next sequence number (see SendingOptions.sequence_numbers)
+static atomic_uint_fast64_t next_seq;
+
+static const char keep_alive_msg[] = "{\"version\":2,\"data\":{},\"type\":\"KEEP_ALIVE\"}";
+
+// KEEP_ALIVE carrying SendingOptions.node_id and the CAP_* flags, written first on every new connection (hello_len is 0
+// for none)
+static char hello_msg[MAX_ENCODED_LEN + 1];
+static size_t hello_len = 0;
+static const char compact_keep_alive_msg[] = {COMPACT_KEEP_ALIVE};
+
+// every CAP_* the options ask for. Without a handshake they are all used
+static uint32_t wanted_caps = 0;
+
+// the KEEP_ALIVE to send on the connection
+static struct iovec keep_alive_iov(const Uplink *link) {
+    if (link->caps & CAP_COMPACT_KEEP_ALIVE)
+        return (struct iovec) {.iov_base = (void *) compact_keep_alive_msg, .iov_len = sizeof(compact_keep_alive_msg)};
+    return (struct iovec) {.iov_base = (void *) keep_alive_msg, .iov_len = sizeof(keep_alive_msg) - 1};
+}
+
+// wall clock milliseconds since the epoch
+static int64_t realtime_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static double monotonic_seconds_frac(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static int64_t monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static long monotonic_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long) ts.tv_sec;
+}
+
+// lock a mutex the sender can't carry on without
+static void lock_or_die(pthread_mutex_t *mux) {
+    if (0 != pthread_mutex_lock(mux)) {
+        perror("failed to lock sending mutex");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// fills in the default sending options
+void default_sending_options(SendingOptions *opts) {
+    if (NULL == opts)
+        return;
+
+    opts->async = false;
+    opts->queue_len = DEFAULT_SEND_QUEUE_LEN;
+    opts->send_timeout_ms = DEFAULT_SEND_TIMEOUT_MS;
+    opts->reconnect = false;
+    opts->reconnect_min_ms = DEFAULT_RECONNECT_MIN_MS;
+    opts->reconnect_max_ms = DEFAULT_RECONNECT_MAX_MS;
+    opts->compact_keep_alive = false;
+    opts->batch = BATCH_NONE;
+    opts->compress = COMPRESS_OFF;
+    opts->spool_dir = NULL;
+    opts->spool_segment_size = DEFAULT_SPOOL_SEGMENT_SIZE;
+    opts->spool_max_segments = DEFAULT_SPOOL_MAX_SEGMENTS;
+    opts->spool_drain_rate = DEFAULT_SPOOL_DRAIN_RATE;
+    opts->connect_timeout_ms = DEFAULT_CONNECT_TIMEOUT_MS;
+    opts->lazy_connect = false;
+    opts->uplink_mode = UPLINK_MIRROR;
+    opts->coalesce_window = 0;
+    memset(opts->rate_limits, 0, sizeof(opts->rate_limits));
+    opts->node_id = 0;
+    opts->sequence_numbers = false;
+    opts->acks = false;
+    opts->ack_timeout_ms = DEFAULT_ACK_TIMEOUT_MS;
+    opts->flow_control = false;
+    opts->handshake = false;
+}
+
+// copy a frame onto the ring. Any number of threads may push at once without locking. Fails if the ring is full
+static bool ring_push(SendRing *ring, const char *data, size_t len, uint64_t msg_seq) {
+    // a frame too long for a slot is copied to the heap first, so that running out of memory fails the push rather than
+    // publishing an empty slot
+    char *heap = NULL;
+    if (len >= sizeof(ring->slots[0].data)) {
+        heap = malloc(len);
+        if (NULL == heap)
+            return false;
+        memcpy(heap, data, len);
+    }
+
+    size_t pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    RingSlot *slot;
+    while (true) {
+        slot = &ring->slots[pos % ring->cap];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        ptrdiff_t diff = (ptrdiff_t) (seq - pos);
+        if (diff < 0) {
+            free(heap);
+            return false; // still holds the frame from a lap ago
+        }
+        if (0 != diff) {
+            pos = atomic_load_explicit(&ring->tail, memory_order_relaxed); // another producer got there first
+            continue;
+        }
+        if (atomic_compare_exchange_weak_explicit(&ring->tail, &pos, pos + 1, memory_order_relaxed,
+                    memory_order_relaxed))
+            break;
+    }
+
+    // the slot is ours until it is published
+    slot->heap = heap;
+    if (NULL == heap)
+        memcpy(slot->data, data, len);
+    slot->len = len;
+    slot->msg_seq = msg_seq;
+
+    // sequentially consistent so that it is ordered before ring_wake reads sleeping (see ring_pop_batch)
+    atomic_store(&slot->seq, pos + 1);
+    return true;
+}
+
+// wake the writer if it is waiting for something to be pushed. Call without the ring locked
+static void ring_wake(SendRing *ring) {
+    if (!atomic_load(&ring->sleeping))
+        return;
+
+    lock_or_die(&ring->mux);
+    pthread_cond_signal(&ring->not_empty);
+    pthread_mutex_unlock(&ring->mux);
+}
+
+// the slot for pos if its frame has been published. Writer thread only
+static RingSlot *ring_ready(SendRing *ring, size_t pos) {
+    RingSlot *slot = &ring->slots[pos % ring->cap];
+    return (pos + 1 == atomic_load(&slot->seq)) ? slot : NULL;
+}
+
+// hands the oldest count slots back to the producers once their frames are done with. Writer thread only
+static void ring_release(SendRing *ring, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        RingSlot *slot = &ring->slots[ring->head % ring->cap];
+        free(slot->heap);
+        slot->heap = NULL;
+        atomic_store_explicit(&slot->seq, ring->head + ring->cap, memory_order_release);
+        ring->head++;
+    }
+}
+
+// the writer has written the next count frames. They are released unless they have to wait for an ACK
+static void ring_sent(Uplink *link, size_t count) {
+    SendRing *ring = &link->ring;
+    if (!(link->caps & CAP_ACKS)) {
+        ring->sent += count;
+        ring_release(ring, count);
+        return;
+    }
+
+    // nothing was waiting so the clock starts now
+    if ((0 != count) && (ring->sent == ring->head))
+        link->ack_progress_ms = monotonic_ms();
+    ring->sent += count;
+}
+
+// is anything written waiting for an ACK? Writer thread only
+static bool awaiting_acks(Uplink *link) {
+    return (link->caps & CAP_ACKS) && (link->ring.sent != link->ring.head);
+}
+
+// how many of count messages the server's credit allows to be written now. Writer thread only
+static size_t credit_allows(Uplink *link, size_t count) {
+    if (!sending_options.flow_control || (link->written_msgs >= link->credit_limit))
+        return sending_options.flow_control ? 0 : count;
+    return (link->credit_limit - link->written_msgs < count) ? (size_t) (link->credit_limit - link->written_msgs) : count;
+}
+
+// hand a message to the writer: copied onto the ring or into the spool. msg_seq is its number if we numbered it
+static bool queue_frame(Uplink *link, const char *data, size_t len, uint64_t msg_seq) {
+    SendRing *ring = &link->ring;
+
+    // without a spool there is nothing else to keep consistent with the ring
+    if (NULL == link->spool) {
+        if (!ring_push(ring, data, len, msg_seq))
+            return false;
+        ring_wake(ring);
+        return true;
+    }
+
+    // once anything is spooled everything after it must be too
+    if (0 != pthread_mutex_lock(&ring->mux)) {
+        perror("failed to lock sending mutex");
+        return false;
+    }
+    bool ret = !link->spool_active && (-1 != link->fd) && ring_push(ring, data, len, msg_seq);
+    if (!ret) {
+        ret = spool_append(link->spool, data, len);
+        if (ret)
+            link->spool_active = true;
+    }
+    if (ret)
+        pthread_cond_signal(&ring->not_empty);
+    pthread_mutex_unlock(&ring->mux);
+
+    return ret;
+}
+
+// whether the writer thread has anything to do. Call with the ring locked
+static bool writer_has_work(Uplink *link) {
+    if ((NULL != ring_ready(&link->ring, link->ring.sent)) || link->stopping)
+        return true;
+
+    if (sending_options.async)
+        return atomic_load(&link->keep_alive_due) || (-1 == link->fd) || link->spool_active;
+
+    // sync mode: only needed while the connection is down
+    return !link->up;
+}
+
+// the CLOCK_REALTIME time ms milliseconds from now, for pthread_cond_timedwait
+static struct timespec deadline_after(unsigned int ms) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += ms / 1000;
+    deadline.tv_nsec += (long) (ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    return deadline;
+}
+
+// wait until the writer has work then look at up to max frames on the ring which haven't been written. They stay on
+// the ring (so the producers can't reuse their slots) until ring_sent. While anything is waiting for an ACK this
+// gives up after CONTROL_POLL_MS so that the writer can read them
+// returns the number found
+static size_t ring_pop_batch(Uplink *link, QueuedFrame *out, size_t max) {
+    SendRing *ring = &link->ring;
+    lock_or_die(&ring->mux);
+    // sleeping is set before looking for work: a producer either published before this looks or sees the flag
+    // afterwards and signals (which it can't do before this thread waits because this thread holds the lock)
+    atomic_store(&ring->sleeping, true);
+    if (awaiting_acks(link) || (0 == credit_allows(link, 1))) {
+        struct timespec deadline = deadline_after(CONTROL_POLL_MS);
+        int err = 0;
+        while (!writer_has_work(link) && (ETIMEDOUT != err))
+            err = pthread_cond_timedwait(&ring->not_empty, &ring->mux, &deadline);
+    } else {
+        while (!writer_has_work(link))
+            pthread_cond_wait(&ring->not_empty, &ring->mux);
+    }
+    atomic_store(&ring->sleeping, false);
+    pthread_mutex_unlock(&ring->mux);
+
+    size_t n = 0;
+    RingSlot *slot;
+    while ((n < max) && (NULL != (slot = ring_ready(ring, ring->sent + n)))) {
+        out[n].data = (NULL == slot->heap) ? slot->data : slot->heap;
+        out[n].len = slot->len;
+        out[n].spooled = false;
+        n++;
+    }
+
+    return n;
+}
+
+static bool ring_init(SendRing *ring, size_t cap) {
+    ring->slots = calloc(cap, sizeof(RingSlot));
+    if (NULL == ring->slots)
+        return false;
+
+    for (size_t i = 0; i < cap; i++)
+        atomic_init(&ring->slots[i].seq, i);
+    ring->cap = cap;
+    atomic_init(&ring->tail, 0);
+    ring->head = 0;
+    ring->sent = 0;
+    atomic_init(&ring->sleeping, false);
+    pthread_mutex_init(&ring->mux, NULL);
+    pthread_cond_init(&ring->not_empty, NULL);
+    return true;
+}
+
+// frees the ring and anything still on it
+static void ring_destroy(SendRing *ring) {
+    if (NULL == ring->slots)
+        return;
+
+    for (size_t i = 0; i < ring->cap; i++)
+        free(ring->slots[i].heap);
+    free(ring->slots);
+    ring->slots = NULL;
+    pthread_mutex_destroy(&ring->mux);
+    pthread_cond_destroy(&ring->not_empty);
+}
+
+// write everything in iov, however many system calls it takes. iov is modified
+// on failure the unwritten part is left in iov[*remaining..iovcnt) (if remaining is not NULL)
+static bool write_all(int fd, struct iovec *iov, size_t iovcnt, size_t *remaining) {
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+
+    while (0 != msg.msg_iovlen) {
+        // MSG_NOSIGNAL: a closed connection is an error not a SIGPIPE
+        ssize_t count = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (-1 == count) {
+            int e = errno;
+            if (EINTR == e)
+                continue;
+
+            if ((EAGAIN == e) || (EWOULDBLOCK == e)) {
+                // wait for space in the socket buffer
+                struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+                int ready = poll(&pfd, 1, sending_options.send_timeout_ms);
+                if (1 == ready)
+                    continue;
+                if ((-1 == ready) && (EINTR == errno))
+                    continue;
+                puts("Timed out writing to socket");
+                break;
+            }
+
+            printf("Error writing to socket. errno = %i, %s\n", e, strerror(e));
+            break;
+        }
+
+        // skip past whatever was written
+        size_t written = (size_t) count;
+        while ((0 != msg.msg_iovlen) && (written >= msg.msg_iov->iov_len)) {
+            written -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (0 != msg.msg_iovlen) {
+            msg.msg_iov->iov_base = (char *) msg.msg_iov->iov_base + written;
+            msg.msg_iov->iov_len -= written;
+        }
+    }
+
+    if (NULL != remaining)
+        *remaining = (size_t) (msg.msg_iov - iov);
+    return 0 == msg.msg_iovlen;
+}
+
+// replaces the iovecs of a batch frame, iov[first..*iovcnt), with the compressed frame if that is smaller.
+// The compressed block goes at *used in link->compressed. Writer thread only
+static void compress_batch(Uplink *link, struct iovec *iov, size_t first, size_t *iovcnt, size_t *used,
+        unsigned char header[COMPRESSED_FRAME_HEADER_LEN]) {
+    size_t len = 0;
+    for (size_t i = first; i < *iovcnt; i++) {
+        memcpy(link->batch_buf + len, iov[i].iov_base, iov[i].iov_len);
+        len += iov[i].iov_len;
+    }
+
+    char *block = link->compressed + *used;
+    size_t block_len = compress_block(link->batch_buf, len, block);
+    if (COMPRESSED_FRAME_HEADER_LEN + block_len >= len)
+        return; // not worth it
+
+    header[0] = COMPRESSED_FRAME;
+    header[1] = (unsigned char) (block_len >> 8);
+    header[2] = (unsigned char) block_len;
+    header[3] = (unsigned char) (len >> 8);
+    header[4] = (unsigned char) len;
+    *iovcnt = first;
+    iov[(*iovcnt)++] = (struct iovec) {.iov_base = header, .iov_len = COMPRESSED_FRAME_HEADER_LEN};
+    iov[(*iovcnt)++] = (struct iovec) {.iov_base = block, .iov_len = block_len};
+    *used += block_len;
+}
+
+// makes sure there is somewhere to compress batches of these frames. Returns false if there isn't. Writer thread only
+static bool reserve_compressed(Uplink *link, const QueuedFrame *frames, size_t count) {
+    if ((NULL == link->batch_buf) && (NULL == (link->batch_buf = malloc(MAX_GATHER_LEN))))
+        return false;
+
+    // no batch is longer than its messages plus the batch's own bytes for each of them
+    size_t len = 0;
+    for (size_t i = 0; i < count; i++)
+        len += frames[i].len + MAX_GATHER_LEN - MAX_BATCH_LEN;
+    size_t need = COMPRESS_BOUND(len) + 16 * count;
+    if (need <= link->compressed_cap)
+        return true;
+
+    char *compressed = realloc(link->compressed, need);
+    if (NULL == compressed)
+        return false;
+    link->compressed = compressed;
+    link->compressed_cap = need;
+    return true;
+}
+
+// the batch format in use on the connection (see SendingOptions.batch)
+static BatchFormat link_batch(const Uplink *link) {
+    if (link->caps & CAP_BATCH_BINARY)
+        return BATCH_BINARY;
+    if (link->caps & CAP_BATCH_JSON)
+        return BATCH_JSON;
+    return BATCH_NONE;
+}
+
+// writes a batch of frames (and the KEEP_ALIVE if it is due) with as few system calls as possible. With
+// SendingOptions.batch frames which follow each other are put into batch frames of up to MAX_BATCH_LEN bytes, with the
+// batch's header, separators and lengths in iovecs of their own so that nothing is copied (unless it is compressed)
+// returns the number of frames completely written
+static size_t write_frames(Uplink *link, const QueuedFrame *frames, size_t count) {
+    // each frame needs at most a separator (or length) before it and each batch a header and suffix
+    struct iovec iov[4 * MAX_BATCH + 1];
+    unsigned char lengths[MAX_BATCH][2];
+    unsigned char headers[MAX_BATCH][COMPRESSED_FRAME_HEADER_LEN];
+    size_t group_iov_end[MAX_BATCH]; // iovecs up to the end of each frame (or batch) written separately
+    size_t group_frame_end[MAX_BATCH]; // frames up to the end of it
+    size_t groups = 0;
+    size_t iovcnt = 0;
+    BatchFormat batch = link_batch(link);
+    bool compress = link->compress && (link->caps & CAP_COMPRESS) && reserve_compressed(link, frames, count);
+    size_t compressed_used = 0;
+
+    for (size_t i = 0; i < count; ) {
+        // as many of the following frames as fit in one batch
+        size_t n = 1;
+        size_t body_len = frames[i].len + 2;
+        if (BATCH_NONE != batch) {
+            while ((i + n < count) && (body_len + frames[i + n].len + 2 <= MAX_BATCH_LEN)) {
+                body_len += frames[i + n].len + 2;
+                n++;
+            }
+        }
+
+        size_t group_start = iovcnt;
+        if (1 == n) {
+            iov[iovcnt].iov_base = (void *) frames[i].data;
+            iov[iovcnt].iov_len = frames[i].len;
+            iovcnt++;
+        } else if (BATCH_JSON == batch) {
+            iov[iovcnt++] = (struct iovec) {.iov_base = (void *) BATCH_PREFIX, .iov_len = sizeof(BATCH_PREFIX) - 1};
+            for (size_t j = i; j < i + n; j++) {
+                if (j != i)
+                    iov[iovcnt++] = (struct iovec) {.iov_base = (void *) ",", .iov_len = 1};
+                iov[iovcnt++] = (struct iovec) {.iov_base = (void *) frames[j].data, .iov_len = frames[j].len};
+            }
+            iov[iovcnt++] = (struct iovec) {.iov_base = (void *) BATCH_SUFFIX, .iov_len = sizeof(BATCH_SUFFIX) - 1};
+        } else {
+            unsigned char *header = headers[groups];
+            header[0] = BINARY_BATCH;
+            header[1] = (unsigned char) (body_len >> 8);
+            header[2] = (unsigned char) body_len;
+            iov[iovcnt++] = (struct iovec) {.iov_base = header, .iov_len = BINARY_BATCH_HEADER_LEN};
+            for (size_t j = i; j < i + n; j++) {
+                lengths[j][0] = (unsigned char) (frames[j].len >> 8);
+                lengths[j][1] = (unsigned char) frames[j].len;
+                iov[iovcnt++] = (struct iovec) {.iov_base = lengths[j], .iov_len = 2};
+                iov[iovcnt++] = (struct iovec) {.iov_base = (void *) frames[j].data, .iov_len = frames[j].len};
+            }
+        }
+
+        if (compress && (n > 1))
+            compress_batch(link, iov, group_start, &iovcnt, &compressed_used, headers[groups]);
+
+        i += n;
+        group_iov_end[groups] = iovcnt;
+        group_frame_end[groups] = i;
+        groups++;
+    }
+
+    if (atomic_exchange(&link->keep_alive_due, false)) {
+        iov[iovcnt++] = keep_alive_iov(link);
+    }
+
+    size_t done = iovcnt;
+    bool ok = write_all(link->fd, iov, iovcnt, &done);
+    atomic_store(&link->healthy, ok);
+    if (ok) {
+        atomic_store(&link->last_write, monotonic_seconds());
+        return count;
+    }
+
+    // a frame (or batch) which was partly written has to be sent again in full
+    size_t written = 0;
+    for (size_t g = 0; (g < groups) && (group_iov_end[g] <= done); g++)
+        written = group_frame_end[g];
+    return written;
+}
+
+static bool await_handshake(Uplink *link, int fd);
+
+// opens a new (non-blocking) connection to the server and starts its control state afresh. *caps is set to the CAP_*
+// to use on it. Returns the fd or -1
+static int open_connection(Uplink *link, uint32_t *caps) {
+    // open a socket. It is non-blocking from the start: writes wait for space themselves (see write_all)
+    int fd = socket(link->addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (-1 == fd) {
+        return -1;
+    }
+
+    // create tcp connection, waiting at most connect_timeout_ms rather than for the kernel to give up on the SYN
+    if (-1 == connect(fd, (const struct sockaddr *) &link->addr, link->addrlen)) {
+        if (EINPROGRESS != errno) {
+            close(fd);
+            return -1;
+        }
+
+        struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+        int ret;
+        do {
+            ret = poll(&pfd, 1, sending_options.connect_timeout_ms);
+        } while ((-1 == ret) && (EINTR == errno));
+
+        int err = 0;
+        socklen_t errlen = sizeof(err);
+        if ((1 != ret) || (-1 == getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen)) || (0 != err)) {
+            close(fd);
+            errno = (0 == ret) ? ETIMEDOUT : err;
+            return -1;
+        }
+    }
+
+    // nothing has been read from or written to the new connection yet
+    link->control_len = 0;
+    link->written_msgs = 0;
+    link->credit_limit = sending_options.flow_control ? 0 : UINT64_MAX; // until the server's first CREDIT
+    link->credited = false;
+    link->agreed = 0;
+
+    // say which node this is and what it can do before anything else is written
+    if (0 != hello_len) {
+        struct iovec iov = {.iov_base = hello_msg, .iov_len = hello_len};
+        if (!write_all(fd, &iov, 1, NULL)) {
+            close(fd);
+            return -1;
+        }
+    }
+
+    // an older server doesn't reply. It gets plain frames and KEEP_ALIVEs
+    *caps = wanted_caps;
+    if (sending_options.handshake) {
+        if (!await_handshake(link, fd)) {
+            close(fd);
+            return -1;
+        }
+        *caps &= (0 != link->agreed) ? link->agreed : ~(uint32_t) ENCODING_CAPS;
+    }
+
+    // a server which has said it won't grant credit isn't waited for
+    if (!(*caps & CAP_CREDIT)) {
+        link->credit_limit = UINT64_MAX;
+        link->credited = true;
+    }
+
+    return fd;
+}
+
+// closes a broken connection so that the writer reconnects. Call with link->fd_mux locked
+static void drop_connection(Uplink *link) {
+    if (-1 != link->fd)
+        close(link->fd);
+
+    // the writer checks these with the ring locked
+    lock_or_die(&link->ring.mux);
+    link->fd = -1;
+    link->up = false;
+    pthread_cond_signal(&link->ring.not_empty);
+    pthread_mutex_unlock(&link->ring.mux);
+}
+
+// sleeps for ms milliseconds unless the uplink is stopped first
+// returns false if it is stopping
+static bool backoff_wait(Uplink *link, unsigned int ms) {
+    struct timespec deadline = deadline_after(ms);
+
+    lock_or_die(&link->ring.mux);
+    int err = 0;
+    while (!link->stopping && (ETIMEDOUT != err))
+        err = pthread_cond_timedwait(&link->ring.not_empty, &link->ring.mux, &deadline);
+    bool stopping = link->stopping;
+    pthread_mutex_unlock(&link->ring.mux);
+
+    return !stopping;
+}
+
+// reconnect with jittered exponential backoff
+// returns false if the uplink is stopped first
+static bool reconnect_uplink(Uplink *link) {
+    unsigned int delay = sending_options.reconnect_min_ms;
+
+    while (true) {
+        // wait somewhere between delay/2 and delay so that many nodes don't reconnect in lockstep
+        unsigned int wait = (delay / 2) + ((unsigned int) rand_r(&link->seed) % ((delay / 2) + 1));
+        if (!backoff_wait(link, wait))
+            return false;
+
+        uint32_t caps;
+        int fd = open_connection(link, &caps);
+        if (-1 != fd) {
+            lock_or_die(&link->fd_mux);
+            lock_or_die(&link->ring.mux);
+            link->fd = fd;
+            link->caps = caps;
+            pthread_mutex_unlock(&link->ring.mux);
+            pthread_mutex_unlock(&link->fd_mux);
+            atomic_store(&link->healthy, true);
+            return true;
+        }
+
+        delay = (delay > sending_options.reconnect_max_ms / 2) ? sending_options.reconnect_max_ms : delay * 2;
+    }
+}
+
+// sync mode: once everything queued has been replayed, let send_message write directly again
+static void mark_up(Uplink *link) {
+    lock_or_die(&link->fd_mux);
+    lock_or_die(&link->ring.mux);
+    // senders queue with fd_mux locked so nothing can be added after this check
+    if ((NULL == ring_ready(&link->ring, link->ring.head)) && !link->spool_active && (-1 != link->fd))
+        link->up = true;
+    pthread_mutex_unlock(&link->ring.mux);
+    pthread_mutex_unlock(&link->fd_mux);
+}
+
+// takes the next few spooled messages to be written. Returns how many
+static size_t peek_spool(Uplink *link, QueuedFrame *out) {
+    // a batch every 100ms or so
+    size_t max = sending_options.spool_drain_rate / 10;
+    max = (0 == max) ? 1 : ((max > MAX_BATCH) ? MAX_BATCH : max);
+
+    struct iovec iov[MAX_BATCH];
+    lock_or_die(&link->ring.mux);
+    size_t n = spool_peek(link->spool, iov, max);
+    if (0 == n)
+        link->spool_active = false; // drained
+    pthread_mutex_unlock(&link->ring.mux);
+
+    for (size_t i = 0; i < n; i++) {
+        out[i].data = iov[i].iov_base;
+        out[i].len = iov[i].iov_len;
+        out[i].spooled = true;
+    }
+    return n;
+}
+
+// marks spooled messages as sent then waits long enough to keep to spool_drain_rate
+static void consume_spool(Uplink *link, size_t count) {
+    lock_or_die(&link->ring.mux);
+    spool_consume(link->spool, count);
+    if (0 == spool_pending(link->spool))
+        link->spool_active = false;
+    pthread_mutex_unlock(&link->ring.mux);
+
+    backoff_wait(link, (unsigned int) ((count * 1000) / sending_options.spool_drain_rate));
+}
+
+// releases the written frames an ACK for seq covers: those up to the first with a higher number. Frames we didn't
+// number go with the ones around them. Writer thread only
+static void release_acked(Uplink *link, uint64_t seq) {
+    SendRing *ring = &link->ring;
+    size_t count = 0;
+    while ((ring->head + count != ring->sent) && (ring->slots[(ring->head + count) % ring->cap].msg_seq <= seq))
+        count++;
+
+    if (0 != count) {
+        ring_release(ring, count);
+        link->ack_progress_ms = monotonic_ms();
+    }
+}
 
-// locking has to be done first but this will unlock
-static bool send_encoded_message(const char* encoded) {
+// handles the complete control frames in control_buf, leaving any partial one at the start of it
+static void handle_control(Uplink *link) {
+    size_t done = 0; // bytes handled
+    size_t frame_start = 0;
+    int nest = 0; // control frames have no strings with braces in them so counting braces finds the end
+    for (size_t i = 0; i < link->control_len; i++) {
+        char c = link->control_buf[i];
+        if ('{' == c) {
+            if (0 == nest++)
+                frame_start = i;
+        } else if (('}' == c) && (0 != nest) && (0 == --nest)) {
+            MessageRoute route;
+            if (decode_message_route(&link->control_buf[frame_start], i + 1 - frame_start, &route)) {
+                if (ACK == route.type)
+                    release_acked(link, route.seq);
+                else if ((CREDIT == route.type) && (!link->credited || (route.seq > link->credit_limit))) {
+                    link->credit_limit = route.seq;
+                    link->credited = true;
+                } else if ((KEEP_ALIVE == route.type) && (route.caps & CAP_HANDSHAKE))
+                    link->agreed = route.caps;
+            }
+            done = i + 1;
+        } else if (0 == nest) {
+            done = i + 1; // anything between frames is skipped
+        }
+    }
+
+    // far too long for a control frame
+    if ((0 == done) && (sizeof(link->control_buf) == link->control_len))
+        done = link->control_len;
+
+    memmove(link->control_buf, &link->control_buf[done], link->control_len - done);
+    link->control_len -= done;
+}
+
+// reads whatever the server has sent without blocking. Writer thread only
+static void read_control(Uplink *link) {
+    while ((-1 != link->fd) && !link->control_closed) {
+        ssize_t count = read(link->fd, &link->control_buf[link->control_len], sizeof(link->control_buf) - link->control_len);
+        if (count > 0) {
+            link->control_len += (size_t) count;
+            handle_control(link);
+            continue;
+        }
+
+        int e = errno;
+        if ((-1 == count) && (EINTR == e))
+            continue;
+        if ((-1 == count) && ((EAGAIN == e) || (EWOULDBLOCK == e)))
+            return;
+
+        // the server has gone. With acks what it didn't acknowledge is sent again once reconnected
+        if (sending_options.reconnect) {
+            lock_or_die(&link->fd_mux);
+            drop_connection(link);
+            pthread_mutex_unlock(&link->fd_mux);
+        } else {
+            // nothing more will come. Writing fails from now on
+            link->control_closed = true;
+            link->credit_limit = UINT64_MAX;
+        }
+    }
+}
+
+// waits up to HANDSHAKE_WAIT_MS for the server's reply to the hello on a new connection. Anything the server writes
+// after the reply (e.g. the first CREDIT) is handled too. Returns false if the connection broke. Writer thread (or
+// before it starts) only
+static bool await_handshake(Uplink *link, int fd) {
+    int64_t deadline = monotonic_ms() + HANDSHAKE_WAIT_MS;
+    int64_t now;
+    while ((0 == link->agreed) && ((now = monotonic_ms()) < deadline)) {
+        struct pollfd pfd = {.fd = fd, .events = POLLIN};
+        if (poll(&pfd, 1, (int) (deadline - now)) <= 0)
+            continue;
+
+        ssize_t count = read(fd, &link->control_buf[link->control_len], sizeof(link->control_buf) - link->control_len);
+        if (count > 0) {
+            link->control_len += (size_t) count;
+            handle_control(link);
+        } else if ((0 == count) || ((EINTR != errno) && (EAGAIN != errno) && (EWOULDBLOCK != errno))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// the server may have written control frames which haven't been read yet. Closing with them unread resets the
+// connection, which can lose the end of what was written, so stop writing and read until the server closes. Writer
+// thread only
+static void close_control(Uplink *link) {
+    if (0 != shutdown(link->fd, SHUT_WR))
+        return;
+
+    int64_t deadline = monotonic_ms() + CLOSE_WAIT_MS;
+    int64_t now;
+    while ((now = monotonic_ms()) < deadline) {
+        struct pollfd pfd = {.fd = link->fd, .events = POLLIN};
+        if (poll(&pfd, 1, (int) (deadline - now)) <= 0)
+            continue;
+
+        char discard[CONTROL_BUF_LEN];
+        ssize_t count = read(link->fd, discard, sizeof(discard));
+        if ((0 == count) || ((-1 == count) && (EINTR != errno) && (EAGAIN != errno) && (EWOULDBLOCK != errno)))
+            return;
+    }
+}
+
+// writer thread for async or reconnect mode
+static void *writer_thread(void *arg) {
+    Uplink *link = arg;
+    QueuedFrame batch[MAX_BATCH];
+    size_t first = 0; // batch[first..n) is still to be written
+    size_t n = 0;
+    int64_t stalled_since = 0; // when the server's credit ran out (0 while there is some)
+
+    while (true) {
+        if (-1 == link->fd) {
+            if (!reconnect_uplink(link))
+                break; // stopped while disconnected: anything left is dropped
+
+            // start again from the oldest frame which wasn't acknowledged
+            if (sending_options.acks) {
+                first = n;
+                link->ring.sent = link->ring.head;
+            }
+            stalled_since = 0; // open_connection started the rest of the connection's state afresh
+        }
+
+        if (sending_options.acks || sending_options.flow_control)
+            read_control(link);
+
+        if (sending_options.acks) {
+
+            // the server has stopped acknowledging anything
+            if (awaiting_acks(link) && (monotonic_ms() - link->ack_progress_ms > (int64_t) sending_options.ack_timeout_ms)) {
+                puts("Timed out waiting for an ACK");
+                lock_or_die(&link->fd_mux);
+                drop_connection(link);
+                pthread_mutex_unlock(&link->fd_mux);
+            }
+            if (-1 == link->fd)
+                continue;
+        }
+
+        if (first == n) {
+            first = 0;
+            n = ring_pop_batch(link, batch, MAX_BATCH);
+        }
+
+        if ((0 == n) && !(sending_options.async && atomic_load(&link->keep_alive_due))) {
+            if (link->stopping && !awaiting_acks(link))
+                break; // nothing left (the spool is kept for next time)
+            if (link->stopping) {
+                // give the server until ack_timeout_ms to acknowledge the rest
+                struct timespec poll_interval = {.tv_sec = 0, .tv_nsec = CONTROL_POLL_MS * 1000000L};
+                nanosleep(&poll_interval, NULL);
+                continue;
+            }
+            if (link->spool_active && (-1 != link->fd)) {
+                n = peek_spool(link, batch);
+                continue;
+            }
+            if (!sending_options.async && !link->up)
+                mark_up(link);
+            continue;
+        }
+
+        if (-1 == link->fd)
+            continue; // a sender found the connection broken: reconnect first
+
+        // out of credit: wait for the server to grant more. Only KEEP_ALIVEs go out meanwhile
+        size_t count = credit_allows(link, n - first);
+        if ((0 == count) && (first != n)) {
+            if (0 == stalled_since)
+                stalled_since = monotonic_ms();
+            if (!link->credited && (monotonic_ms() - stalled_since > FIRST_CREDIT_WAIT_MS)) {
+                // the server doesn't do flow control
+                link->credit_limit = UINT64_MAX;
+                link->credited = true;
+                continue;
+            }
+            if (link->stopping && (monotonic_ms() - stalled_since > sending_options.send_timeout_ms))
+                break; // anything left is dropped
+            if (atomic_load(&link->keep_alive_due))
+                write_frames(link, NULL, 0);
+            struct pollfd pfd = {.fd = link->fd, .events = POLLIN};
+            poll(&pfd, 1, CONTROL_POLL_MS);
+            continue;
+        }
+        stalled_since = 0;
+
+        size_t written = write_frames(link, &batch[first], count);
+        link->written_msgs += written;
+        if ((0 != written) && batch[first].spooled)
+            consume_spool(link, written);
+        else
+            ring_sent(link, written);
+        first += written;
+
+        if (written != count) {
+            if (sending_options.reconnect) {
+                // keep the rest for after reconnecting
+                lock_or_die(&link->fd_mux);
+                drop_connection(link);
+                pthread_mutex_unlock(&link->fd_mux);
+            } else {
+                // nowhere else for them to go
+                if (!batch[first].spooled)
+                    ring_sent(link, n - first);
+                first = n;
+            }
+        }
+    }
+
+    if ((sending_options.acks || sending_options.flow_control) && (-1 != link->fd) && !link->control_closed)
+        close_control(link);
+
+    // anything left on the ring is freed by ring_destroy
+    return NULL;
+}
+
+// write one message (plus the KEEP_ALIVE if it is due) on the caller's thread
+// in reconnect mode the message is queued for replay if it can't be written
+static bool send_encoded_message(Uplink *link, const char* encoded, size_t len, uint64_t msg_seq) {
     // lock mutex
-    if (-1 == pthread_mutex_lock(&fd_mux)) {
+    if (0 != pthread_mutex_lock(&link->fd_mux)) {
         perror("failed to lock sending mutex");
-        // TODO: memory leak of encoded when this is called from send_message
         return false;
     }
 
     // send the encoded message
-    size_t expected_count = strnlen(encoded, MAX_ENCODED_LEN);
-    ssize_t count = write(sending_fd, encoded, expected_count);
-    const int write_errno = errno; // incase pthread_mutex_unlock changes errno
-    int err = pthread_mutex_unlock(&fd_mux);
+    bool ret = false;
+    QueuedFrame frame = {.data = encoded, .len = len};
+    if (!sending_options.reconnect || link->up) {
+        ret = (1 == write_frames(link, &frame, 1));
+        if (!ret && sending_options.reconnect)
+            drop_connection(link);
+    }
+
+    if (!ret && sending_options.reconnect)
+        ret = queue_frame(link, encoded, len, msg_seq); // for replay
+
+    int err = pthread_mutex_unlock(&link->fd_mux);
     if (0 != err) {
         perror("Couldn't unlock sending mutex");
         exit(EXIT_FAILURE);
     }
-    if (count != (ssize_t) expected_count) {
-        printf("Error writing message to socket. expected_count = %li, count = %li, errno = %i, %s\n",
-            expected_count, count, write_errno, strerror(write_errno));
-        return false;
+
+    return ret;
+}
+
+// sends a KEEP_ALIVE to one server if nothing else has been sent to it recently
+static void keep_alive_uplink(Uplink *link) {
+    // other traffic is keeping the connection alive
+    if (monotonic_seconds() - atomic_load(&link->last_write) < KEEP_ALIVE_INTERVAL)
+        return;
+
+    atomic_store(&link->keep_alive_due, true);
+
+    if (sending_options.async) {
+        // the writer thread owns the socket. Wake it up in case it is idle
+        lock_or_die(&link->ring.mux);
+        pthread_cond_signal(&link->ring.not_empty);
+        pthread_mutex_unlock(&link->ring.mux);
+        return;
     }
 
-    return true;
+    // if a message is being sent right now then the KEEP_ALIVE goes with it
+    if (0 != pthread_mutex_trylock(&link->fd_mux))
+        return;
+
+    // while reconnecting the KEEP_ALIVE waits for the connection to come back
+    if ((!sending_options.reconnect || link->up) && atomic_exchange(&link->keep_alive_due, false)) {
+        struct iovec iov = keep_alive_iov(link);
+        if (!write_all(link->fd, &iov, 1, NULL) && sending_options.reconnect)
+            drop_connection(link);
+    }
+    pthread_mutex_unlock(&link->fd_mux);
 }
 
-// called periodically to send a KEEP_ALIVE message
+// called periodically to send KEEP_ALIVE messages
 static void send_keep_alive(__attribute__((unused)) void *compulsory) {
-    const char* keep_alive_msg = "{\"version\":2,\"data\":{},\"type\":\"KEEP_ALIVE\"}";
+    for (size_t i = 0; i < num_uplinks; i++)
+        keep_alive_uplink(&uplinks[i]);
+}
 
-    send_encoded_message(keep_alive_msg); // unlocks mutex
+// is the type rate limited?
+static bool is_limited(int type) {
+    return (HARD_ERROR_VALVE != type) && (KEEP_ALIVE != type) && (0 != sending_options.rate_limits[type].rate);
+}
+
+// the most tokens a bucket holds
+static double rate_burst(int type) {
+    const RateLimit *limit = &sending_options.rate_limits[type];
+    return (double) ((0 == limit->burst) ? limit->rate : limit->burst);
+}
+
+// takes a token for a message of this type. Returns false (and counts the message) if there isn't one
+static bool take_token(MessageType type) {
+    if ((type < 0) || (type >= INVALID) || !is_limited(type))
+        return true;
+
+    if (0 != pthread_mutex_lock(&bucket_mux)) {
+        perror("failed to lock sending mutex");
+        return true;
+    }
+    TokenBucket *bucket = &buckets[type];
+    double now = monotonic_seconds_frac();
+    bucket->tokens += (now - bucket->last_refill) * (double) sending_options.rate_limits[type].rate;
+    if (bucket->tokens > rate_burst(type))
+        bucket->tokens = rate_burst(type);
+    bucket->last_refill = now;
+
+    bool ret = (bucket->tokens >= 1);
+    if (ret)
+        bucket->tokens -= 1;
+    else if (UINT32_MAX != bucket->suppressed)
+        bucket->suppressed++;
+    pthread_mutex_unlock(&bucket_mux);
+
+    return ret;
 }
 
 bool start_sending(const struct sockaddr *addr, socklen_t addrlen) {
-    // open a socket
-    sending_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (-1 == sending_fd) {
+    SendingOptions opts;
+    default_sending_options(&opts);
+    return start_sending_opts(addr, addrlen, &opts);
+}
+
+bool start_sending_opts(const struct sockaddr *addr, socklen_t addrlen, const SendingOptions *opts) {
+    return start_sending_multi(&addr, &addrlen, 1, opts);
+}
+
+// whether addr is this host, where compressing would only cost time
+static bool is_loopback(const struct sockaddr_storage *addr) {
+    if (AF_INET == addr->ss_family)
+        return 127 == (ntohl(((const struct sockaddr_in *) addr)->sin_addr.s_addr) >> 24);
+    if (AF_INET6 == addr->ss_family) {
+        const struct in6_addr *in6 = &((const struct sockaddr_in6 *) addr)->sin6_addr;
+        return IN6_IS_ADDR_LOOPBACK(in6) || (IN6_IS_ADDR_V4MAPPED(in6) && (127 == in6->s6_addr[12]));
+    }
+    return false;
+}
+
+// connects one uplink and starts its writer. spool_dir may be NULL
+static bool start_uplink(Uplink *link, const struct sockaddr *addr, socklen_t addrlen, const char *spool_dir) {
+    link->fd = -1;
+    pthread_mutex_init(&link->fd_mux, NULL);
+    if ((NULL == addr) || (addrlen > sizeof(link->addr)))
+        return false;
+
+    memcpy(&link->addr, addr, addrlen);
+    link->addrlen = addrlen;
+    link->seed = (unsigned int) time(NULL) ^ (unsigned int) getpid() ^ (unsigned int) (link - uplinks);
+    link->control_len = 0;
+    link->ack_progress_ms = 0;
+    link->written_msgs = 0;
+    link->credit_limit = sending_options.flow_control ? 0 : UINT64_MAX;
+    link->credited = false;
+    link->control_closed = false;
+    link->caps = wanted_caps;
+    link->compress = (COMPRESS_ALWAYS == sending_options.compress) ||
+            ((COMPRESS_AUTO == sending_options.compress) && !is_loopback(&link->addr));
+    atomic_init(&link->keep_alive_due, false);
+    atomic_init(&link->last_write, 0);
+    atomic_init(&link->healthy, !sending_options.lazy_connect);
+
+    // create tcp connection. A lazy uplink is connected by its writer thread
+    if (sending_options.lazy_connect) {
+        link->up = false;
+    } else {
+        link->fd = open_connection(link, &link->caps);
+        // one of several uplinks is left for its writer to connect (see start_sending_multi)
+        if ((-1 == link->fd) && (num_uplinks < 2)) {
+            return false;
+        }
+        link->up = (-1 != link->fd);
+        atomic_store(&link->healthy, link->up);
+    }
+
+    // anything left in the spool from last time is sent before new messages
+    if (NULL != spool_dir) {
+        link->spool = spool_open(spool_dir, sending_options.spool_segment_size, sending_options.spool_max_segments);
+        if (NULL == link->spool)
+            return false;
+        link->spool_active = (0 != spool_pending(link->spool));
+        link->up = link->up && !link->spool_active;
+    }
+
+    // start the writer thread
+    if (sending_options.async || sending_options.reconnect) {
+        if (!ring_init(&link->ring, sending_options.queue_len))
+            return false;
+        link->stopping = false;
+        if (0 != pthread_create(&link->writer, NULL, writer_thread, link))
+            return false;
+        link->writer_running = true;
+    }
+
+    return true;
+}
+
+bool start_sending_multi(const struct sockaddr *const *addrs, const socklen_t *addrlens, size_t count,
+        const SendingOptions *opts) {
+    if ((NULL == opts) || (NULL == addrs) || (NULL == addrlens) || (0 == count) || (NULL != uplinks))
         return false;
+    sending_options = *opts;
+
+    // every uplink has its own queue, and one which is down doesn't stop the others being used
+    if (count > 1) {
+        sending_options.async = true;
+        sending_options.reconnect = true;
+    }
+
+    // the writer thread keeps what hasn't been acknowledged. Failing over would split the numbers between servers
+    if (sending_options.acks) {
+        if (!sending_options.reconnect || (0 == sending_options.ack_timeout_ms) ||
+                ((count > 1) && (UPLINK_FAILOVER == sending_options.uplink_mode)))
+            return false;
+        // the spool deletes messages once written, so it would lose them in the outages acks are for
+        if (NULL != sending_options.spool_dir)
+            return false;
+        sending_options.async = true;
+        sending_options.sequence_numbers = true;
+    }
+
+    // only the writer thread reads the server's credit
+    if (sending_options.flow_control)
+        sending_options.async = true;
+
+    if ((sending_options.async || sending_options.reconnect) && (0 == sending_options.queue_len))
+        return false;
+    if (sending_options.reconnect && ((0 == sending_options.reconnect_min_ms) ||
+            (sending_options.reconnect_max_ms < sending_options.reconnect_min_ms)))
+        return false;
+    if ((NULL != sending_options.spool_dir) && (!sending_options.reconnect || (0 == sending_options.spool_drain_rate)))
+        return false;
+    if ((sending_options.connect_timeout_ms <= 0) || (sending_options.lazy_connect && !sending_options.reconnect))
+        return false;
+    if ((COMPRESS_OFF != sending_options.compress) && (BATCH_NONE == sending_options.batch))
+        return false;
+
+    // several uplinks each have a numbered spool inside spool_dir
+    if ((count > 1) && (NULL != sending_options.spool_dir) && (-1 == mkdir(sending_options.spool_dir, 0700)) &&
+            (EEXIST != errno))
+        return false;
+
+    atomic_store(&next_seq, 1);
+
+    hello_len = 0;
+    wanted_caps = (sending_options.acks ? CAP_ACKS : 0) | (sending_options.flow_control ? CAP_CREDIT : 0) |
+            ((COMPRESS_OFF != sending_options.compress) ? CAP_COMPRESS : 0) |
+            (sending_options.compact_keep_alive ? CAP_COMPACT_KEEP_ALIVE : 0) |
+            ((BATCH_JSON == sending_options.batch) ? CAP_BATCH_JSON : 0) |
+            ((BATCH_BINARY == sending_options.batch) ? CAP_BATCH_BINARY : 0);
+    // without a handshake the server is only told about what it has to know about
+    uint32_t caps = sending_options.handshake ? (wanted_caps | CAP_HANDSHAKE) :
+            (wanted_caps & (CAP_ACKS | CAP_CREDIT | CAP_COMPRESS));
+    if ((0 != sending_options.node_id) || (0 != caps)) {
+        Message hello;
+        keep_alive(&hello);
+        hello.node_id = sending_options.node_id;
+        hello.caps = caps;
+        ssize_t len = encode_message_buf(&hello, hello_msg, sizeof(hello_msg));
+        if (-1 == len)
+            return false;
+        hello_len = (size_t) len;
     }
 
-    // create tcp connection
-    if (-1 == connect(sending_fd, addr, addrlen)) {
+    uplinks = calloc(count, sizeof(Uplink));
+    if (NULL == uplinks)
         return false;
+    num_uplinks = count;
+
+    for (size_t i = 0; i < count; i++) {
+        char spool_dir[PATH_MAX];
+        if (NULL != sending_options.spool_dir) {
+            if (1 == count)
+                snprintf(spool_dir, sizeof(spool_dir), "%s", sending_options.spool_dir);
+            else
+                snprintf(spool_dir, sizeof(spool_dir), "%s/%zu", sending_options.spool_dir, i);
+        }
+
+        if (!start_uplink(&uplinks[i], addrs[i], addrlens[i], (NULL == sending_options.spool_dir) ? NULL : spool_dir)) {
+            num_uplinks = i + 1; // stop_sending cleans up the ones which were started
+            stop_sending();
+            return false;
+        }
+    }
+
+    // there's nowhere for messages to go until one of them is reached
+    if (!sending_options.lazy_connect) {
+        bool connected = false;
+        for (size_t i = 0; i < count; i++)
+            connected |= atomic_load(&uplinks[i].healthy);
+        if (!connected) {
+            stop_sending();
+            return false;
+        }
     }
 
     // periodically send KEEP_ALIVE message
-    return create_timer((timer_handler_t) send_keep_alive, &timer, KEEP_ALIVE_INTERVAL);
+    if (!create_timer((timer_handler_t) send_keep_alive, &timer, KEEP_ALIVE_INTERVAL)) {
+        stop_sending();
+        return false;
+    }
+
+    // buckets start full
+    ticking = (0 != sending_options.coalesce_window);
+    for (int type = 0; type < INVALID; type++) {
+        buckets[type].tokens = rate_burst(type);
+        buckets[type].last_refill = monotonic_seconds_frac();
+        buckets[type].suppressed = 0;
+        ticking |= is_limited(type);
+    }
+
+    // check every second whether the coalescing window has closed or anything was suppressed
+    if (ticking && !create_timer((timer_handler_t) sending_tick, &tick_timer, 1)) {
+        ticking = false;
+        stop_sending();
+        return false;
+    }
+    return true;
 }
 
-bool send_message(const Message *msg) {
+// queue a message on every uplink. Succeeds if at least one of them took it
+static bool mirror_message(const char *encoded, size_t len, uint64_t msg_seq) {
+    bool ret = false;
+    for (size_t i = 0; i < num_uplinks; i++)
+        ret |= queue_frame(&uplinks[i], encoded, len, msg_seq);
+    return ret;
+}
+
+// queue a message on the first uplink which is working
+static bool failover_message(const char *encoded, size_t len, uint64_t msg_seq) {
+    // if none are healthy it waits for the first
+    size_t first = 0;
+    for (size_t i = 0; i < num_uplinks; i++) {
+        if (atomic_load(&uplinks[i].healthy)) {
+            first = i;
+            break;
+        }
+    }
+
+    // if that one's queue is full try the ones after it
+    for (size_t i = first; i < num_uplinks; i++) {
+        if (queue_frame(&uplinks[i], encoded, len, msg_seq))
+            return true;
+    }
+    return false;
+}
+
+// each thread encodes into its own buffer so sending doesn't allocate
+static _Thread_local char encode_buf[MAX_ENCODED_LEN + 1];
+
+// send (or queue) an encoded message on the uplinks. msg_seq is its number if we numbered it, otherwise 0
+static bool route_encoded(const char *encoded, size_t len, uint64_t msg_seq) {
+    if (num_uplinks > 1) {
+        if (UPLINK_FAILOVER == sending_options.uplink_mode)
+            return failover_message(encoded, len, msg_seq);
+        return mirror_message(encoded, len, msg_seq);
+    }
+
+    if (sending_options.async)
+        return queue_frame(&uplinks[0], encoded, len, msg_seq);
+
+    return send_encoded_message(&uplinks[0], encoded, len, msg_seq);
+}
+
+// encode a message and send (or queue) it
+static bool transmit_message(const Message *msg) {
     // msg checked for null in encode_message
+    if (0 == num_uplinks)
+        return false;
+
+    // number our own messages. Producers can race between here and the queue so the server allows for reordering
+    // only these are acknowledged
+    Message numbered;
+    uint64_t msg_seq = 0;
+    if (sending_options.sequence_numbers && (NULL != msg) && (0 == msg->node_id) && (0 == msg->seq)) {
+        numbered = *msg;
+        numbered.seq = atomic_fetch_add(&next_seq, 1);
+        msg_seq = numbered.seq;
+        msg = &numbered;
+    }
 
     // encode the message for transmission
+    ssize_t len = encode_message_buf(msg, encode_buf, sizeof(encode_buf));
+    if (-1 != len)
+        return route_encoded(encode_buf, (size_t) len, msg_seq);
+
+    // too long for the buffer
     char *encoded = NULL;
-    encode_message(msg, &encoded);
-    if (!encoded)
+    if (-1 == encode_message(msg, &encoded))
         return false;
+    bool ret = route_encoded(encoded, strlen(encoded), msg_seq); // encode_message's length is capped at MAX_ENCODED_LEN
+    free(encoded);
+    return ret;
+}
 
-    bool ret = send_encoded_message(encoded);    
+// the text of a message which has one
+static const GString *message_text(const Message *msg) {
+    switch (msg->type) {
+        case HARD_ERROR_VALVE: return msg->data.hardware_valve.message;
+        case HARD_ERROR_OTHER: return msg->data.hardware_other.message;
+        case SOFT_ERROR: return msg->data.software.message;
+        default: return NULL;
+    }
+}
 
-    free(encoded);
+// is msg a repeat of the message which opened the window? Call with coalesce_mux locked
+static bool is_repeat(const Message *msg) {
+    if (!coalescer.active || (msg->type != coalescer.type) || (0 != msg->repeat.count))
+        return false;
+    if ((HARD_ERROR_VALVE == msg->type) && (msg->data.hardware_valve.valve_no != coalescer.valve_no))
+        return false;
+
+    const GString *text = message_text(msg);
+    if ((NULL == text) || (NULL == coalescer.text))
+        return text == coalescer.text;
+    return (text->len == coalescer.text->len) && (0 == memcmp(text->str, coalescer.text->str, text->len));
+}
 
+// closes the window. If repeats were held back during it *summary is set up to report them and true is returned: the
+// caller sends it with send_summary once coalesce_mux is unlocked, so that counting repeats never waits for a write.
+// If there were repeats and keep_open then a new window is started for the same message instead. Call with
+// coalesce_mux locked
+static bool close_window(bool keep_open, Message *summary) {
+    if (!coalescer.active)
+        return false;
+
+    bool repeated = (0 != coalescer.repeat.count);
+    if (repeated) {
+        const char *text = (NULL == coalescer.text) ? NULL : coalescer.text->str;
+        if (HARD_ERROR_VALVE == coalescer.type)
+            hardware_error_valve(summary, coalescer.valve_no, text);
+        else if (HARD_ERROR_OTHER == coalescer.type)
+            hardware_error_other(summary, text);
+        else
+            software_error(summary, text);
+        summary->repeat = coalescer.repeat;
+    }
+
+    // the fault is still happening so keep coalescing it
+    if (repeated && keep_open) {
+        coalescer.window_start = monotonic_seconds();
+        memset(&coalescer.repeat, 0, sizeof(coalescer.repeat));
+        return true;
+    }
+
+    if (NULL != coalescer.text)
+        g_string_free(coalescer.text, true);
+    memset(&coalescer, 0, sizeof(coalescer));
+    return repeated;
+}
+
+// sends and frees a summary from close_window. Call with coalesce_mux unlocked
+static bool send_summary(Message *summary) {
+    bool ret = transmit_message(summary);
+    free_message(summary);
+    return ret;
+}
+
+// opens a window for msg. Call with coalesce_mux locked
+static void open_window(const Message *msg) {
+    const GString *text = message_text(msg);
+
+    coalescer.active = true;
+    coalescer.type = msg->type;
+    coalescer.valve_no = (HARD_ERROR_VALVE == msg->type) ? msg->data.hardware_valve.valve_no : 0;
+    coalescer.text = (NULL == text) ? NULL : g_string_new_len(text->str, (gssize) text->len);
+    coalescer.window_start = monotonic_seconds();
+    memset(&coalescer.repeat, 0, sizeof(coalescer.repeat));
+}
+
+// sends a summary of the messages each rate limit has dropped since the last one
+static void report_suppressed(void) {
+    for (int type = 0; type < INVALID; type++) {
+        if (0 != pthread_mutex_lock(&bucket_mux)) {
+            perror("failed to lock sending mutex");
+            return;
+        }
+        uint32_t suppressed = buckets[type].suppressed;
+        buckets[type].suppressed = 0;
+        pthread_mutex_unlock(&bucket_mux);
+        if (0 == suppressed)
+            continue;
+
+        char text[64];
+        snprintf(text, sizeof(text), "%u %ss suppressed", suppressed, message_type_name((MessageType) type));
+        Message summary;
+        if (HARD_ERROR_OTHER == type)
+            hardware_error_other(&summary, text);
+        else
+            software_error(&summary, text);
+        transmit_message(&summary);
+        free_message(&summary);
+    }
+}
+
+// closes the coalescing window once it has been open for coalesce_window seconds and reports suppressed messages
+static void sending_tick(__attribute__((unused)) void *compulsory) {
+    if (0 != pthread_mutex_lock(&tick_mux)) {
+        perror("failed to lock sending mutex");
+        return;
+    }
+    if (!ticking) {
+        // stop_sending got here first
+        pthread_mutex_unlock(&tick_mux);
+        return;
+    }
+
+    if (0 != sending_options.coalesce_window) {
+        Message summary;
+        bool repeated = false;
+        if (0 != pthread_mutex_lock(&coalesce_mux)) {
+            perror("failed to lock sending mutex");
+            pthread_mutex_unlock(&tick_mux);
+            return;
+        }
+        if (coalescer.active && (monotonic_seconds() - coalescer.window_start >= sending_options.coalesce_window))
+            repeated = close_window(true, &summary);
+        pthread_mutex_unlock(&coalesce_mux);
+        if (repeated)
+            send_summary(&summary);
+    }
+
+    report_suppressed();
+    pthread_mutex_unlock(&tick_mux);
+}
+
+bool send_message(const Message *msg) {
+    // a dropped message still counts as sent: it is reported in the summary
+    if ((NULL != msg) && !take_token(msg->type))
+        return true;
+
+    if ((NULL == msg) || (0 == sending_options.coalesce_window) || (KEEP_ALIVE == msg->type) || (INVALID == msg->type))
+        return transmit_message(msg);
+
+    if (0 != pthread_mutex_lock(&coalesce_mux)) {
+        perror("failed to lock sending mutex");
+        return transmit_message(msg);
+    }
+    if (is_repeat(msg)) {
+        int64_t now = realtime_ms();
+        if (0 == coalescer.repeat.count)
+            coalescer.repeat.first_ms = now;
+        coalescer.repeat.last_ms = now;
+        if (UINT32_MAX != coalescer.repeat.count)
+            coalescer.repeat.count++;
+        pthread_mutex_unlock(&coalesce_mux);
+        return true;
+    }
+
+    // a different message closes the window
+    Message summary;
+    bool repeated = close_window(false, &summary);
+    if (0 == msg->repeat.count)
+        open_window(msg);
+    pthread_mutex_unlock(&coalesce_mux);
+
+    if (repeated)
+        send_summary(&summary);
+    return transmit_message(msg);
+}
+
+bool send_template(const MessageTemplate *tmpl, int valve_no) {
+    if ((NULL == tmpl) || (0 == num_uplinks))
+        return false;
+
+    // coalescing needs to compare whole messages and templates have no slot for the sequence number
+    if ((0 != sending_options.coalesce_window) || sending_options.sequence_numbers) {
+        Message msg;
+        if (!template_message(tmpl, valve_no, &msg))
+            return false;
+        bool ret = send_message(&msg);
+        free_message(&msg);
+        return ret;
+    }
+
+    // a dropped message still counts as sent: it is reported in the summary
+    if (!take_token(template_type(tmpl)))
+        return true;
+
+    ssize_t len = render_template(tmpl, valve_no, encode_buf, sizeof(encode_buf));
+    if (-1 != len)
+        return route_encoded(encode_buf, (size_t) len, 0);
+
+    // too long for the buffer
+    Message msg;
+    if (!template_message(tmpl, valve_no, &msg))
+        return false;
+    bool ret = transmit_message(&msg);
+    free_message(&msg);
     return ret;
 }
 
 void stop_sending(void) {
+    if (NULL == uplinks)
+        return;
     stop_timer(timer);
 
-    assert(0 == pthread_mutex_lock(&fd_mux));
-    if (-1 != sending_fd) {
-        close(sending_fd);
-        sending_fd = -1;
+    // send any repeats still being held back and the last summaries
+    if (ticking) {
+        stop_timer(tick_timer);
+        lock_or_die(&tick_mux);
+        ticking = false;
+        pthread_mutex_unlock(&tick_mux);
+        Message summary;
+        lock_or_die(&coalesce_mux);
+        bool repeated = close_window(false, &summary);
+        pthread_mutex_unlock(&coalesce_mux);
+        if (repeated)
+            send_summary(&summary);
+        report_suppressed();
     }
-    assert(0 == pthread_mutex_unlock(&fd_mux));
-    assert(0 == pthread_mutex_destroy(&fd_mux));
-}
\ No newline at end of file
+
+    for (size_t i = 0; i < num_uplinks; i++) {
+        Uplink *link = &uplinks[i];
+
+        // let the writer finish off what is queued
+        if (link->writer_running) {
+            lock_or_die(&link->ring.mux);
+            link->stopping = true;
+            pthread_cond_signal(&link->ring.not_empty);
+            pthread_mutex_unlock(&link->ring.mux);
+
+            pthread_join(link->writer, NULL);
+            link->writer_running = false;
+        }
+        ring_destroy(&link->ring);
+        free(link->batch_buf);
+        free(link->compressed);
+
+        spool_close(link->spool);
+
+        if (-1 != link->fd)
+            close(link->fd);
+        pthread_mutex_destroy(&link->fd_mux);
+    }
+
+    free(uplinks);
+    uplinks = NULL;
+    num_uplinks = 0;
+}
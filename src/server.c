@@ -25,19 +25,57 @@ Periodically these times are checked against the current time to see if everythi
 #include <fcntl.h>
 #include <pthread.h>
 #include "edsac_representation.h"
+#include "edsac_compress.h"
 #include <errno.h>
+#include <stdatomic.h>
 #include <time.h>
 #include <stdio.h>
 #include <assert.h>
 #include "edsac_timer.h"
 #include <errno.h>
 
+// sequence numbers are checked against the last SEQ_WINDOW received from a sender
+#define SEQ_WINDOW 64
+
+// state for checking one sender's sequence numbers (see check_sequence)
+typedef struct {
+    uint64_t highest; // highest number received, 0 before the first
+    uint64_t window; // bit i is set once highest - i has been received
+    uint64_t complete; // every number up to this has been received or given up on. This is what is acknowledged
+    uint64_t complete_at_tick; // complete at the last tick of the ack timer
+    bool gap_at_tick; // complete was behind highest at the last tick
+    SequenceStats stats;
+} SequenceTracker;
+
+// room for control frames (ACK and CREDIT) the socket couldn't take straight away
+#define MAX_CONTROL_LEN 192
+
 // stores information about an active connection
 typedef struct {
     int fd;
     pthread_mutex_t mutex;
     struct sockaddr_in addr;
     time_t last_keep_alive;
+    uint32_t node_id; // announced by the node when it connected (0 until then)
+    SequenceTracker seq; // for numbered messages from a connection which hasn't announced a node
+    uint32_t caps; // CAP_* agreed when the sender connected: those it announced which ServerOptions.caps allows
+    // acknowledgements (see ServerOptions.ack_every)
+    unsigned int unacked; // numbered messages from the connection's own node since the last ACK
+    uint64_t last_ack; // number in the last ACK written
+    // flow control (see ServerOptions.credit_window)
+    uint64_t received; // messages (not KEEP_ALIVEs) received on this connection
+    uint64_t granted; // the sender may send until it has sent this many
+    char control_out[MAX_CONTROL_LEN]; // control frames the socket had no room for yet
+    size_t control_len;
+    // receive buffer and the state of the framer scanning it
+    struct RecvChunk *chunk;
+    size_t frame_start; // offset in chunk of the frame being scanned
+    size_t scan_pos; // offset in chunk of the next byte to scan
+    int nest_count; // { nesting of the frame being scanned. 0 between frames
+    bool deep; // the frame being scanned nests deeper than a message does, so it may be a batch
+    bool in_binary; // scanning a binary batch (see BatchReader) or COMPRESSED_FRAME rather than a JSON frame
+    bool in_string; // inside a JSON string (so braces don't count)
+    bool escaped; // the previous character was a backslash inside a string
     /* this is a bit of a hack to get around an issue:
     pthreads requires a mutex to be unlocked for it to be destroyed.
     If anything is waiting on it when this unlock occurs (right before destruction) then it gets the lock before the mutex is destroyed
@@ -47,12 +85,28 @@ typedef struct {
 
 // result from reading from a socket (not used externally)
 typedef enum {
-    SUCCESS,
+    SUCCESS, // everything available was read
     ERROR,
-    END
+    END // the remote host closed the connection
 } ReadStatus;
 
+// size of a newly allocated receive buffer
+#define RECV_CHUNK_SIZE 4096
+
+// frames longer than this are treated as an error
+#define MAX_FRAME_LEN 65536
+
+// reference counted receive buffer. The kernel reads straight into data.
+// With borrowed views BufferItems point into data so it lives until the last of them is freed
+struct RecvChunk {
+    atomic_uint refs;
+    size_t len; // how much of data has been filled
+    size_t cap; // size of data
+    char data[];
+};
+
 static void free_connectiondata(ConnectionData *condata);
+static void *report_close(ConnectionData *condata);
 
 // ofsets past REALTIMESIGMIN
 #define CONNECT_SIG 1
@@ -62,16 +116,75 @@ static void free_connectiondata(ConnectionData *condata);
 static GQueue *read_buff = NULL;
 static pthread_mutex_t read_buff_mux = PTHREAD_MUTEX_INITIALIZER;
 
+// items on their way to or waiting in read_buff, and open connections, for sharing out credit
+static atomic_size_t queued_items = 0;
+static atomic_uint num_connections = 0;
+
 // global store of connections
 static pthread_mutex_t connections_mux = PTHREAD_MUTEX_INITIALIZER;
 static GHashTable *connections_table = NULL;
 
+// index of the logical nodes heard from on open connections: node id -> NodeInfo
+// a relay's connection carries many nodes so this is separate from connections_table
+typedef struct {
+    int fd; // connection the node was last heard from
+    struct in_addr address; // the other end of that connection
+    time_t last_seen;
+} NodeInfo;
+
+static pthread_mutex_t nodes_mux = PTHREAD_MUTEX_INITIALIZER;
+static GHashTable *nodes_table = NULL;
+
+// node id -> SequenceTracker. Kept when the node disconnects so that messages lost across a reconnect are counted.
+// Protected by nodes_mux, as are the connections' trackers and seq_totals
+static GHashTable *seq_table = NULL;
+static SequenceStats seq_totals;
+
 // the listening socket
 static int listen_socket = -1;
 
 // the timer id
 timer_t timer_id;
 
+// flushes acknowledgements and tops up credit (see ServerOptions.ack_every and credit_window)
+static timer_t control_timer;
+static bool control_timer_running = false;
+
+// options the server was started with
+static ServerOptions server_options;
+
+// decode pipeline (see ServerOptions.decode_workers)
+// frames go onto decode_queue in the order they were read. Each is given the next sequence number when a worker takes it
+// decoded items wait in reorder until every earlier item has been moved to read_buff
+static GQueue *decode_queue = NULL;
+static pthread_mutex_t decode_mux = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t decode_cond = PTHREAD_COND_INITIALIZER;
+static uint64_t next_decode_seq = 0; // sequence number of the next item taken off decode_queue
+static bool decode_stop = false;
+static GHashTable *reorder = NULL; // sequence number -> decoded BufferItem
+static pthread_mutex_t reorder_mux = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t next_merge_seq = 0; // sequence number of the next item to go into read_buff
+static pthread_t *decode_threads = NULL;
+static unsigned int num_decode_threads = 0;
+
+// allocate an empty receive buffer with one reference
+static struct RecvChunk *alloc_chunk(size_t cap) {
+    struct RecvChunk *chunk = malloc(sizeof(struct RecvChunk) + cap);
+    if (NULL == chunk)
+        return NULL;
+
+    atomic_init(&chunk->refs, 1);
+    chunk->len = 0;
+    chunk->cap = cap;
+    return chunk;
+}
+
+// drop a reference to a receive buffer
+static void release_chunk(struct RecvChunk *chunk) {
+    if ((NULL != chunk) && (1 == atomic_fetch_sub(&chunk->refs, 1)))
+        free(chunk);
+}
+
 // helper for get_connected_list
 static void list_ip_addrs(__attribute__((unused)) gpointer key, gpointer value, gpointer user_data) {
     assert(NULL != value);
@@ -91,13 +204,387 @@ static void list_ip_addrs(__attribute__((unused)) gpointer key, gpointer value,
 GSList *get_connected_list(void) {
     GSList *ret = NULL;
 
-    assert(0 == pthread_mutex_lock(&connections_mux));
+    if (0 != pthread_mutex_lock(&connections_mux)) {
+        perror("could not lock connections_mux");
+        return NULL;
+    }
     g_hash_table_foreach(connections_table, (GHFunc) list_ip_addrs, &ret);
-    assert(0 == pthread_mutex_unlock(&connections_mux));
+    pthread_mutex_unlock(&connections_mux);
+
+    return ret;
+}
+
+// record that node_id was heard from on a connection
+static void note_node(const ConnectionData *condata, uint32_t node_id) {
+    if (0 != pthread_mutex_lock(&nodes_mux)) {
+        perror("could not lock nodes_mux");
+        return;
+    }
+    NodeInfo *info = g_hash_table_lookup(nodes_table, GUINT_TO_POINTER(node_id));
+    if (NULL == info) {
+        info = malloc(sizeof(NodeInfo));
+        if (NULL != info)
+            g_hash_table_insert(nodes_table, GUINT_TO_POINTER(node_id), info);
+    }
+    if (NULL != info) {
+        info->fd = condata->fd;
+        info->address = condata->addr.sin_addr;
+        info->last_seen = time(NULL);
+    }
+    pthread_mutex_unlock(&nodes_mux);
+}
+
+// helper for forget_nodes
+static gboolean node_on_fd(__attribute__((unused)) gpointer key, gpointer value, gpointer user_data) {
+    return ((NodeInfo *) value)->fd == *(int *) user_data;
+}
+
+// remove the nodes last heard from on a connection which is closing
+static void forget_nodes(int fd) {
+    if (0 != pthread_mutex_lock(&nodes_mux)) {
+        perror("could not lock nodes_mux");
+        return;
+    }
+    g_hash_table_foreach_remove(nodes_table, node_on_fd, &fd);
+    pthread_mutex_unlock(&nodes_mux);
+}
+
+// helper for get_connected_nodes
+static void list_node_ids(gpointer key, __attribute__((unused)) gpointer value, gpointer user_data) {
+    GSList **list = user_data;
+    *list = g_slist_prepend(*list, key);
+}
+
+// returns a list of the node ids heard from on the open connections
+GSList *get_connected_nodes(void) {
+    GSList *ret = NULL;
+
+    if (0 != pthread_mutex_lock(&nodes_mux)) {
+        perror("could not lock nodes_mux");
+        return NULL;
+    }
+    if (NULL != nodes_table)
+        g_hash_table_foreach(nodes_table, list_node_ids, &ret);
+    pthread_mutex_unlock(&nodes_mux);
+
+    return ret;
+}
+
+// looks up the address of the connection a node was last heard from on
+bool get_node_address(uint32_t node_id, struct in_addr *address) {
+    if (NULL == address)
+        return false;
+
+    if (0 != pthread_mutex_lock(&nodes_mux)) {
+        perror("could not lock nodes_mux");
+        return false;
+    }
+    NodeInfo *info = (NULL == nodes_table) ? NULL : g_hash_table_lookup(nodes_table, GUINT_TO_POINTER(node_id));
+    if (NULL != info)
+        *address = info->address;
+    pthread_mutex_unlock(&nodes_mux);
+
+    return NULL != info;
+}
+
+// moves complete up past everything which has been received. Numbers which have left the window are given up on
+static void advance_complete(SequenceTracker *tracker) {
+    if (tracker->highest - tracker->complete > SEQ_WINDOW)
+        tracker->complete = tracker->highest - SEQ_WINDOW;
+    while ((tracker->complete < tracker->highest) &&
+            (tracker->window & ((uint64_t) 1 << (tracker->highest - tracker->complete - 1))))
+        tracker->complete++;
+}
+
+// checks one sequence number against what has been received from its sender so far, in constant time.
+// Returns false if it is a duplicate. Call with nodes_mux locked
+static bool check_sequence(SequenceTracker *tracker, uint64_t seq) {
+    SequenceStats *stats = &tracker->stats;
+    SequenceStats before = *stats;
+    bool ret = true;
+
+    // the sender has been restarted
+    if ((1 == seq) && (tracker->highest > 1)) {
+        tracker->highest = 0;
+        tracker->window = 0;
+        stats->restarts++;
+    }
+
+    if (seq > tracker->highest) {
+        // numbers skipped over are lost unless they turn up later. Nothing is known before the first
+        if (0 != tracker->highest)
+            stats->lost += seq - tracker->highest - 1;
+        else
+            tracker->complete = seq - 1;
+        uint64_t shift = seq - tracker->highest;
+        tracker->window = (shift >= SEQ_WINDOW) ? 0 : tracker->window << shift;
+        tracker->window |= 1;
+        tracker->highest = seq;
+        stats->received++;
+    } else {
+        uint64_t age = tracker->highest - seq;
+        if ((age >= SEQ_WINDOW) || (tracker->window & ((uint64_t) 1 << age))) {
+            stats->duplicates++;
+            ret = false;
+        } else {
+            tracker->window |= (uint64_t) 1 << age;
+            stats->reordered++;
+            if (0 != stats->lost)
+                stats->lost--;
+            stats->received++;
+        }
+    }
+
+    if (ret)
+        advance_complete(tracker);
+
+    // unsigned arithmetic handles lost going down
+    seq_totals.received += stats->received - before.received;
+    seq_totals.lost += stats->lost - before.lost;
+    seq_totals.reordered += stats->reordered - before.reordered;
+    seq_totals.duplicates += stats->duplicates - before.duplicates;
+    seq_totals.restarts += stats->restarts - before.restarts;
+    return ret;
+}
+
+// the tracker for a node's sequence numbers, created if needed. Call with nodes_mux locked. NULL if out of memory
+static SequenceTracker *node_tracker(uint32_t node_id, bool create) {
+    SequenceTracker *tracker = g_hash_table_lookup(seq_table, GUINT_TO_POINTER(node_id));
+    if ((NULL == tracker) && create) {
+        tracker = calloc(1, sizeof(SequenceTracker));
+        if (NULL != tracker)
+            g_hash_table_insert(seq_table, GUINT_TO_POINTER(node_id), tracker);
+    }
+    return tracker;
+}
+
+// the tracker for the messages a connection sends for its own node. Call with nodes_mux locked. NULL if there is none
+static SequenceTracker *connection_tracker(ConnectionData *condata) {
+    return (0 == condata->node_id) ? &condata->seq : node_tracker(condata->node_id, false);
+}
+
+// checks the sequence number of a message from node_id (0 for the connection itself) received on condata.
+// Returns false if it is a duplicate
+static bool check_item_sequence(ConnectionData *condata, uint32_t node_id, uint64_t seq) {
+    if (0 != pthread_mutex_lock(&nodes_mux)) {
+        perror("could not lock nodes_mux");
+        return true;
+    }
+    SequenceTracker *tracker = (0 == node_id) ? &condata->seq : node_tracker(node_id, true);
+    bool ret = (NULL == tracker) || check_sequence(tracker, seq);
+    pthread_mutex_unlock(&nodes_mux);
+    return ret;
+}
+
+void get_sequence_stats(SequenceStats *stats) {
+    if (NULL == stats)
+        return;
+
+    if (0 != pthread_mutex_lock(&nodes_mux)) {
+        perror("could not lock nodes_mux");
+        memset(stats, 0, sizeof(*stats));
+        return;
+    }
+    *stats = seq_totals;
+    pthread_mutex_unlock(&nodes_mux);
+}
+
+bool get_node_sequence_stats(uint32_t node_id, SequenceStats *stats) {
+    if (NULL == stats)
+        return false;
+
+    if (0 != pthread_mutex_lock(&nodes_mux)) {
+        perror("could not lock nodes_mux");
+        return false;
+    }
+    SequenceTracker *tracker = (NULL == seq_table) ? NULL : node_tracker(node_id, false);
+    if (NULL != tracker)
+        *stats = tracker->stats;
+    pthread_mutex_unlock(&nodes_mux);
+
+    return NULL != tracker;
+}
+
+// helper for get_connection_stats. Call with nodes_mux locked
+static void list_connection_stats(__attribute__((unused)) gpointer key, gpointer value, gpointer user_data) {
+    ConnectionData *condata = value;
+    GSList **list = user_data;
+
+    ConnectionStats *stats = calloc(1, sizeof(ConnectionStats));
+    assert(NULL != stats);
+    stats->addr = condata->addr;
+    stats->node_id = condata->node_id;
+    const SequenceTracker *tracker = connection_tracker(condata);
+    if (NULL != tracker)
+        stats->seq = tracker->stats;
+
+    *list = g_slist_prepend(*list, stats);
+}
+
+GSList *get_connection_stats(void) {
+    GSList *ret = NULL;
+
+    if (0 != pthread_mutex_lock(&connections_mux)) {
+        perror("could not lock connections_mux");
+        return NULL;
+    }
+    if (0 != pthread_mutex_lock(&nodes_mux)) {
+        perror("could not lock nodes_mux");
+        pthread_mutex_unlock(&connections_mux);
+        return NULL;
+    }
+    g_hash_table_foreach(connections_table, list_connection_stats, &ret);
+    pthread_mutex_unlock(&nodes_mux);
+    pthread_mutex_unlock(&connections_mux);
 
     return ret;
 }
 
+// writes as much of the waiting control frames as the socket will take without blocking
+static void write_control(ConnectionData *condata) {
+    while (0 != condata->control_len) {
+        // MSG_NOSIGNAL: a closed connection is an error not a SIGPIPE
+        ssize_t count = send(condata->fd, condata->control_out, condata->control_len, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if ((-1 == count) && (EINTR == errno))
+            continue;
+        if (count <= 0)
+            return; // the sender isn't reading: try again next time
+
+        condata->control_len -= (size_t) count;
+        memmove(condata->control_out, condata->control_out + count, condata->control_len);
+    }
+}
+
+// sends a control frame to the sender without blocking. Returns false if there was no room to keep it until the socket
+// can take it. Call with condata->mutex locked
+static bool send_control(ConnectionData *condata, const Message *msg) {
+    write_control(condata);
+    ssize_t len = encode_message_buf(msg, condata->control_out + condata->control_len,
+            sizeof(condata->control_out) - condata->control_len);
+    if (-1 == len)
+        return false;
+
+    condata->control_len += (size_t) len;
+    write_control(condata);
+    return true;
+}
+
+// acknowledges everything complete in the sequence of the connection's own node, if that has moved on since the
+// last ACK. Call with condata->mutex locked
+static void send_ack(ConnectionData *condata) {
+    condata->unacked = 0;
+
+    if (0 != pthread_mutex_lock(&nodes_mux)) {
+        perror("could not lock nodes_mux");
+        return;
+    }
+    const SequenceTracker *tracker = connection_tracker(condata);
+    uint64_t complete = (NULL == tracker) ? 0 : tracker->complete;
+    pthread_mutex_unlock(&nodes_mux);
+    if ((0 == complete) || (complete == condata->last_ack))
+        return;
+
+    Message ack;
+    ack_message(&ack, complete);
+    if (send_control(condata, &ack))
+        condata->last_ack = complete;
+}
+
+// replies to a sender's hello with the CAP_* agreed to. Call with condata->mutex locked
+static void send_handshake(ConnectionData *condata) {
+    Message reply;
+    keep_alive(&reply);
+    reply.caps = condata->caps;
+    send_control(condata, &reply);
+}
+
+// grants the sender more credit once it has used half of what it had, if the read queue has room for it.
+// Call with condata->mutex locked
+static void grant_credit(ConnectionData *condata) {
+    uint64_t window = server_options.credit_window;
+    if ((condata->granted > condata->received) && (condata->granted - condata->received > window / 2))
+        return;
+
+    // everything below the limit is shared between the connections
+    size_t queued = atomic_load(&queued_items);
+    unsigned int connections = atomic_load(&num_connections);
+    size_t room = (queued >= server_options.read_queue_limit) ? 0 : server_options.read_queue_limit - queued;
+    room /= (0 == connections) ? 1 : connections;
+    if (room < window)
+        window = room;
+
+    uint64_t granted = condata->received + window;
+    if ((0 == window) || (granted <= condata->granted))
+        return;
+
+    Message credit;
+    credit_message(&credit, granted);
+    if (send_control(condata, &credit))
+        condata->granted = granted;
+}
+
+// gives up on the first gap in a sequence if it has been open since the last tick, so that a message which was never
+// sent can't hold acknowledgements back for ever. Call with nodes_mux locked
+static void tick_sequence(SequenceTracker *tracker) {
+    if (tracker->gap_at_tick && (tracker->complete == tracker->complete_at_tick) &&
+            (tracker->complete < tracker->highest)) {
+        tracker->complete++;
+        advance_complete(tracker);
+    }
+    tracker->gap_at_tick = (tracker->complete < tracker->highest);
+    tracker->complete_at_tick = tracker->complete;
+}
+
+// helper for flush_control
+static void flush_connection(__attribute__((unused)) gpointer key, gpointer value,
+        __attribute__((unused)) gpointer user_data) {
+    ConnectionData *condata = value;
+
+    // a connection which is being read from sends its own control frames
+    if (0 != pthread_mutex_trylock(&(condata->mutex)))
+        return;
+    if (condata->destroyed)
+        return;
+
+    if ((0 != server_options.ack_every) && (condata->caps & CAP_ACKS)) {
+        if (0 != pthread_mutex_lock(&nodes_mux)) {
+            perror("could not lock nodes_mux");
+        } else {
+            SequenceTracker *tracker = connection_tracker(condata);
+            if (NULL != tracker)
+                tick_sequence(tracker);
+            pthread_mutex_unlock(&nodes_mux);
+            send_ack(condata);
+        }
+    }
+
+    // senders which were paused get going again once read_message has made room
+    if ((0 != server_options.credit_window) && (condata->caps & CAP_CREDIT))
+        grant_credit(condata);
+
+    write_control(condata);
+    pthread_mutex_unlock(&(condata->mutex));
+}
+
+// called every ack_interval_ms to acknowledge what has arrived since the last ACK and top up credit
+static void flush_control(__attribute__((unused)) void *compulsory) {
+    // io_handler must not interrupt this thread while it holds a connection
+    sigset_t mask, old_mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGRTMIN + READ_SIG);
+    sigaddset(&mask, SIGRTMIN + CONNECT_SIG);
+    pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+
+    // like iter_keep_alives it doesn't matter if this is skipped every so often
+    if (0 == pthread_mutex_trylock(&connections_mux)) {
+        if (NULL != connections_table)
+            g_hash_table_foreach(connections_table, flush_connection, NULL);
+        pthread_mutex_unlock(&connections_mux);
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+}
+
 // sets up a fd for realtime signal IO using signal sig, handled by handler
 static bool setup_rt_signal_io(int fd, int sig, void (*handler)(int, siginfo_t *, void *)) {
     // establish signal handler for new connections
@@ -129,126 +616,380 @@ static bool setup_rt_signal_io(int fd, int sig, void (*handler)(int, siginfo_t *
     return true;
 }
 
-// attempt to read a full json object from a fd (defined as "{*}", handling nesting)
-static ReadStatus read_json_object(int fd, GString **out_string) {
-    // assuming that we can read the whole thing at once
+// whether part of a frame has been scanned but not the end of it
+static bool in_frame(const ConnectionData *condata) {
+    return (0 != condata->nest_count) || condata->in_binary;
+}
+
+// make sure there is space to read into condata->chunk
+// a partially received frame is carried over when a new buffer is needed
+static bool reserve_chunk(ConnectionData *condata) {
+    struct RecvChunk *chunk = condata->chunk;
+    if ((NULL != chunk) && (chunk->len < chunk->cap))
+        return true;
+
+    // everything before keep_from has been framed already
+    size_t keep_from = 0;
+    size_t keep = 0;
+    if (NULL != chunk) {
+        keep_from = in_frame(condata) ? condata->frame_start : chunk->len;
+        keep = chunk->len - keep_from;
+    }
+    if (keep >= MAX_FRAME_LEN) {
+        puts("frame too long");
+        return false;
+    }
 
-    GString *string = g_string_new("{");
+    size_t cap = RECV_CHUNK_SIZE;
+    while (cap < 2 * keep)
+        cap *= 2;
+
+    if ((NULL != chunk) && (1 == atomic_load(&chunk->refs)) && (cap <= chunk->cap)) {
+        // nothing else is looking at this buffer so reuse it
+        memmove(chunk->data, chunk->data + keep_from, keep);
+        chunk->len = keep;
+    } else {
+        struct RecvChunk *new_chunk = alloc_chunk(cap);
+        if (NULL == new_chunk)
+            return false;
+        if (NULL != chunk)
+            memcpy(new_chunk->data, chunk->data + keep_from, keep);
+        new_chunk->len = keep;
+        release_chunk(chunk);
+        condata->chunk = new_chunk;
+    }
 
-    // read first character
-    char buf;
-    ssize_t num_read = read(fd, &buf, 1);
-    if (1 != num_read) { // we could not read a whole character
-        int e = errno;
-        g_string_free(string, true);
+    condata->scan_pos -= keep_from;
+    condata->frame_start = in_frame(condata) ? condata->frame_start - keep_from : 0;
+    return true;
+}
 
-        // if it looks like there just wasn't any data left in the buffer for us to read
-        if ((EBADF == e) || (EAGAIN == e) || (EWOULDBLOCK == e) || (0 == num_read)) {
-            return END;
+// decode the body of a frame held by item->raw
+// with lazy decoding this happens in read_message so that it runs on the consumer's thread
+static void finish_decode(BufferItem *item) {
+    if (NULL == item->raw)
+        return;
+
+    // the frame holds a reference to its receive buffer. Only borrowed text keeps it
+    struct RecvChunk *chunk = item->chunk;
+    item->chunk = NULL;
+
+    bool decoded;
+    if (server_options.borrowed_views) {
+        // the text stays in the receive buffer
+        decoded = item->agreed ? decode_agreed_message_inplace(item->raw, item->raw_len, &(item->msg), &(item->text)) :
+                decode_message_inplace(item->raw, item->raw_len, &(item->msg), &(item->text));
+        if (decoded && (NULL != item->text)) {
+            item->chunk = chunk;
+            chunk = NULL;
         }
-        
-        // there may have been data but an unknown error occured
-        printf("Unknown error errno=%s num_read=%li\n", strerror(e), num_read);
-        return ERROR;
+    } else {
+        GString *obj = g_string_new_len(item->raw, (gssize) item->raw_len);
+        decoded = item->agreed ? decode_agreed_message(obj->str, &(item->msg)) : decode_message(obj->str, &(item->msg));
+        g_string_free(obj, true);
     }
 
-    // the first character must be {
-    if (buf != '{') {
-        g_string_free(string, true);
+    if (!decoded) {
+        printf("decode error on: %.*s\n", (int) item->raw_len, item->raw);
+        // report this BufferItem as a software error
+        item->text = NULL;
+        software_error(&(item->msg), "Could not decode message");
+    }
+
+    // a relay passes on the address of the node the message came from
+    if (server_options.relayed_origins && (INADDR_ANY != item->msg.origin.s_addr))
+        item->address = item->msg.origin;
+
+    item->raw = NULL;
+    item->raw_len = 0;
+    release_chunk(chunk);
+}
 
-        // skip newline characters so we can telnet in for testing
-        if ((buf == '\n') || (buf == 13 /*CR*/)) { 
-            puts("newline");
-            return read_json_object(fd, out_string);
+// turn one complete frame, held in chunk, into a BufferItem
+// returns NULL if there is nothing to queue (KEEP_ALIVE or out of memory)
+static BufferItem *frame_to_item(ConnectionData *condata, struct RecvChunk *chunk, char *frame, size_t len) {
+    // the item we will add to the buffer for this frame
+    BufferItem *item = malloc(sizeof(BufferItem));
+    if (NULL == item) {
+        return NULL;
+    }
+    memset(&(item->msg), 0, sizeof(item->msg));
+    item->text = NULL;
+    item->raw = frame;
+    item->raw_len = len;
+    item->agreed = (0 != (condata->caps & CAP_HANDSHAKE)); // after the hello, which is checked as usual
+    atomic_fetch_add(&chunk->refs, 1);
+    item->chunk = chunk;
+    item->address = condata->addr.sin_addr; // decoding may replace it with a relayed origin
+
+    if (server_options.lazy_decode || (0 != server_options.decode_workers)) {
+        // only work out enough to route the frame: the body is decoded by a decode worker or read_message
+        MessageRoute route;
+        if (item->agreed ? decode_agreed_message_route(frame, len, &route) : decode_message_route(frame, len, &route)) {
+            item->msg.type = route.type;
+            item->msg.node_id = route.node_id;
+            item->msg.seq = route.seq;
+            item->msg.caps = route.caps;
+        } else {
+            finish_decode(item); // reports the error
         }
+    } else {
+        finish_decode(item);
+    }
 
-        printf("invalid c=%i\n", (int) buf);
-        return ERROR;
+    // a node announces itself and what it can handle with a KEEP_ALIVE when it connects. Other messages may carry
+    // the node they are from (e.g. through a relay) and otherwise come from the connection's node
+    uint32_t node_id = item->msg.node_id;
+    if ((KEEP_ALIVE == item->msg.type) && (0 != node_id))
+        condata->node_id = node_id;
+    if ((KEEP_ALIVE == item->msg.type) && (0 != item->msg.caps)) {
+        condata->caps = item->msg.caps & (server_options.caps | CAP_HANDSHAKE);
+        // the reply goes first so that a sender which waits for it doesn't have to look past anything else
+        if (condata->caps & CAP_HANDSHAKE)
+            send_handshake(condata);
+        // the sender's first credit
+        if ((0 != server_options.credit_window) && (condata->caps & CAP_CREDIT))
+            grant_credit(condata);
+    }
+    item->node_id = (0 != node_id) ? node_id : condata->node_id;
+    if (0 != item->node_id)
+        note_node(condata, item->node_id);
+
+    // everything but a KEEP_ALIVE uses up credit, duplicates included. Senders which don't read CREDIT get none
+    bool credit = (0 != server_options.credit_window) && (condata->caps & CAP_CREDIT);
+    if (credit && (KEEP_ALIVE != item->msg.type))
+        condata->received++;
+
+    // numbered messages are checked for gaps and duplicates
+    if (0 != item->msg.seq) {
+        bool fresh = check_item_sequence(condata, item->node_id, item->msg.seq);
+
+        // duplicates count towards the next ACK too: the sender may be resending because it missed the last one
+        if ((0 != server_options.ack_every) && (condata->caps & CAP_ACKS) && (item->node_id == condata->node_id) &&
+                (++condata->unacked >= server_options.ack_every))
+            send_ack(condata);
+
+        if (!fresh) {
+            free_bufferitem(item);
+            return NULL;
+        }
     }
 
-    // read in the rest
-    int nest_count = 1; // we already have {
-    while (true) {
-        // try to read 1 character
-        num_read = read(fd, &buf, 1);
-        if (1 != num_read) {
-            int e = errno;
-            g_string_free(string, true);
-
-            // if we reached the end of the buffer
-            if ((EAGAIN == e) || (EWOULDBLOCK == e) || (0 == num_read)) {
-                puts("partial packet!");
+    // KEEP_ALIVEs only exist to update last_keep_alive (see extract_frames). ACKs only go the other way
+    if ((KEEP_ALIVE == item->msg.type) || (ACK == item->msg.type)) {
+        free_bufferitem(item);
+        return NULL;
+    }
+
+    // "real" messages. They count against the read queue limit from now, before the rest of the read is queued
+    item->recv_time = time(NULL);
+    atomic_fetch_add(&queued_items, 1);
+    if (credit)
+        grant_credit(condata);
+    return item;
+}
+
+// a BufferItem for each message in a batch frame held in chunk is added to items
+// returns false if the batch was malformed (the messages before the problem are still added)
+static bool unpack_batch(ConnectionData *condata, struct RecvChunk *chunk, BatchReader *reader, GQueue *items) {
+    const char *msg;
+    size_t len;
+    while (batch_next(reader, &msg, &len)) {
+        // the batch is in one of our buffers so casting away the reader's const is fine
+        BufferItem *item = frame_to_item(condata, chunk, (char *) msg, len);
+        if (NULL != item)
+            g_queue_push_tail(items, item);
+    }
+    return !reader->error;
+}
+
+// a compressed frame expands into a buffer of its own, which its items hold references to like the receive buffer.
+// It has to expand to a batch. Returns false if it doesn't or the sender didn't say it would compress
+static bool unpack_compressed(ConnectionData *condata, const char *frame, size_t len, GQueue *items) {
+    if (!(condata->caps & CAP_COMPRESS))
+        return false;
+
+    const unsigned char *header = (const unsigned char *) frame;
+    size_t expanded_len = ((size_t) header[3] << 8) | header[4];
+    struct RecvChunk *chunk = alloc_chunk(expanded_len);
+    if (NULL == chunk)
+        return false;
+
+    bool ok = decompress_block(frame + COMPRESSED_FRAME_HEADER_LEN, len - COMPRESSED_FRAME_HEADER_LEN, chunk->data,
+            expanded_len);
+    if (ok) {
+        chunk->len = expanded_len;
+        BatchReader reader;
+        ok = binary_batch_begin(chunk->data, expanded_len, &reader) || batch_begin(chunk->data, expanded_len, &reader);
+        ok = ok && unpack_batch(condata, chunk, &reader, items);
+    }
+
+    release_chunk(chunk);
+    return ok;
+}
+
+// a binary frame (a binary batch or a compressed frame) is complete once its header and everything the length in it
+// counts have arrived. Returns false if more has to be read first
+static bool binary_frame_ready(const ConnectionData *condata, size_t *frame_len) {
+    const struct RecvChunk *chunk = condata->chunk;
+    size_t have = chunk->len - condata->frame_start;
+    const unsigned char *header = (const unsigned char *) chunk->data + condata->frame_start;
+    size_t header_len = (BINARY_BATCH == header[0]) ? BINARY_BATCH_HEADER_LEN : COMPRESSED_FRAME_HEADER_LEN;
+    if (have < header_len)
+        return false;
+
+    *frame_len = header_len + (((size_t) header[1] << 8) | header[2]);
+    return have >= *frame_len;
+}
+
+// scan newly read bytes for complete json objects (defined as "{*}", handling nesting and strings) and binary batches
+// a BufferItem for each message in a complete frame is added to items
+static ReadStatus extract_frames(ConnectionData *condata, GQueue *items) {
+    struct RecvChunk *chunk = condata->chunk;
+    bool got_frame = false;
+
+    while (condata->scan_pos < chunk->len) {
+        // binary frames say how long they are so there is nothing to scan
+        if (condata->in_binary) {
+            size_t frame_len;
+            if (!binary_frame_ready(condata, &frame_len)) {
+                condata->scan_pos = chunk->len;
+                break;
+            }
+
+            BatchReader reader;
+            char *frame = chunk->data + condata->frame_start;
+            if (COMPRESSED_FRAME == frame[0]) {
+                if (!unpack_compressed(condata, frame, frame_len, items)) {
+                    puts("invalid compressed frame");
+                    return ERROR;
+                }
+            } else if (!binary_batch_begin(frame, frame_len, &reader) ||
+                    !unpack_batch(condata, chunk, &reader, items)) {
+                puts("invalid binary batch");
                 return ERROR;
+            }
+            got_frame = true;
+            condata->in_binary = false;
+            condata->scan_pos = condata->frame_start + frame_len;
+            continue;
+        }
+
+        char c = chunk->data[condata->scan_pos++];
+
+        // between frames
+        if (0 == condata->nest_count) {
+            if ('{' == c) {
+                condata->frame_start = condata->scan_pos - 1;
+                condata->nest_count = 1;
+                condata->deep = false;
+                condata->in_string = false;
+                condata->escaped = false;
+            } else if ((BINARY_BATCH == c) || (COMPRESSED_FRAME == c)) {
+                condata->frame_start = condata->scan_pos - 1;
+                condata->in_binary = true;
+            } else if (COMPACT_KEEP_ALIVE == c) {
+                // nothing to decode: it only updates last_keep_alive
+                got_frame = true;
+            } else if ((c == '\n') || (c == 13 /*CR*/)) {
+                // skip newline characters so we can telnet in for testing
             } else {
-                // unknown error
-                printf("errno=%s. num_read=%li\n", strerror(e), num_read);
+                printf("invalid c=%i\n", (int) c);
                 return ERROR;
             }
+            continue;
         }
 
-        // we did read in a character successfully...
-        
-        // nesting count
-        if ('{' == buf)
-            nest_count += 1;
-        else if ('}' == buf)
-            nest_count -= 1;
+        // braces inside strings don't count towards nesting
+        if (condata->in_string) {
+            if (condata->escaped)
+                condata->escaped = false;
+            else if ('\\' == c)
+                condata->escaped = true;
+            else if ('"' == c)
+                condata->in_string = false;
+            continue;
+        }
 
-        // add the character to the string
-        string = g_string_append_c(string, buf);
+        if ('"' == c) {
+            condata->in_string = true;
+        } else if ('{' == c) {
+            // a message's objects are only ever inside its top level object. Those of a batch are inside its array
+            if (++condata->nest_count > 2)
+                condata->deep = true;
+        } else if ('}' == c) {
+            condata->nest_count -= 1;
+        }
 
         // are we done?
-        if (0 == nest_count)
-            break;
+        if (0 == condata->nest_count) {
+            got_frame = true;
+            char *frame = chunk->data + condata->frame_start;
+            size_t len = condata->scan_pos - condata->frame_start;
+
+            BatchReader reader;
+            if (condata->deep && batch_begin(frame, len, &reader)) {
+                if (!unpack_batch(condata, chunk, &reader, items))
+                    puts("invalid batch");
+                continue;
+            }
+
+            // anything which isn't a batch is decoded (or reported) as a message
+            BufferItem *item = frame_to_item(condata, chunk, frame, len);
+            if (NULL != item)
+                g_queue_push_tail(items, item);
+        }
     }
 
-    *out_string = string;
-    return SUCCESS;
-}
+    // any frame shows the client is alive, not just a KEEP_ALIVE
+    if (got_frame)
+        condata->last_keep_alive = time(NULL);
 
-// fetch a read buffer item from fd
-// mutexes are done by the caller
-static ReadStatus fetch_item(ConnectionData *condata) {
-    // the item we will add to the buffer for this read
-    BufferItem *item = malloc(sizeof(BufferItem));
-    if (NULL == item) {
-        return ERROR;
+    // if nothing points into the buffer we can start from the beginning again
+    if (!in_frame(condata) && (1 == atomic_load(&chunk->refs))) {
+        chunk->len = 0;
+        condata->scan_pos = 0;
     }
 
-    // attempt to read in the json object
-    GString *obj;
-    ReadStatus status = read_json_object(condata->fd, &obj); // frees obj on error
-    if (SUCCESS != status) {
-        free(item);
-        return status;
-    }
+    return SUCCESS;
+}
 
-    // decode JSON
-    if (!decode_message(obj->str, &(item->msg))) {
-        printf("decode error on: %s\n", obj->str);
-        // report this BufferItem as a software error
-        software_error(&(item->msg), "Could not decode message");
-    }
+// read everything available on a connection, adding a BufferItem to items for each message
+// mutexes are done by the caller
+static ReadStatus fetch_items(ConnectionData *condata, GQueue *items) {
+    while (true) {
+        if (!reserve_chunk(condata))
+            return ERROR;
+
+        struct RecvChunk *chunk = condata->chunk;
+        ssize_t num_read = read(condata->fd, chunk->data + chunk->len, chunk->cap - chunk->len);
+        if (num_read > 0) {
+            chunk->len += (size_t) num_read;
+            if (ERROR == extract_frames(condata, items))
+                return ERROR;
+            continue;
+        }
 
-    g_string_free(obj, true);
+        // the remote host closed the connection
+        if (0 == num_read)
+            return END;
 
-    if (KEEP_ALIVE == item->msg.type) {
-        free_bufferitem(item);
-        // update last_keep_alive
-        condata->last_keep_alive = time(NULL);
-    } else { // "real" messages
-        item->address = condata->addr.sin_addr;
-        item->recv_time = time(NULL);
+        int e = errno;
+        // there just wasn't any data left in the buffer for us to read
+        if ((EAGAIN == e) || (EWOULDBLOCK == e))
+            return SUCCESS;
+        if (EINTR == e)
+            continue;
 
-        // add the item to the queue
-        g_queue_push_tail(read_buff, (gpointer) item);
+        // an unknown error occured
+        printf("Unknown error errno=%s num_read=%li\n", strerror(e), num_read);
+        return ERROR;
     }
-
-    return SUCCESS;
 }
 
 static void destroy_connection(ConnectionData *condata) {
     // destroy the connection
+    forget_nodes(condata->fd);
 
     // get access to connections_table
     if (0 != pthread_mutex_lock(&connections_mux)) {
@@ -265,25 +1006,54 @@ static void destroy_connection(ConnectionData *condata) {
     pthread_mutex_unlock(&connections_mux);
 }
 
-// read in an object waiting in a buffer
-static void *object_reader(ConnectionData *condata) {
-    // get exclusive access to read_buff
-    if (0 != pthread_mutex_lock(&read_buff_mux)) {
-        perror("object reader could not get the read_buff mutex");
-        return NULL;
+// hand items over to read_buff (through the decode workers if there are any), emptying items
+static void queue_items(GQueue *items) {
+    if (g_queue_is_empty(items))
+        return;
+
+    pthread_mutex_t *mutex = (NULL != decode_queue) ? &decode_mux : &read_buff_mux;
+    GQueue *queue = (NULL != decode_queue) ? decode_queue : read_buff;
+
+    BufferItem *item;
+    if (0 != pthread_mutex_lock(mutex)) {
+        perror("could not lock the queue");
+        while (NULL != (item = g_queue_pop_head(items))) {
+            free_bufferitem(item);
+            atomic_fetch_sub(&queued_items, 1);
+        }
+        return;
     }
-    
-    // read in every available object
-    ReadStatus status = fetch_item(condata);
+
+    while (NULL != (item = g_queue_pop_head(items)))
+        g_queue_push_tail(queue, item);
+
+    if (NULL != decode_queue)
+        pthread_cond_broadcast(&decode_cond);
+    pthread_mutex_unlock(mutex);
+}
+
+// read in the objects waiting in a buffer
+static void *object_reader(ConnectionData *condata) {
+    // read in every available object without holding read_buff_mux
+    GQueue items;
+    g_queue_init(&items);
+    ReadStatus status = fetch_items(condata, &items);
+
+    // hand them all over at once
+    queue_items(&items);
+
     if (ERROR == status) {
         puts("Read ERROR from remote host\n"); 
         destroy_connection(condata);
-        pthread_mutex_unlock(&read_buff_mux);
         return NULL;
-    } 
-    
+    }
+
+    if (END == status) {
+        report_close(condata);
+        return NULL;
+    }
+
     // clean up before returning
-    pthread_mutex_unlock(&read_buff_mux);
     pthread_mutex_unlock(&(condata->mutex));
     return NULL;
 }
@@ -297,21 +1067,21 @@ static void *report_close(ConnectionData *condata) {
     }
     
     item->address = condata->addr.sin_addr;
+    item->node_id = condata->node_id;
     item->recv_time = time(NULL);
+    item->text = NULL;
+    item->raw = NULL;
+    item->agreed = false;
+    item->chunk = NULL;
     
     software_error(&(item->msg), "Connection closed");
     
-    // get access to the queue
-    if (0 != pthread_mutex_lock(&read_buff_mux)) {
-        puts("can't lock queue");
-        free_bufferitem(item);
-        return NULL;
-    }
-    
-    // add the item to the queue
-    g_queue_push_tail(read_buff, (gpointer) item);
-    
-    pthread_mutex_unlock(&read_buff_mux);
+    // add the item to the queue behind any messages from this connection which are still being decoded
+    GQueue items;
+    g_queue_init(&items);
+    g_queue_push_tail(&items, item);
+    atomic_fetch_add(&queued_items, 1);
+    queue_items(&items);
 
     destroy_connection(condata);
     return NULL;
@@ -346,19 +1116,7 @@ static void io_handler(__attribute__ ((unused)) int sig, __attribute__ ((unused)
         return;
     }
 
-    char buf;
-    // check to see if there is any data to read
-    // checking si->si_code just seems to report the connection is closed on every signal
-    // MSG_PEEK so that the read character is not removed from the read buffer
-    ssize_t count = recv(si->si_fd, &buf, 1, MSG_PEEK);
-//    int e = errno;
-    if (1 != count) {
-//        printf("closed connection. fd=%i si_code=%i errno=%s count=%li\n",si->si_fd, si->si_code, strerror(e), count);
-
-        report_close(condata);
-        return;
-    }
-
+    // there is no need to peek for a closed connection: reading returns END for that
     // do the actual reading 
     object_reader((void *) condata);
 }
@@ -402,6 +1160,7 @@ static void connect_handler(__attribute__ ((unused)) int sig, siginfo_t *si, __a
         free(condata);
         return;
     }
+    atomic_fetch_add(&num_connections, 1); // until free_connectiondata
 
     // set the last message time to now
     if (-1 == time(&(condata->last_keep_alive))) {
@@ -411,20 +1170,47 @@ static void connect_handler(__attribute__ ((unused)) int sig, siginfo_t *si, __a
     }
 
     condata->fd = fd;
+    condata->node_id = 0;
+    memset(&(condata->seq), 0, sizeof(condata->seq));
+    condata->caps = 0;
+    condata->unacked = 0;
+    condata->last_ack = 0;
+    condata->received = 0;
+    condata->granted = 0;
+    condata->control_len = 0;
     condata->destroyed = false;
+    condata->chunk = NULL;
+    condata->frame_start = 0;
+    condata->scan_pos = 0;
+    condata->nest_count = 0;
+    condata->deep = false;
+    condata->in_binary = false;
+    condata->in_string = false;
+    condata->escaped = false;
+
+    // anything which arrived before O_ASYNC is set raises no signal so it is read below. Hold the connection while
+    // doing that so that io_handler waits for us, with its signal blocked on this thread so it can't interrupt us
+    sigset_t read_sig, old_mask;
+    sigemptyset(&read_sig);
+    sigaddset(&read_sig, SIGRTMIN + READ_SIG);
+    pthread_sigmask(SIG_BLOCK, &read_sig, &old_mask);
+    pthread_mutex_lock(&(condata->mutex));
 
     // get access to connections table
     if (0 != pthread_mutex_lock(&connections_mux)) {
         close(fd);
         free_connectiondata(condata);
+        pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
         return;
     }
 
     // g_hash_table needs the key to stick around
     int *key = malloc(sizeof(int));
     if (NULL == key) {
+        pthread_mutex_unlock(&connections_mux);
         close(fd);
         free_connectiondata(condata);
+        pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
         return;
     }
     *key = fd;
@@ -439,6 +1225,10 @@ static void connect_handler(__attribute__ ((unused)) int sig, siginfo_t *si, __a
     pthread_mutex_unlock(&connections_mux);
 
     setup_rt_signal_io(fd, SIGRTMIN + READ_SIG, io_handler);
+
+    // unlocks (or destroys) the connection
+    object_reader(condata);
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
 }
 
 // function to check if a keep alive message has been received for a given connection
@@ -469,7 +1259,12 @@ static void check_keep_alive(__attribute__((unused)) gpointer key, gpointer valu
         }
         software_error(&(err->msg), "Connection timeout");
         memcpy(&(err->address), &(condata->addr.sin_addr), sizeof(err->address));
+        err->node_id = condata->node_id;
         err->recv_time = time(NULL);
+        err->text = NULL;
+        err->raw = NULL;
+        err->agreed = false;
+        err->chunk = NULL;
 
         if (0 != pthread_mutex_trylock(&read_buff_mux)) {
             perror("Couldn't lock read_buff_mux");
@@ -478,6 +1273,7 @@ static void check_keep_alive(__attribute__((unused)) gpointer key, gpointer valu
         }
 
         g_queue_push_tail(read_buff, err);
+        atomic_fetch_add(&queued_items, 1);
         pthread_mutex_unlock(&read_buff_mux);
     }
 }
@@ -497,12 +1293,211 @@ static void iter_keep_alives(__attribute__((unused)) void *compulsory) {
 }
 
 
-// starts a server listening on addr
+// move decoded items into read_buff in the order they were read
+static void merge_decoded(uint64_t seq, BufferItem *item) {
+    if (0 != pthread_mutex_lock(&reorder_mux)) {
+        perror("could not lock reorder_mux");
+        exit(EXIT_FAILURE);
+    }
+    g_hash_table_insert(reorder, (gpointer) (uintptr_t) seq, item);
+
+    // only the owner of the next sequence number can make progress
+    if (seq == next_merge_seq) {
+        if (0 != pthread_mutex_lock(&read_buff_mux)) {
+            perror("could not lock read_buff_mux");
+            exit(EXIT_FAILURE);
+        }
+        BufferItem *next;
+        while (NULL != (next = g_hash_table_lookup(reorder, (gpointer) (uintptr_t) next_merge_seq))) {
+            g_hash_table_steal(reorder, (gpointer) (uintptr_t) next_merge_seq);
+            g_queue_push_tail(read_buff, next);
+            next_merge_seq++;
+        }
+        pthread_mutex_unlock(&read_buff_mux);
+    }
+
+    pthread_mutex_unlock(&reorder_mux);
+}
+
+// decode worker thread
+static void *decode_worker(__attribute__((unused)) void *compulsory) {
+    while (true) {
+        if (0 != pthread_mutex_lock(&decode_mux)) {
+            perror("could not lock decode_mux");
+            exit(EXIT_FAILURE);
+        }
+        while (!decode_stop && g_queue_is_empty(decode_queue))
+            pthread_cond_wait(&decode_cond, &decode_mux);
+        if (decode_stop) {
+            pthread_mutex_unlock(&decode_mux);
+            return NULL;
+        }
+        BufferItem *item = g_queue_pop_head(decode_queue);
+        uint64_t seq = next_decode_seq++;
+        pthread_mutex_unlock(&decode_mux);
+
+        finish_decode(item);
+        merge_decoded(seq, item);
+    }
+}
+
+// stop the decode workers and free everything in the pipeline
+static void stop_decode_workers(void) {
+    if (NULL == decode_queue)
+        return;
+
+    pthread_mutex_lock(&decode_mux);
+    decode_stop = true;
+    pthread_cond_broadcast(&decode_cond);
+    pthread_mutex_unlock(&decode_mux);
+
+    for (unsigned int i = 0; i < num_decode_threads; i++)
+        pthread_join(decode_threads[i], NULL);
+    free(decode_threads);
+    decode_threads = NULL;
+    num_decode_threads = 0;
+
+    pthread_mutex_lock(&decode_mux);
+    g_queue_free_full(decode_queue, (GDestroyNotify) free_bufferitem);
+    decode_queue = NULL;
+    pthread_mutex_unlock(&decode_mux);
+
+    pthread_mutex_lock(&reorder_mux);
+    g_hash_table_destroy(reorder);
+    reorder = NULL;
+    pthread_mutex_unlock(&reorder_mux);
+}
+
+// start the decode workers
+static bool start_decode_workers(unsigned int count) {
+    decode_stop = false;
+    next_decode_seq = 0;
+    next_merge_seq = 0;
+    decode_queue = g_queue_new();
+    reorder = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, (GDestroyNotify) free_bufferitem);
+    decode_threads = calloc(count, sizeof(pthread_t));
+    if ((NULL == decode_queue) || (NULL == reorder) || (NULL == decode_threads)) {
+        return false;
+    }
+
+    // the workers must not run the signal handlers: they take decode_mux
+    sigset_t mask, old_mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGRTMIN + READ_SIG);
+    sigaddset(&mask, SIGRTMIN + CONNECT_SIG);
+    pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+
+    bool ret = true;
+    for (; num_decode_threads < count; num_decode_threads++) {
+        if (0 != pthread_create(&decode_threads[num_decode_threads], NULL, decode_worker, NULL)) {
+            ret = false;
+            break;
+        }
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    return ret;
+}
+
+// returns how many messages are waiting at each stage of the pipeline
+void get_pipeline_depths(PipelineDepths *depths) {
+    if (NULL == depths)
+        return;
+
+    memset(depths, 0, sizeof(*depths));
+
+    if (NULL != decode_queue) {
+        if (0 != pthread_mutex_lock(&decode_mux)) {
+            perror("could not lock decode_mux");
+            return;
+        }
+        depths->decode_queue = g_queue_get_length(decode_queue);
+        pthread_mutex_unlock(&decode_mux);
+
+        if (0 != pthread_mutex_lock(&reorder_mux)) {
+            perror("could not lock reorder_mux");
+            return;
+        }
+        depths->reorder = g_hash_table_size(reorder);
+        pthread_mutex_unlock(&reorder_mux);
+    }
+
+    if (0 != pthread_mutex_lock(&read_buff_mux)) {
+        perror("could not lock read_buff_mux");
+        return;
+    }
+    if (NULL != read_buff)
+        depths->read_queue = g_queue_get_length(read_buff);
+    pthread_mutex_unlock(&read_buff_mux);
+}
+
+// fills in the default server options
+void default_server_options(ServerOptions *opts) {
+    if (NULL == opts)
+        return;
+
+    opts->borrowed_views = false;
+    opts->lazy_decode = false;
+    opts->decode_workers = 0;
+    opts->relayed_origins = false;
+    opts->ack_every = DEFAULT_ACK_EVERY;
+    opts->ack_interval_ms = DEFAULT_ACK_INTERVAL_MS;
+    opts->credit_window = DEFAULT_CREDIT_WINDOW;
+    opts->read_queue_limit = DEFAULT_READ_QUEUE_LIMIT;
+    opts->caps = SERVER_CAPS;
+}
+
+// undoes whatever start_server_opts had done before failing (except starting timers). Nothing has connected yet
+// returns false
+static bool abandon_start(void) {
+    stop_decode_workers();
+
+    close(listen_socket);
+    listen_socket = -1;
+
+    if (read_buff) {
+        g_queue_free(read_buff);
+        read_buff = NULL;
+    }
+    if (connections_table) {
+        g_hash_table_destroy(connections_table);
+        connections_table = NULL;
+    }
+    if (nodes_table) {
+        g_hash_table_destroy(nodes_table);
+        nodes_table = NULL;
+        g_hash_table_destroy(seq_table);
+        seq_table = NULL;
+    }
+    return false;
+}
+
+// starts a server listening on addr with the default options
 // returns success
 bool start_server(const struct sockaddr *addr, socklen_t addrlen) {
-    if (NULL == addr)
+    ServerOptions opts;
+    default_server_options(&opts);
+    return start_server_opts(addr, addrlen, &opts);
+}
+
+// starts a server listening on addr
+// returns success
+bool start_server_opts(const struct sockaddr *addr, socklen_t addrlen, const ServerOptions *opts) {
+    if ((NULL == addr) || (NULL == opts))
+        return false;
+    bool control = (0 != opts->ack_every) || (0 != opts->credit_window);
+    if (control && (0 == opts->ack_interval_ms))
         return false;
 
+    server_options = *opts;
+    // a sender mustn't be told it will be acknowledged or granted credit by a server set up to do neither
+    if (0 == opts->ack_every)
+        server_options.caps &= ~(uint32_t) CAP_ACKS;
+    if (0 == opts->credit_window)
+        server_options.caps &= ~(uint32_t) CAP_CREDIT;
+    atomic_store(&queued_items, 0);
+    atomic_store(&num_connections, 0);
+
     // create IPv4 TCP socket to communicate over
     // non-blocking so we can use signal driven IO
     // cloexec for security (closes fd on an exec() syscall)
@@ -512,59 +1507,58 @@ bool start_server(const struct sockaddr *addr, socklen_t addrlen) {
         return false;
     }
 
+    // senders which read control frames wait for the server to close first, leaving its end in TIME_WAIT. Don't let
+    // that stop a restarted server from binding
+    int reuse = 1;
+    if (-1 == setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse))) {
+        perror("start_server: setsockopt");
+        return abandon_start();
+    }
+
     // bind to the specified address
     if (-1 == bind(listen_socket, addr, addrlen)) {
-        close(listen_socket);
         perror("start_server: binding");
-        listen_socket = -1;
-        return false;
+        return abandon_start();
     }
 
     // initialise the read buffer
     read_buff = g_queue_new();
-    if (!read_buff) {
-        close(listen_socket);
-        listen_socket = -1;
-        return false;
-    }
+    if (!read_buff)
+        return abandon_start();
 
     // initialise the connections table
     connections_table = g_hash_table_new_full(g_int_hash, g_int_equal, (GDestroyNotify) free, (GDestroyNotify) free_connectiondata); 
-    if (!connections_table) {
-        close(listen_socket);
-        listen_socket = -1;
-        return false;
-    }
+    if (!connections_table)
+        return abandon_start();
+
+    // start the decode pipeline before anything can arrive
+    if ((0 != opts->decode_workers) && !start_decode_workers(opts->decode_workers))
+        return abandon_start();
 
     // set up realtime signal-driven IO on the listening socket
-    if (!setup_rt_signal_io(listen_socket, SIGRTMIN + CONNECT_SIG, connect_handler)) {
-        close(listen_socket);
-        listen_socket = -1;
-        g_queue_free(read_buff);
-        read_buff = NULL;
-        g_hash_table_destroy(connections_table);
-        connections_table = NULL;
-        return false;
-    }
+    if (!setup_rt_signal_io(listen_socket, SIGRTMIN + CONNECT_SIG, connect_handler))
+        return abandon_start();
 
     // set up keep_alive checker
-    if (false == create_timer((timer_handler_t) iter_keep_alives, &timer_id, (KEEP_ALIVE_INTERVAL) * (KEEP_ALIVE_CHECK_PERIOD))) {
-        close(listen_socket);
-        listen_socket = -1;
-        g_queue_free(read_buff);
-        read_buff = NULL;
-        g_hash_table_destroy(connections_table);
-        connections_table = NULL;
-        return false;
-    }
+    if (false == create_timer((timer_handler_t) iter_keep_alives, &timer_id, (KEEP_ALIVE_INTERVAL) * (KEEP_ALIVE_CHECK_PERIOD)))
+        return abandon_start();
+
+    // nothing can connect before listen
+    nodes_table = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, free);
+    seq_table = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, free);
+    memset(&seq_totals, 0, sizeof(seq_totals));
+
+    // acknowledgements and credit which haven't gone out with a read are sent by a timer
+    control_timer_running = control &&
+            create_timer_ms((timer_handler_t) flush_control, &control_timer, opts->ack_interval_ms);
 
     // begin listening on the socket
-    if (-1 == listen(listen_socket, SOMAXCONN)) {
-        close(listen_socket);
-        listen_socket = -1;
-        g_queue_free(read_buff);
-        read_buff = NULL;
-        return false;
+    if ((control && !control_timer_running) || (-1 == listen(listen_socket, SOMAXCONN))) {
+        stop_timer(timer_id);
+        if (control_timer_running)
+            stop_timer(control_timer);
+        control_timer_running = false;
+        return abandon_start();
     }
 
     return true;
@@ -579,20 +1573,47 @@ BufferItem *read_message(void) {
 
     BufferItem *ret = (BufferItem *) g_queue_pop_head(read_buff);
     // if this is NULL we should be returning NULL anyway
+    if (NULL != ret)
+        atomic_fetch_sub(&queued_items, 1);
 
     pthread_mutex_unlock(&read_buff_mux);
 
+    // lazily decoded messages are finished off here, outside of the lock
+    if (NULL != ret)
+        finish_decode(ret);
+
     return ret;
 }
 
 // free a BufferItem (wrapper function incase it contains anyting that needs freeing interneally)
 void free_bufferitem(BufferItem *item) {
     free_message(&(item->msg));
+    release_chunk(item->chunk);
     free(item);
 }
 
+// the text of a message whether or not it is borrowed
+const char *bufferitem_text(const BufferItem *item) {
+    if (NULL == item)
+        return NULL;
+
+    if (NULL != item->text)
+        return item->text;
+
+    GString *message = NULL;
+    if (SOFT_ERROR == item->msg.type)
+        message = item->msg.data.software.message;
+    else if (HARD_ERROR_OTHER == item->msg.type)
+        message = item->msg.data.hardware_other.message;
+    else if (HARD_ERROR_VALVE == item->msg.type)
+        message = item->msg.data.hardware_valve.message;
+
+    return (NULL == message) ? NULL : message->str;
+}
+
 // free a ConnectionData
 static void free_connectiondata(ConnectionData *condata) {
+    atomic_fetch_sub(&num_connections, 1);
     condata->destroyed = true;
     pthread_mutex_unlock(&(condata->mutex));
     // if something jumps in here then it should check the destroyed flag
@@ -601,6 +1622,7 @@ static void free_connectiondata(ConnectionData *condata) {
         //perror("destroy condata mux");
     }
     close(condata->fd);
+    release_chunk(condata->chunk);
     free(condata);
 }
 
@@ -624,6 +1646,13 @@ void stop_server(void) {
 
     // disable KEEP_ALIVE check
     stop_timer(timer_id);
+    if (control_timer_running) {
+        stop_timer(control_timer);
+        control_timer_running = false;
+    }
+
+    // anything still in the decode pipeline is thrown away
+    stop_decode_workers();
 
     // close the open socket
     if (-1 != listen_socket) {
@@ -639,6 +1668,15 @@ void stop_server(void) {
         pthread_mutex_unlock(&connections_mux);
     }
 
+    if (nodes_table) {
+        pthread_mutex_lock(&nodes_mux);
+        g_hash_table_destroy(nodes_table);
+        nodes_table = NULL;
+        g_hash_table_destroy(seq_table);
+        seq_table = NULL;
+        pthread_mutex_unlock(&nodes_mux);
+    }
+
     // free up the read buffer
     if (read_buff) {
         pthread_mutex_lock(&read_buff_mux);
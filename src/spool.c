@@ -0,0 +1,346 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * spool.c
+ * Append-only on-disk queue of encoded messages, used by the sender while it can't reach the server
+ */
+
+/* The spool is a directory of fixed size segment files named by sequence number (00000000.spool, 00000001.spool...).
+Each segment is mmap'd and records are appended one after another:
+    RecordHeader | payload | padding to RECORD_ALIGN
+The magic number is written last so a record which was only partly written when the process died does not count.
+Records are consumed in order by setting a flag in their header and a segment is deleted once everything in it has been
+consumed. When the spool is opened again the segments are scanned and everything after the last complete record with a
+good CRC is cleared.
+The records are in the page cache as soon as they are written so they survive the process crashing. They are only
+msync'd when the spool is closed.
+*/
+
+// includes
+#include "config.h"
+#include "edsac_spool.h"
+#include <glib.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// "SPL1"
+#define SPOOL_MAGIC 0x314c5053u
+
+// records start on multiples of this
+#define RECORD_ALIGN 8
+
+// in front of each record
+typedef struct {
+    uint32_t magic; // SPOOL_MAGIC once the record is completely written
+    uint32_t len; // length of the payload
+    uint32_t crc; // CRC-32 of the payload
+    uint32_t consumed; // non-zero once the record has been sent
+} RecordHeader;
+
+// one mmap'd segment file
+typedef struct {
+    unsigned int seq; // from the file name
+    char *map;
+    size_t read_off; // first record which has not been consumed
+    size_t write_off; // end of the last complete record
+} Segment;
+
+struct Spool {
+    char *dir;
+    size_t segment_size;
+    unsigned int max_segments;
+    GQueue *segments; // of Segment *, oldest first
+    size_t pending; // records not consumed
+};
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+// table for the reflected IEEE 802.3 polynomial (the same CRC-32 as zlib)
+static void init_crc_table(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+            c = (c & 1) ? (0xedb88320u ^ (c >> 1)) : (c >> 1);
+        crc_table[i] = c;
+    }
+}
+
+static uint32_t crc32(const char *data, size_t len) {
+    pthread_once(&crc_once, init_crc_table);
+
+    uint32_t c = 0xffffffffu;
+    for (size_t i = 0; i < len; i++)
+        c = crc_table[(c ^ (uint8_t) data[i]) & 0xff] ^ (c >> 8);
+    return c ^ 0xffffffffu;
+}
+
+// space taken up by a record with a payload of len bytes
+static size_t record_size(size_t len) {
+    return sizeof(RecordHeader) + ((len + RECORD_ALIGN - 1) & ~((size_t) RECORD_ALIGN - 1));
+}
+
+static RecordHeader *record_at(const Segment *seg, size_t off) {
+    return (RecordHeader *) (void *) (seg->map + off);
+}
+
+static void segment_path(const Spool *spool, unsigned int seq, char *path, size_t path_len) {
+    snprintf(path, path_len, "%s/%08u.spool", spool->dir, seq);
+}
+
+// maps segment seq, creating the file if it does not exist. Returns NULL on failure
+static Segment *map_segment(const Spool *spool, unsigned int seq) {
+    char path[PATH_MAX];
+    segment_path(spool, seq, path, sizeof(path));
+
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (-1 == fd)
+        return NULL;
+
+    // new files are zero filled
+    struct stat st;
+    if ((-1 == fstat(fd, &st)) || ((0 == st.st_size) && (-1 == ftruncate(fd, (off_t) spool->segment_size)))) {
+        close(fd);
+        return NULL;
+    }
+    if ((0 != st.st_size) && ((size_t) st.st_size != spool->segment_size)) {
+        fprintf(stderr, "spool: %s is the wrong size\n", path);
+        close(fd);
+        return NULL;
+    }
+
+    void *map = mmap(NULL, spool->segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd); // the mapping keeps the file open
+    if (MAP_FAILED == map)
+        return NULL;
+
+    Segment *seg = calloc(1, sizeof(Segment));
+    if (NULL == seg) {
+        munmap(map, spool->segment_size);
+        return NULL;
+    }
+    seg->seq = seq;
+    seg->map = map;
+    return seg;
+}
+
+// unmaps a segment and deletes its file
+static void remove_segment(const Spool *spool, Segment *seg) {
+    char path[PATH_MAX];
+    segment_path(spool, seg->seq, path, sizeof(path));
+
+    munmap(seg->map, spool->segment_size);
+    unlink(path);
+    free(seg);
+}
+
+// finds the complete records in a segment left by an earlier run
+static void scan_segment(Spool *spool, Segment *seg) {
+    size_t off = 0;
+    while (off + sizeof(RecordHeader) <= spool->segment_size) {
+        const RecordHeader *hdr = record_at(seg, off);
+        if (SPOOL_MAGIC != hdr->magic)
+            break;
+        if (hdr->len > spool->segment_size - off - sizeof(RecordHeader))
+            break;
+        if (hdr->crc != crc32(seg->map + off + sizeof(RecordHeader), hdr->len))
+            break;
+
+        if (hdr->consumed)
+            seg->read_off = off + record_size(hdr->len);
+        else
+            spool->pending++;
+        off += record_size(hdr->len);
+    }
+
+    // clear anything after the last good record so it can't be mistaken for a record later
+    seg->write_off = off;
+    memset(seg->map + off, 0, spool->segment_size - off);
+}
+
+// starts a new segment after the last one
+static Segment *add_segment(Spool *spool) {
+    if (g_queue_get_length(spool->segments) >= spool->max_segments)
+        return NULL;
+
+    Segment *last = g_queue_peek_tail(spool->segments);
+    Segment *seg = map_segment(spool, (NULL == last) ? 0 : last->seq + 1);
+    if (NULL != seg)
+        g_queue_push_tail(spool->segments, seg);
+    return seg;
+}
+
+static int compare_seq(const void *a, const void *b) {
+    unsigned int x = *(const unsigned int *) a;
+    unsigned int y = *(const unsigned int *) b;
+    return (x > y) - (x < y);
+}
+
+// finds and maps the segments already in the spool directory
+static bool recover_segments(Spool *spool) {
+    DIR *dir = opendir(spool->dir);
+    if (NULL == dir)
+        return false;
+
+    unsigned int *seqs = NULL;
+    size_t count = 0;
+    struct dirent *entry;
+    while (NULL != (entry = readdir(dir))) {
+        unsigned int seq;
+        char check[32];
+        if (1 != sscanf(entry->d_name, "%8u.spool", &seq))
+            continue;
+        snprintf(check, sizeof(check), "%08u.spool", seq);
+        if (0 != strcmp(check, entry->d_name))
+            continue;
+
+        unsigned int *grown = realloc(seqs, (count + 1) * sizeof(unsigned int));
+        if (NULL == grown) {
+            free(seqs);
+            closedir(dir);
+            return false;
+        }
+        seqs = grown;
+        seqs[count++] = seq;
+    }
+    closedir(dir);
+
+    if (0 != count)
+        qsort(seqs, count, sizeof(unsigned int), compare_seq);
+
+    bool ret = true;
+    for (size_t i = 0; i < count; i++) {
+        Segment *seg = map_segment(spool, seqs[i]);
+        if (NULL == seg) {
+            ret = false;
+            break;
+        }
+        scan_segment(spool, seg);
+
+        // nothing left to send in it
+        if ((seg->read_off == seg->write_off) && (i + 1 != count))
+            remove_segment(spool, seg);
+        else
+            g_queue_push_tail(spool->segments, seg);
+    }
+
+    free(seqs);
+    return ret;
+}
+
+Spool *spool_open(const char *dir, size_t segment_size, unsigned int max_segments) {
+    if ((NULL == dir) || (segment_size < 2 * sizeof(RecordHeader)) || (segment_size % RECORD_ALIGN) || (0 == max_segments))
+        return NULL;
+
+    if ((-1 == mkdir(dir, 0700)) && (EEXIST != errno))
+        return NULL;
+
+    Spool *spool = calloc(1, sizeof(Spool));
+    if (NULL == spool)
+        return NULL;
+
+    spool->dir = strdup(dir);
+    spool->segment_size = segment_size;
+    spool->max_segments = max_segments;
+    spool->segments = g_queue_new();
+    if ((NULL == spool->dir) || (NULL == spool->segments)) {
+        spool_close(spool);
+        return NULL;
+    }
+
+    if (!recover_segments(spool) || ((0 == g_queue_get_length(spool->segments)) && (NULL == add_segment(spool)))) {
+        spool_close(spool);
+        return NULL;
+    }
+
+    return spool;
+}
+
+bool spool_append(Spool *spool, const char *data, size_t len) {
+    size_t size = record_size(len);
+    if ((size > spool->segment_size) || (len > UINT32_MAX))
+        return false;
+
+    Segment *seg = g_queue_peek_tail(spool->segments);
+    if ((seg->write_off + size > spool->segment_size) && (NULL == (seg = add_segment(spool))))
+        return false; // full
+
+    RecordHeader *hdr = record_at(seg, seg->write_off);
+    hdr->len = (uint32_t) len;
+    hdr->crc = crc32(data, len);
+    hdr->consumed = 0;
+    memcpy(seg->map + seg->write_off + sizeof(RecordHeader), data, len);
+    // the record only counts once this is written
+    __atomic_store_n(&hdr->magic, SPOOL_MAGIC, __ATOMIC_RELEASE);
+
+    seg->write_off += size;
+    spool->pending++;
+    return true;
+}
+
+size_t spool_peek(Spool *spool, struct iovec *out, size_t max) {
+    size_t n = 0;
+    for (GList *l = spool->segments->head; (NULL != l) && (n < max); l = l->next) {
+        const Segment *seg = l->data;
+        size_t off = seg->read_off;
+        while ((off < seg->write_off) && (n < max)) {
+            const RecordHeader *hdr = record_at(seg, off);
+            out[n].iov_base = seg->map + off + sizeof(RecordHeader);
+            out[n].iov_len = hdr->len;
+            n++;
+            off += record_size(hdr->len);
+        }
+    }
+
+    return n;
+}
+
+void spool_consume(Spool *spool, size_t count) {
+    while (true) {
+        Segment *seg = g_queue_peek_head(spool->segments);
+        while ((0 != count) && (seg->read_off < seg->write_off)) {
+            RecordHeader *hdr = record_at(seg, seg->read_off);
+            hdr->consumed = 1;
+            seg->read_off += record_size(hdr->len);
+            spool->pending--;
+            count--;
+        }
+
+        // the last segment is kept for appending to
+        if ((seg->read_off != seg->write_off) || (1 == g_queue_get_length(spool->segments)))
+            return;
+        remove_segment(spool, g_queue_pop_head(spool->segments));
+    }
+}
+
+size_t spool_pending(const Spool *spool) {
+    return spool->pending;
+}
+
+void spool_close(Spool *spool) {
+    if (NULL == spool)
+        return;
+
+    if (NULL != spool->segments) {
+        Segment *seg;
+        while (NULL != (seg = g_queue_pop_head(spool->segments))) {
+            msync(seg->map, spool->segment_size, MS_SYNC);
+            munmap(seg->map, spool->segment_size);
+            free(seg);
+        }
+        g_queue_free(spool->segments);
+    }
+
+    free(spool->dir);
+    free(spool);
+}
@@ -0,0 +1,157 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * test/ack.c
+ * test for the server acknowledging messages and the sender sending again what wasn't acknowledged
+ */
+
+// includes
+#include "config.h"
+#include "edsac_server.h"
+#include "edsac_sending.h"
+#include "edsac_representation.h"
+#include "edsac_arguments.h"
+#include "helpers.h"
+#include <stdlib.h>
+#include <assert.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#define FAKE_PORT 2026
+#define SERVER_PORT 2027
+
+// reads the next message which isn't a KEEP_ALIVE from fd and returns its sequence number
+static uint64_t read_seq(int fd) {
+    Message msg;
+    read_json_message(fd, &msg);
+    uint64_t seq = msg.seq;
+    free_message(&msg);
+    return seq;
+}
+
+static void write_ack(int fd, uint64_t seq) {
+    Message ack;
+    ack_message(&ack, seq);
+    char *encoded = NULL;
+    assert(-1 != encode_message(&ack, &encoded));
+    write_str(fd, encoded);
+    free(encoded);
+}
+
+static void send_numbered(int count) {
+    for (int i = 0; i < count; i++) {
+        Message msg;
+        software_error(&msg, "disk full");
+        assert(send_message(&msg));
+        free_message(&msg);
+    }
+}
+
+// what the server didn't acknowledge is sent again after reconnecting, or when it stops acknowledging anything
+static void test_resend(void) {
+    struct sockaddr *addr = alloc_addr("127.0.0.1", FAKE_PORT);
+    int listen_fd = listen_on(addr, sizeof(*addr));
+
+    SendingOptions opts;
+    default_sending_options(&opts);
+    opts.reconnect = true;
+    opts.reconnect_min_ms = 20;
+    opts.acks = true;
+    opts.ack_timeout_ms = 300;
+    assert(start_sending_opts(addr, sizeof(*addr), &opts));
+    int fd = accept_sender(listen_fd);
+
+    send_numbered(3);
+    for (uint64_t seq = 1; seq <= 3; seq++)
+        assert(seq == read_seq(fd));
+
+    // the server dies having only acknowledged 2
+    write_ack(fd, 2);
+    close(fd);
+    fd = accept_sender(listen_fd);
+    assert(3 == read_seq(fd));
+
+    // nothing is acknowledged so the sender gives up on the connection and tries again
+    double start = monotonic_now();
+    int next_fd = accept_sender(listen_fd);
+    double waited = monotonic_now() - start;
+    printf("reconnected after %.2fs\n", waited);
+    assert(waited >= 0.25);
+    close(fd);
+    fd = next_fd;
+    assert(3 == read_seq(fd));
+
+    write_ack(fd, 3);
+    send_numbered(1);
+    assert(4 == read_seq(fd));
+    write_ack(fd, 4);
+
+    stop_sending();
+    close(fd);
+    close(listen_fd);
+    free(addr);
+}
+
+// the server acknowledges batches of messages and stop_sending doesn't have to wait for the last ones
+static void test_server(void) {
+    struct sockaddr *addr = alloc_addr("127.0.0.1", SERVER_PORT);
+    ServerOptions server_opts;
+    default_server_options(&server_opts);
+    server_opts.ack_every = 4;
+    assert(start_server_opts(addr, sizeof(*addr), &server_opts));
+
+    SendingOptions opts;
+    default_sending_options(&opts);
+    opts.reconnect = true;
+    opts.acks = true;
+    opts.node_id = 5;
+    assert(start_sending_opts(addr, sizeof(*addr), &opts));
+
+    // 10 is not a multiple of 4 so the timer acknowledges the last two
+    send_numbered(10);
+    for (uint64_t seq = 1; seq <= 10; seq++) {
+        BufferItem *item = wait_message();
+        assert(NULL != item);
+        assert(seq == item->msg.seq);
+        free_bufferitem(item);
+    }
+
+    double start = monotonic_now();
+    stop_sending();
+    double waited = monotonic_now() - start;
+    printf("stopped after %.2fs\n", waited);
+    assert(waited < 2);
+
+    BufferItem *item = wait_message();
+    assert(NULL != item);
+    assert(0 == strcmp("Connection closed", bufferitem_text(item)));
+    free_bufferitem(item);
+
+    SequenceStats stats;
+    assert(get_node_sequence_stats(5, &stats));
+    assert((10 == stats.received) && (0 == stats.duplicates));
+
+    // acknowledgements need somewhere to be sent again
+    opts.reconnect = false;
+    assert(!start_sending_opts(addr, sizeof(*addr), &opts));
+
+    // nor can they be kept in a spool, which deletes messages as soon as they are written
+    opts.reconnect = true;
+    opts.spool_dir = "ack_spool";
+    assert(!start_sending_opts(addr, sizeof(*addr), &opts));
+
+    stop_server();
+    free(addr);
+}
+
+int main(void) {
+    test_resend();
+    test_server();
+
+    puts("passed");
+    return EXIT_SUCCESS;
+}
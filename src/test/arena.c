@@ -0,0 +1,92 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * test/arena.c
+ * Allocation count benchmark for the cJSON arena
+ */
+
+// includes
+#include "config.h"
+#include "edsac_representation.h"
+#include "edsac_arena.h"
+#include <stdlib.h>
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+// number of encode/decode round trips to time
+#define ITERATIONS 100000
+
+// seconds since some fixed point
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + ((double) ts.tv_nsec / 1E9);
+}
+
+// encodes and decodes msg once
+static void round_trip(const Message *msg) {
+    char buf[MAX_ENCODED_LEN];
+    assert(-1 != encode_message_buf(msg, buf, sizeof(buf)));
+
+    Message decoded;
+    assert(decode_message(buf, &decoded));
+    assert(decoded.type == msg->type);
+    free_message(&decoded);
+}
+
+int main(void) {
+    Message msg;
+    hardware_error_valve(&msg, 12, "valve 12 failed its heater check");
+
+    // warm up: the arena grows to fit
+    round_trip(&msg);
+
+    ArenaStats before;
+    arena_get_stats(&before);
+
+    double start = now();
+    for (unsigned int i = 0; i < ITERATIONS; i++)
+        round_trip(&msg);
+    double elapsed = now() - start;
+
+    ArenaStats after;
+    arena_get_stats(&after);
+
+    unsigned long arena_allocs = after.arena_allocs - before.arena_allocs;
+    unsigned long heap_allocs = after.heap_allocs - before.heap_allocs;
+    unsigned long chunk_allocs = after.chunk_allocs - before.chunk_allocs;
+    printf("%u round trips in %.3fs (%.0fns each)\n", ITERATIONS, elapsed, elapsed * 1E9 / ITERATIONS);
+    printf("cJSON allocations per round trip: %.1f from the arena, %.1f from the heap\n",
+        (double) arena_allocs / ITERATIONS, (double) heap_allocs / ITERATIONS);
+    printf("arena chunks allocated: %lu\n", chunk_allocs);
+
+    // in steady state cJSON never reaches malloc
+    assert(0 != arena_allocs);
+    assert(0 == heap_allocs);
+    assert(0 == chunk_allocs);
+
+    // a message bigger than the first chunk makes the arena grow once and then stay that size
+    char big[3 * ARENA_CHUNK_SIZE];
+    memset(big, 'x', sizeof(big) - 1);
+    big[sizeof(big) - 1] = '\0';
+    Message big_msg;
+    software_error(&big_msg, big);
+    char *encoded = NULL;
+    assert(-1 != encode_message(&big_msg, &encoded));
+    free(encoded);
+    arena_get_stats(&before);
+    for (unsigned int i = 0; i < 100; i++) {
+        assert(-1 != encode_message(&big_msg, &encoded));
+        free(encoded);
+    }
+    arena_get_stats(&after);
+    assert(after.chunk_allocs == before.chunk_allocs);
+
+    free_message(&big_msg);
+    free_message(&msg);
+
+    puts("passed");
+    return EXIT_SUCCESS;
+}
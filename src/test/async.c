@@ -0,0 +1,106 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * test/async.c
+ * system test for the asynchronous sender
+ */
+
+// includes
+#include "config.h"
+#include "edsac_server.h"
+#include "edsac_representation.h"
+#include "edsac_sending.h"
+#include "edsac_arguments.h"
+#include <stdlib.h>
+#include <assert.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+
+// seconds since some fixed point
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + ((double) ts.tv_nsec / 1E9);
+}
+
+// queues messages faster than they can be written and checks that they all arrive in order
+int main(void) {
+    const unsigned int num_messages = 1E4; // number of messages to send and receive
+    const char *test_message = "hello world!";
+
+    struct sockaddr *addr = alloc_addr("127.0.0.1", 2004);
+    assert(NULL != addr);
+
+    Message msg;
+    hardware_error_valve(&msg, 0, test_message);
+
+    puts("starting server");
+    if (!start_server(addr, sizeof(*addr))) {
+        perror("failed to start server");
+        free(addr);
+        return EXIT_FAILURE;
+    }
+
+    SendingOptions opts;
+    default_sending_options(&opts);
+    opts.async = true;
+    opts.queue_len = num_messages;
+
+    puts("connecting to server");
+    if (!start_sending_opts(addr, sizeof(*addr), &opts)) {
+        perror("failed to start sending");
+        free(addr);
+        return EXIT_FAILURE;
+    }
+
+    free(addr);
+    addr = NULL;
+
+    // the server's signal handlers allocate memory so they mustn't interrupt this thread while it is in malloc.
+    // While it is blocked they run on the writer thread, which does the writing
+    sigset_t mask, old_mask;
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+
+    puts("sending messages");
+    double start = now();
+    for (unsigned int i = 0; i < num_messages; i++) {
+        msg.data.hardware_valve.valve_no = (int) i;
+        if (!send_message(&msg)) {
+            perror("failed to send message");
+            return EXIT_FAILURE;
+        }
+    }
+    printf("%.0fns per send_message\n", (now() - start) * 1E9 / num_messages);
+
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+    puts("disconnecting");
+    stop_sending(); // writes everything still queued
+
+    for (unsigned int i = 0; i < num_messages; i++) {
+        BufferItem *item = read_message();
+        assert(NULL != item);
+        assert(HARD_ERROR_VALVE == item->msg.type);
+        assert(i == (unsigned int) item->msg.data.hardware_valve.valve_no);
+        assert(0 == strcmp(test_message, bufferitem_text(item)));
+        free_bufferitem(item);
+    }
+
+    BufferItem *disconnect = read_message();
+    assert(NULL != disconnect);
+    assert(SOFT_ERROR == disconnect->msg.type);
+    assert(0 == strcmp("Connection closed", bufferitem_text(disconnect)));
+    free_bufferitem(disconnect);
+
+    free_message(&msg);
+
+    puts("stopping server");
+    stop_server();
+
+    puts("passed");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,164 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * test/batch.c
+ * test for several messages sent in one batch frame, in JSON and in binary
+ */
+
+// includes
+#include "config.h"
+#include "edsac_server.h"
+#include "edsac_sending.h"
+#include "edsac_representation.h"
+#include "edsac_arguments.h"
+#include "helpers.h"
+#include <stdlib.h>
+#include <assert.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#define FAKE_PORT 2029
+#define SERVER_PORT 2030
+#define NUM_QUEUED 20
+#define VALVE_TEXT "valve stuck"
+
+// the messages in a batch are found whatever order its members are in
+static void test_representation(void) {
+    const char *json = "{ \"type\" : \"BATCH\", \"data\" : { \"messages\" : [ "
+            "{\"version\":2,\"data\":{\"message\":\"a]}\"},\"type\":\"SOFT_ERROR\"} , "
+            "{\"version\":2,\"data\":{\"message\":\"b\",\"valve_no\":3},\"type\":\"HARD_ERROR_VALVE\"} ] }, "
+            "\"version\" : 2 }";
+    BatchReader reader;
+    assert(batch_begin(json, strlen(json), &reader));
+
+    const char *msg;
+    size_t len;
+    assert(batch_next(&reader, &msg, &len));
+    Message decoded;
+    char copy[MAX_ENCODED_LEN];
+    memcpy(copy, msg, len);
+    copy[len] = '\0';
+    assert(decode_message(copy, &decoded));
+    assert((SOFT_ERROR == decoded.type) && (0 == strcmp("a]}", decoded.data.software.message->str)));
+    free_message(&decoded);
+
+    assert(batch_next(&reader, &msg, &len));
+    memcpy(copy, msg, len);
+    copy[len] = '\0';
+    assert(decode_message(copy, &decoded));
+    assert((HARD_ERROR_VALVE == decoded.type) && (3 == decoded.data.hardware_valve.valve_no));
+    free_message(&decoded);
+    assert(!batch_next(&reader, &msg, &len) && !reader.error);
+
+    // a message on its own is not a batch
+    const char *single = "{\"version\":2,\"data\":{},\"type\":\"KEEP_ALIVE\"}";
+    assert(!batch_begin(single, strlen(single), &reader));
+
+    // nor is a batch of another version
+    const char *old = "{\"version\":1,\"type\":\"BATCH\",\"data\":{\"messages\":[]}}";
+    assert(!batch_begin(old, strlen(old), &reader));
+
+    // something in the array which isn't a message
+    const char *bad = BATCH_PREFIX "{\"version\":2,\"data\":{},\"type\":\"KEEP_ALIVE\"},7" BATCH_SUFFIX;
+    assert(batch_begin(bad, strlen(bad), &reader));
+    assert(batch_next(&reader, &msg, &len));
+    assert(!batch_next(&reader, &msg, &len) && reader.error);
+
+    // binary: the header gives the length of the rest and each message has its own
+    const char binary[] = {BINARY_BATCH, 0, 7, 0, 2, 'a', 'b', 0, 1, 'c'};
+    assert(binary_batch_begin(binary, sizeof(binary), &reader));
+    assert(batch_next(&reader, &msg, &len) && (2 == len) && (0 == memcmp("ab", msg, 2)));
+    assert(batch_next(&reader, &msg, &len) && (1 == len) && ('c' == *msg));
+    assert(!batch_next(&reader, &msg, &len) && !reader.error);
+
+    assert(!binary_batch_begin(binary, sizeof(binary) - 1, &reader));
+    const char overrun[] = {BINARY_BATCH, 0, 3, 0, 2, 'a'};
+    assert(binary_batch_begin(overrun, sizeof(overrun), &reader));
+    assert(!batch_next(&reader, &msg, &len) && reader.error);
+}
+
+// what the writer puts on the wire
+static void test_wire(BatchFormat batch) {
+    struct sockaddr *addr = alloc_addr("127.0.0.1", FAKE_PORT);
+    SendingOptions opts;
+    lazy_options(&opts);
+    opts.batch = batch;
+    start_lazy(addr, &opts, VALVE_TEXT, NUM_QUEUED);
+
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    assert(-1 != listen_fd);
+    int yes = 1;
+    assert(0 == setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)));
+    assert(0 == bind(listen_fd, addr, sizeof(*addr)));
+    assert(0 == listen(listen_fd, 1));
+    int fd = accept(listen_fd, NULL, NULL);
+    assert(-1 != fd);
+    struct timeval timeout = {.tv_sec = 5, .tv_usec = 0};
+    assert(0 == setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)));
+
+    char start[sizeof(BATCH_PREFIX) - 1];
+    size_t got = 0;
+    while (got < sizeof(start)) {
+        ssize_t count = read(fd, start + got, sizeof(start) - got);
+        assert(count > 0);
+        got += (size_t) count;
+    }
+    if (BATCH_JSON == batch)
+        assert(0 == memcmp(BATCH_PREFIX, start, sizeof(start)));
+    else
+        assert(BINARY_BATCH == start[0]);
+
+    stop_sending();
+    close(fd);
+    close(listen_fd);
+    free(addr);
+}
+
+// the server hands the messages of a batch over one by one, in order
+static void test_server(BatchFormat batch, unsigned int decode_workers) {
+    struct sockaddr *addr = alloc_addr("127.0.0.1", SERVER_PORT);
+    SendingOptions opts;
+    lazy_options(&opts);
+    opts.batch = batch;
+    start_lazy(addr, &opts, VALVE_TEXT, NUM_QUEUED);
+
+    ServerOptions server_opts;
+    default_server_options(&server_opts);
+    server_opts.decode_workers = decode_workers;
+    server_opts.borrowed_views = true;
+    assert(start_server_opts(addr, sizeof(*addr), &server_opts));
+
+    // and once connected, whatever builds up while writing
+    queue_valves(VALVE_TEXT, NUM_QUEUED, NUM_QUEUED);
+    for (int i = 0; i < 2 * NUM_QUEUED; i++) {
+        BufferItem *item = wait_message();
+        assert(NULL != item);
+        assert(HARD_ERROR_VALVE == item->msg.type);
+        assert(i == item->msg.data.hardware_valve.valve_no);
+        assert(0 == strcmp(VALVE_TEXT, bufferitem_text(item)));
+        free_bufferitem(item);
+    }
+
+    stop_sending();
+    BufferItem *item = wait_message();
+    assert(NULL != item);
+    assert(0 == strcmp("Connection closed", bufferitem_text(item)));
+    free_bufferitem(item);
+
+    stop_server();
+    free(addr);
+}
+
+int main(void) {
+    test_representation();
+    test_wire(BATCH_JSON);
+    test_wire(BATCH_BINARY);
+    test_server(BATCH_JSON, 0);
+    test_server(BATCH_BINARY, 2);
+
+    puts("passed");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,95 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * test/borrowed.c
+ * system test for a server running with borrowed views
+ */
+
+// includes
+#include "config.h"
+#include "edsac_server.h"
+#include "edsac_representation.h"
+#include "edsac_sending.h"
+#include "edsac_arguments.h"
+#include <stdlib.h>
+#include <assert.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+
+// sends messages to a server using borrowed views and checks the text survives the trip
+int main(void) {
+    const unsigned int num_messages = 1E4; // number of messages to send and receive
+    // braces and quotes inside the text must not confuse the framing
+    const char *test_message = "valve {3} said \"hello\"";
+
+    struct sockaddr *addr = alloc_addr("127.0.0.1", 2001);
+    assert(NULL != addr);
+
+    Message msg;
+    hardware_error_valve(&msg, 3, test_message);
+
+    ServerOptions opts;
+    default_server_options(&opts);
+    opts.borrowed_views = true;
+
+    puts("starting server");
+    if (!start_server_opts(addr, sizeof(*addr), &opts)) {
+        perror("failed to start server");
+        free(addr);
+        return EXIT_FAILURE;
+    }
+
+    puts("connecting to server");
+    if (!start_sending(addr, sizeof(*addr))) {
+        perror("failed to start sending");
+        free(addr);
+        return EXIT_FAILURE;
+    }
+
+    free(addr);
+    addr = NULL;
+
+    puts("sending messages");
+    for (unsigned int i = 0; i < num_messages; i++) {
+        if (!send_message(&msg)) {
+            perror("failed to send message");
+            return EXIT_FAILURE;
+        }
+    }
+
+    puts("disconnecting");
+    stop_sending();
+
+    // hold on to every item so that the receive buffers are shared between them
+    BufferItem **items = malloc(num_messages * sizeof(BufferItem *));
+    assert(NULL != items);
+    for (unsigned int i = 0; i < num_messages; i++) {
+        items[i] = read_message();
+        assert(NULL != items[i]);
+        assert(HARD_ERROR_VALVE == items[i]->msg.type);
+        assert(3 == items[i]->msg.data.hardware_valve.valve_no);
+        assert(NULL != items[i]->chunk);
+    }
+    for (unsigned int i = 0; i < num_messages; i++) {
+        assert(0 == strcmp(test_message, bufferitem_text(items[i])));
+        free_bufferitem(items[i]);
+    }
+    free(items);
+
+    // locally generated messages are not borrowed
+    BufferItem *disconnect = read_message();
+    assert(NULL != disconnect);
+    assert(SOFT_ERROR == disconnect->msg.type);
+    assert(NULL == disconnect->chunk);
+    assert(0 == strcmp("Connection closed", bufferitem_text(disconnect)));
+    free_bufferitem(disconnect);
+
+    free_message(&msg);
+
+    puts("stopping server");
+    stop_server();
+
+    puts("passed");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,126 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * test/coalesce.c
+ * test for the sender coalescing repeated messages
+ */
+
+// includes
+#include "config.h"
+#include "edsac_representation.h"
+#include "edsac_sending.h"
+#include "edsac_arguments.h"
+#include "helpers.h"
+#include <stdlib.h>
+#include <assert.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+
+#define NUM_REPEATS 50
+
+// the repeat fields survive encoding and both ways of decoding
+static void test_representation(void) {
+    Message msg;
+    hardware_error_valve(&msg, 3, "valve stuck");
+    msg.repeat.count = 12;
+    msg.repeat.first_ms = 1500000000123;
+    msg.repeat.last_ms = 1500000004567;
+
+    char *encoded = NULL;
+    assert(-1 != encode_message(&msg, &encoded));
+
+    Message decoded;
+    assert(decode_message(encoded, &decoded));
+    assert(12 == decoded.repeat.count);
+    assert(1500000000123 == decoded.repeat.first_ms);
+    assert(1500000004567 == decoded.repeat.last_ms);
+    free_message(&decoded);
+
+    const char *text;
+    assert(decode_message_inplace(encoded, strlen(encoded), &decoded, &text));
+    assert(0 == strcmp("valve stuck", text));
+    assert(12 == decoded.repeat.count);
+    assert(1500000000123 == decoded.repeat.first_ms);
+    assert(1500000004567 == decoded.repeat.last_ms);
+    free(encoded);
+
+    // and are left out of ordinary messages
+    msg.repeat.count = 0;
+    assert(-1 != encode_message(&msg, &encoded));
+    assert(NULL == strstr(encoded, "repeat"));
+    assert(decode_message(encoded, &decoded));
+    assert(0 == decoded.repeat.count);
+    free_message(&decoded);
+    free(encoded);
+    free_message(&msg);
+}
+
+// reads a HARD_ERROR_VALVE and checks its valve number and repeat count
+static void expect(int fd, int valve_no, uint32_t repeats) {
+    Message msg;
+    read_json_message(fd, &msg);
+    printf("valve %i repeated %u times\n", msg.data.hardware_valve.valve_no, msg.repeat.count);
+    assert(HARD_ERROR_VALVE == msg.type);
+    assert(valve_no == msg.data.hardware_valve.valve_no);
+    assert(repeats == msg.repeat.count);
+    if (0 != repeats)
+        assert(msg.repeat.first_ms <= msg.repeat.last_ms);
+    free_message(&msg);
+}
+
+static void test_sender(void) {
+    struct sockaddr *addr = alloc_addr("127.0.0.1", 2013);
+    assert(NULL != addr);
+    int listen_fd = listen_on(addr, sizeof(*addr));
+
+    SendingOptions opts;
+    default_sending_options(&opts);
+    opts.coalesce_window = 1;
+    assert(start_sending_opts(addr, sizeof(*addr), &opts));
+    int conn = accept_sender(listen_fd);
+
+    // the first is sent straight away and the rest once the window closes
+    Message msg;
+    hardware_error_valve(&msg, 7, "valve stuck");
+    for (int i = 0; i < NUM_REPEATS; i++)
+        assert(send_message(&msg));
+    expect(conn, 7, 0);
+    expect(conn, 7, NUM_REPEATS - 1);
+
+    // a persistent fault keeps being coalesced
+    for (int i = 0; i < NUM_REPEATS; i++)
+        assert(send_message(&msg));
+    expect(conn, 7, NUM_REPEATS);
+
+    // a different message flushes the repeats first
+    msg.data.hardware_valve.valve_no = 8;
+    for (int i = 0; i < 3; i++)
+        assert(send_message(&msg));
+    msg.data.hardware_valve.valve_no = 9;
+    assert(send_message(&msg));
+    assert(send_message(&msg));
+    expect(conn, 8, 0);
+    expect(conn, 8, 2);
+    expect(conn, 9, 0);
+
+    // stopping sends what is left
+    stop_sending();
+    expect(conn, 9, 1);
+
+    close(conn);
+    close(listen_fd);
+    free_message(&msg);
+    free(addr);
+}
+
+int main(void) {
+    test_representation();
+    test_sender();
+
+    puts("passed");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,198 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * test/compress.c
+ * test for the block compressor and compressed batch frames
+ */
+
+// includes
+#include "config.h"
+#include "edsac_server.h"
+#include "edsac_sending.h"
+#include "edsac_representation.h"
+#include "edsac_arguments.h"
+#include "edsac_compress.h"
+#include "helpers.h"
+#include <stdlib.h>
+#include <assert.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#define FAKE_PORT 2031
+#define SERVER_PORT 2032
+#define NUM_QUEUED 20
+#define VALVE_TEXT "valve failed to close"
+
+// compresses and expands src, returning the compressed length
+static size_t round_trip(const char *src, size_t len) {
+    char *compressed = malloc(COMPRESS_BOUND(len));
+    char *expanded = malloc(len + 1);
+    assert((NULL != compressed) && (NULL != expanded));
+
+    size_t compressed_len = compress_block(src, len, compressed);
+    assert(compressed_len <= COMPRESS_BOUND(len));
+    assert(decompress_block(compressed, compressed_len, expanded, len));
+    assert(0 == memcmp(src, expanded, len));
+
+    // the length has to be right and the block complete
+    assert(!decompress_block(compressed, compressed_len, expanded, len + 1));
+    if (len > 0)
+        assert(!decompress_block(compressed, compressed_len, expanded, len - 1));
+    if (compressed_len > 1)
+        assert(!decompress_block(compressed, compressed_len - 1, expanded, len));
+
+    free(compressed);
+    free(expanded);
+    return compressed_len;
+}
+
+static void test_codec(void) {
+    round_trip("", 0);
+    round_trip("a", 1);
+    round_trip("abcdefghijklmnopqrstuvwxyz", 26);
+
+    // alert texts repeat a lot
+    char alerts[MAX_BATCH_LEN];
+    size_t len = 0;
+    for (int i = 0; len + 100 < sizeof(alerts); i++)
+        len += (size_t) snprintf(alerts + len, sizeof(alerts) - len,
+                "{\"version\":2,\"data\":{\"message\":\"valve %i failed\",\"valve_no\":%i},\"type\":\"HARD_ERROR_VALVE\"}",
+                i, i);
+    size_t compressed_len = round_trip(alerts, len);
+    printf("alerts: %zu -> %zu bytes\n", len, compressed_len);
+    assert(compressed_len * 4 < len);
+
+    // long runs need extra length bytes for both literals and matches
+    char *runs = malloc(MAX_COMPRESS_LEN);
+    assert(NULL != runs);
+    memset(runs, 'x', MAX_COMPRESS_LEN);
+    compressed_len = round_trip(runs, MAX_COMPRESS_LEN);
+    assert(compressed_len < 400);
+
+    // and things which don't compress come out a little longer
+    unsigned int seed = 1;
+    for (size_t i = 0; i < MAX_COMPRESS_LEN; i++)
+        runs[i] = (char) rand_r(&seed);
+    compressed_len = round_trip(runs, MAX_COMPRESS_LEN);
+    assert(compressed_len > MAX_COMPRESS_LEN);
+    free(runs);
+
+    // a match can't reach back before the start
+    const char bad[] = {0x10, 'a', 2, 0};
+    char out[16];
+    assert(!decompress_block(bad, sizeof(bad), out, 5));
+}
+
+// the first byte after the sender's hello
+static char first_frame_byte(int fd) {
+    // the hello is a KEEP_ALIVE, which has no strings for braces to hide in
+    char hello[MAX_ENCODED_LEN + 1];
+    read_json_frame(fd, hello);
+
+    char c;
+    assert(1 == read(fd, &c, 1));
+    return c;
+}
+
+// batches are only compressed off this host unless asked to
+static void test_wire(CompressMode compress, char expected) {
+    struct sockaddr *addr = alloc_addr("127.0.0.1", FAKE_PORT);
+    SendingOptions opts;
+    lazy_options(&opts);
+    opts.batch = BATCH_BINARY;
+    opts.compress = compress;
+    start_lazy(addr, &opts, VALVE_TEXT, NUM_QUEUED);
+
+    int listen_fd = listen_on(addr, sizeof(*addr));
+    int fd = accept_sender(listen_fd);
+
+    assert(expected == first_frame_byte(fd));
+
+    stop_sending();
+    close(fd);
+    close(listen_fd);
+    free(addr);
+}
+
+// the server expands compressed batches into their messages
+static void test_server(BatchFormat batch) {
+    struct sockaddr *addr = alloc_addr("127.0.0.1", SERVER_PORT);
+    SendingOptions opts;
+    lazy_options(&opts);
+    opts.batch = batch;
+    opts.compress = COMPRESS_ALWAYS;
+    start_lazy(addr, &opts, VALVE_TEXT, NUM_QUEUED);
+
+    ServerOptions server_opts;
+    default_server_options(&server_opts);
+    server_opts.borrowed_views = true;
+    assert(start_server_opts(addr, sizeof(*addr), &server_opts));
+
+    queue_valves(VALVE_TEXT, NUM_QUEUED, NUM_QUEUED);
+    for (int i = 0; i < 2 * NUM_QUEUED; i++) {
+        BufferItem *item = wait_message();
+        assert(NULL != item);
+        assert(HARD_ERROR_VALVE == item->msg.type);
+        assert(i == item->msg.data.hardware_valve.valve_no);
+        assert(0 == strcmp(VALVE_TEXT, bufferitem_text(item)));
+        free_bufferitem(item);
+    }
+
+    stop_sending();
+    BufferItem *item = wait_message();
+    assert(NULL != item);
+    assert(0 == strcmp("Connection closed", bufferitem_text(item)));
+    free_bufferitem(item);
+
+    // a sender which didn't say it would compress is cut off
+    int fd = connect_to(addr);
+    const char batch_frame[] = {BINARY_BATCH, 0, 0};
+    char frame[COMPRESSED_FRAME_HEADER_LEN + 16];
+    size_t block_len = compress_block(batch_frame, sizeof(batch_frame), frame + COMPRESSED_FRAME_HEADER_LEN);
+    const char header[] = {COMPRESSED_FRAME, 0, (char) block_len, 0, sizeof(batch_frame)};
+    memcpy(frame, header, sizeof(header));
+    assert((ssize_t) (sizeof(header) + block_len) == write(fd, frame, sizeof(header) + block_len));
+
+    GSList *connections = NULL;
+    for (int i = 0; i < 200; i++) {
+        g_slist_free_full(connections, free);
+        connections = get_connection_stats();
+        if (NULL == connections)
+            break;
+        usleep(10000);
+    }
+    assert(NULL == connections);
+    close(fd);
+
+    // and no more is needed to make it acceptable than the announcement
+    fd = connect_to(addr);
+    const char *hello = "{\"version\":2,\"data\":{},\"type\":\"KEEP_ALIVE\",\"caps\":4}";
+    write_str(fd, hello);
+    assert((ssize_t) (sizeof(header) + block_len) == write(fd, frame, sizeof(header) + block_len));
+    usleep(100000);
+    connections = get_connection_stats();
+    assert(1 == g_slist_length(connections));
+    g_slist_free_full(connections, free);
+    close(fd);
+    item = wait_message();
+    assert(NULL != item);
+    assert(0 == strcmp("Connection closed", bufferitem_text(item)));
+    free_bufferitem(item);
+
+    stop_server();
+    free(addr);
+}
+
+int main(void) {
+    test_codec();
+    test_wire(COMPRESS_ALWAYS, COMPRESSED_FRAME);
+    test_wire(COMPRESS_AUTO, BINARY_BATCH);
+    test_server(BATCH_BINARY);
+    test_server(BATCH_JSON);
+
+    puts("passed");
+    return EXIT_SUCCESS;
+}
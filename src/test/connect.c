@@ -0,0 +1,117 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * test/connect.c
+ * tests for the connect timeout and for connecting lazily
+ */
+
+// includes
+#include "config.h"
+#include "edsac_representation.h"
+#include "edsac_sending.h"
+#include "edsac_arguments.h"
+#include "helpers.h"
+#include <stdlib.h>
+#include <assert.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+
+#define NUM_QUEUED 5
+#define NUM_BLOCKERS 4
+
+static long elapsed_ms(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+// a server whose accept queue is full ignores new connections so connect fails after the timeout
+static void test_timeout(void) {
+    struct sockaddr *addr = alloc_addr("127.0.0.1", 2015);
+    assert(NULL != addr);
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    assert(-1 != listen_fd);
+    int yes = 1;
+    assert(0 == setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)));
+    assert(0 == bind(listen_fd, addr, sizeof(*addr)));
+    assert(0 == listen(listen_fd, 0));
+
+    // fill the accept queue
+    int blockers[NUM_BLOCKERS];
+    for (int i = 0; i < NUM_BLOCKERS; i++) {
+        blockers[i] = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        assert(-1 != blockers[i]);
+        connect(blockers[i], addr, sizeof(*addr));
+    }
+    usleep(100000);
+
+    SendingOptions opts;
+    default_sending_options(&opts);
+    opts.connect_timeout_ms = 200;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    assert(!start_sending_opts(addr, sizeof(*addr), &opts));
+    long waited = elapsed_ms(&start);
+    printf("connect gave up after %li ms\n", waited);
+    assert((waited >= 150) && (waited < 2000));
+
+    for (int i = 0; i < NUM_BLOCKERS; i++)
+        close(blockers[i]);
+    close(listen_fd);
+    free(addr);
+}
+
+// start_sending returns before there is a server. Messages wait for it
+static void test_lazy(void) {
+    struct sockaddr *addr = alloc_addr("127.0.0.1", 2016);
+    assert(NULL != addr);
+
+    SendingOptions opts;
+    default_sending_options(&opts);
+    opts.reconnect = true;
+    opts.reconnect_min_ms = 20;
+    opts.reconnect_max_ms = 200;
+    opts.lazy_connect = true;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    assert(start_sending_opts(addr, sizeof(*addr), &opts));
+    assert(elapsed_ms(&start) < 100);
+
+    Message msg;
+    hardware_error_valve(&msg, 0, "valve stuck");
+    for (int i = 0; i < NUM_QUEUED; i++) {
+        msg.data.hardware_valve.valve_no = i;
+        assert(send_message(&msg));
+    }
+
+    puts("starting the server");
+    int listen_fd = listen_on(addr, sizeof(*addr));
+    int conn = accept_sender(listen_fd);
+    for (int i = 0; i < NUM_QUEUED; i++)
+        assert(i == read_valve_no(conn));
+
+    // and then it's business as usual
+    msg.data.hardware_valve.valve_no = NUM_QUEUED;
+    assert(send_message(&msg));
+    assert(NUM_QUEUED == read_valve_no(conn));
+
+    stop_sending();
+    close(conn);
+    close(listen_fd);
+    free_message(&msg);
+    free(addr);
+}
+
+int main(void) {
+    test_timeout();
+    test_lazy();
+
+    puts("passed");
+    return EXIT_SUCCESS;
+}
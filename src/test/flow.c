@@ -0,0 +1,89 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * test/flow.c
+ * test for the server granting credit and the sender waiting for it
+ */
+
+// includes
+#include "config.h"
+#include "edsac_server.h"
+#include "edsac_sending.h"
+#include "edsac_representation.h"
+#include "edsac_arguments.h"
+#include "helpers.h"
+#include <stdlib.h>
+#include <assert.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#define PORT 2028
+#define SENT 100
+#define QUEUE_LEN 64
+#define READ_QUEUE_LIMIT 16
+
+int main(void) {
+    struct sockaddr *addr = alloc_addr("127.0.0.1", PORT);
+    assert(NULL != addr);
+
+    ServerOptions server_opts;
+    default_server_options(&server_opts);
+    server_opts.credit_window = 8;
+    server_opts.read_queue_limit = READ_QUEUE_LIMIT;
+    assert(start_server_opts(addr, sizeof(*addr), &server_opts));
+
+    SendingOptions opts;
+    default_sending_options(&opts);
+    opts.flow_control = true;
+    opts.queue_len = QUEUE_LEN;
+    assert(start_sending_opts(addr, sizeof(*addr), &opts));
+
+    // nothing is read so the server stops granting credit. The rest waits on the sender's queue until it is full, then
+    // send_message fails straight away
+    int accepted[SENT];
+    int num_accepted = 0;
+    for (int i = 0; i < SENT; i++) {
+        Message msg;
+        hardware_error_valve(&msg, i, "valve stuck");
+        if (send_message(&msg))
+            accepted[num_accepted++] = i;
+        free_message(&msg);
+    }
+    printf("%i accepted\n", num_accepted);
+    assert((num_accepted >= QUEUE_LEN) && (num_accepted < SENT));
+
+    // the server's signals cut sleeps short so watch the queue for a while rather than sleeping once
+    size_t deepest = 0;
+    for (int i = 0; i < 50; i++) {
+        usleep(10000);
+        PipelineDepths depths;
+        get_pipeline_depths(&depths);
+        if (depths.read_queue > deepest)
+            deepest = depths.read_queue;
+    }
+    printf("%zu waiting for read_message\n", deepest);
+    assert((0 != deepest) && (deepest <= READ_QUEUE_LIMIT));
+
+    // reading makes room so the sender gets going again
+    for (int i = 0; i < num_accepted; i++) {
+        BufferItem *item = wait_message();
+        assert(NULL != item);
+        assert(HARD_ERROR_VALVE == item->msg.type);
+        assert(accepted[i] == item->msg.data.hardware_valve.valve_no);
+        free_bufferitem(item);
+    }
+
+    stop_sending();
+    BufferItem *item = wait_message();
+    assert(NULL != item);
+    assert(0 == strcmp("Connection closed", bufferitem_text(item)));
+    free_bufferitem(item);
+
+    stop_server();
+    free(addr);
+
+    puts("passed");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,256 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * test/handshake.c
+ * test for agreeing the version and encodings when a sender connects
+ */
+
+// includes
+#include "config.h"
+#include "edsac_server.h"
+#include "edsac_sending.h"
+#include "edsac_representation.h"
+#include "edsac_arguments.h"
+#include "helpers.h"
+#include <stdlib.h>
+#include <assert.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#define FAKE_PORT 2033
+#define SERVER_PORT 2034
+#define NUM_QUEUED 20
+#define VALVE_TEXT "valve leaking"
+
+#define UNVERSIONED "{\"data\":{\"message\":\"no version\"},\"type\":\"SOFT_ERROR\"}"
+
+// waits for a message with this text
+static void expect_text(const char *text) {
+    BufferItem *item = wait_message();
+    assert(NULL != item);
+    assert(0 == strcmp(text, bufferitem_text(item)));
+    free_bufferitem(item);
+}
+
+// only the agreed decoders skip the version
+static void test_representation(void) {
+    const char *v3 = "{\"version\":3,\"data\":{\"message\":\"from the future\"},\"type\":\"SOFT_ERROR\"}";
+    char frame[MAX_ENCODED_LEN];
+    Message msg;
+    const char *text;
+    MessageRoute route;
+
+    assert(!decode_message_route(v3, strlen(v3), &route));
+    assert(decode_agreed_message_route(v3, strlen(v3), &route) && (SOFT_ERROR == route.type));
+    assert(decode_agreed_message_route(UNVERSIONED, strlen(UNVERSIONED), &route) && (SOFT_ERROR == route.type));
+
+    strcpy(frame, v3);
+    assert(!decode_message_inplace(frame, strlen(frame), &msg, &text));
+    assert(decode_agreed_message_inplace(frame, strlen(frame), &msg, &text));
+    assert(0 == strcmp("from the future", text));
+
+    assert(!decode_message(UNVERSIONED, &msg));
+    assert(decode_agreed_message(UNVERSIONED, &msg));
+    assert(0 == strcmp("no version", msg.data.software.message->str));
+    free_message(&msg);
+
+    // the type is still needed
+    const char *untyped = "{\"version\":2,\"data\":{}}";
+    assert(!decode_agreed_message_route(untyped, strlen(untyped), &route));
+}
+
+// reads one control frame (they have no strings for braces to hide in) and returns its caps
+static uint32_t read_reply(int fd) {
+    char frame[MAX_ENCODED_LEN + 1];
+    size_t len = read_json_frame(fd, frame);
+
+    MessageRoute route;
+    assert(decode_message_route(frame, len, &route));
+    assert(KEEP_ALIVE == route.type);
+    return route.caps;
+}
+
+// writes a handshake reply agreeing to caps
+static void write_reply(int fd, uint32_t caps) {
+    Message msg;
+    keep_alive(&msg);
+    msg.caps = CAP_HANDSHAKE | caps;
+    char encoded[MAX_ENCODED_LEN];
+    assert(-1 != encode_message_buf(&msg, encoded, sizeof(encoded)));
+    write_str(fd, encoded);
+}
+
+// the server replies with what it agrees to and then stops checking versions
+static void test_server_reply(unsigned int decode_workers, bool borrowed_views) {
+    struct sockaddr *addr = alloc_addr("127.0.0.1", SERVER_PORT);
+    ServerOptions server_opts;
+    default_server_options(&server_opts);
+    server_opts.decode_workers = decode_workers;
+    server_opts.borrowed_views = borrowed_views;
+    server_opts.caps = CAP_BATCH_JSON | CAP_COMPACT_KEEP_ALIVE;
+    assert(start_server_opts(addr, sizeof(*addr), &server_opts));
+
+    int fd = connect_to(addr);
+    Message hello;
+    keep_alive(&hello);
+    hello.caps = CAP_HANDSHAKE | CAP_BATCH_JSON | CAP_BATCH_BINARY | CAP_COMPRESS;
+    char encoded[MAX_ENCODED_LEN];
+    assert(-1 != encode_message_buf(&hello, encoded, sizeof(encoded)));
+    write_str(fd, encoded);
+    assert((CAP_HANDSHAKE | CAP_BATCH_JSON) == read_reply(fd));
+
+    write_str(fd, UNVERSIONED);
+    expect_text("no version");
+    close(fd);
+    expect_text("Connection closed");
+
+    // without a handshake every message is checked
+    fd = connect_to(addr);
+    write_str(fd, UNVERSIONED);
+    expect_text("Could not decode message");
+    close(fd);
+    expect_text("Connection closed");
+
+    stop_server();
+    free(addr);
+}
+
+// a server set not to acknowledge or grant credit doesn't agree to either
+static void test_server_no_control(void) {
+    struct sockaddr *addr = alloc_addr("127.0.0.1", SERVER_PORT);
+    ServerOptions server_opts;
+    default_server_options(&server_opts);
+    server_opts.ack_every = 0;
+    server_opts.credit_window = 0;
+    assert(start_server_opts(addr, sizeof(*addr), &server_opts));
+
+    int fd = connect_to(addr);
+    Message hello;
+    keep_alive(&hello);
+    hello.caps = CAP_HANDSHAKE | CAP_ACKS | CAP_CREDIT | CAP_BATCH_JSON;
+    char encoded[MAX_ENCODED_LEN];
+    assert(-1 != encode_message_buf(&hello, encoded, sizeof(encoded)));
+    write_str(fd, encoded);
+    assert((CAP_HANDSHAKE | CAP_BATCH_JSON) == read_reply(fd));
+    close(fd);
+    expect_text("Connection closed");
+
+    stop_server();
+    free(addr);
+}
+
+// a sender asking for everything the handshake can agree
+static void handshake_options(SendingOptions *opts) {
+    lazy_options(opts);
+    opts->batch = BATCH_BINARY;
+    opts->compress = COMPRESS_ALWAYS;
+    opts->compact_keep_alive = true;
+    opts->handshake = true;
+}
+
+// the sender only uses what the server agreed to, and nothing new if it doesn't reply at all
+static void test_sender(bool reply, uint32_t agreed, char expected) {
+    struct sockaddr *addr = alloc_addr("127.0.0.1", FAKE_PORT);
+    SendingOptions opts;
+    handshake_options(&opts);
+    start_lazy(addr, &opts, VALVE_TEXT, NUM_QUEUED);
+
+    int listen_fd = listen_on(addr, sizeof(*addr));
+    int fd = accept_sender(listen_fd);
+
+    uint32_t wanted = CAP_HANDSHAKE | CAP_BATCH_BINARY | CAP_COMPRESS | CAP_COMPACT_KEEP_ALIVE;
+    assert(wanted == read_reply(fd));
+    if (reply)
+        write_reply(fd, agreed);
+
+    char c;
+    assert(1 == read(fd, &c, 1));
+    assert(expected == c);
+
+    stop_sending();
+    close(fd);
+    close(listen_fd);
+    free(addr);
+}
+
+// a sender wanting acks and credit from a server which agrees to neither writes straight away, releases what it has
+// written without waiting for an ACK and so never times the connection out
+static void test_sender_no_control(void) {
+    struct sockaddr *addr = alloc_addr("127.0.0.1", FAKE_PORT);
+    SendingOptions opts;
+    lazy_options(&opts);
+    opts.handshake = true;
+    opts.acks = true;
+    opts.ack_timeout_ms = 200;
+    opts.flow_control = true;
+    start_lazy(addr, &opts, VALVE_TEXT, NUM_QUEUED);
+
+    int listen_fd = listen_on(addr, sizeof(*addr));
+    int fd = accept_sender(listen_fd);
+    assert((CAP_HANDSHAKE | CAP_ACKS | CAP_CREDIT) == read_reply(fd));
+    double replied = monotonic_now();
+    write_reply(fd, 0);
+
+    // well within the second a server which might grant credit is given
+    assert(0 == read_valve_no(fd));
+    assert(monotonic_now() - replied < 0.5);
+    for (int i = 1; i < NUM_QUEUED; i++)
+        assert(i == read_valve_no(fd));
+
+    // a timed out connection would be closed here, and the messages written again on the next one
+    usleep(3 * opts.ack_timeout_ms * 1000);
+    queue_valves(VALVE_TEXT, NUM_QUEUED, 1);
+    assert(NUM_QUEUED == read_valve_no(fd));
+
+    stop_sending();
+    close(fd);
+    close(listen_fd);
+    free(addr);
+}
+
+// a real server which refuses compression still gets everything, batched
+static void test_round_trip(void) {
+    struct sockaddr *addr = alloc_addr("127.0.0.1", SERVER_PORT);
+    SendingOptions opts;
+    handshake_options(&opts);
+    start_lazy(addr, &opts, VALVE_TEXT, NUM_QUEUED);
+
+    ServerOptions server_opts;
+    default_server_options(&server_opts);
+    server_opts.caps = SERVER_CAPS & ~(uint32_t) CAP_COMPRESS;
+    assert(start_server_opts(addr, sizeof(*addr), &server_opts));
+
+    queue_valves(VALVE_TEXT, NUM_QUEUED, NUM_QUEUED);
+    for (int i = 0; i < 2 * NUM_QUEUED; i++) {
+        BufferItem *item = wait_message();
+        assert(NULL != item);
+        assert(HARD_ERROR_VALVE == item->msg.type);
+        assert(i == item->msg.data.hardware_valve.valve_no);
+        assert(0 == strcmp(VALVE_TEXT, bufferitem_text(item)));
+        free_bufferitem(item);
+    }
+
+    stop_sending();
+    expect_text("Connection closed");
+
+    stop_server();
+    free(addr);
+}
+
+int main(void) {
+    test_representation();
+    test_server_reply(0, false);
+    test_server_reply(2, true);
+    test_sender(true, CAP_BATCH_BINARY | CAP_COMPRESS, COMPRESSED_FRAME);
+    test_sender(true, CAP_BATCH_BINARY, BINARY_BATCH);
+    test_sender(false, 0, '{');
+    test_server_no_control();
+    test_sender_no_control();
+    test_round_trip();
+
+    puts("passed");
+    return EXIT_SUCCESS;
+}
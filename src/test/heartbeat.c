@@ -0,0 +1,82 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * test/heartbeat.c
+ * test for the server accepting compact KEEP_ALIVEs between messages
+ */
+
+// includes
+#include "config.h"
+#include "edsac_server.h"
+#include "edsac_representation.h"
+#include "edsac_arguments.h"
+#include "helpers.h"
+#include <stdlib.h>
+#include <assert.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/socket.h>
+
+// writes compact and JSON KEEP_ALIVEs around two messages and checks that only the messages come out
+int main(void) {
+    const char *test_message = "hello world!";
+
+    struct sockaddr *addr = alloc_addr("127.0.0.1", 2008);
+    assert(NULL != addr);
+
+    puts("starting server");
+    if (!start_server(addr, sizeof(*addr))) {
+        perror("failed to start server");
+        free(addr);
+        return EXIT_FAILURE;
+    }
+
+    Message msg;
+    hardware_error_valve(&msg, 7, test_message);
+    char *encoded = NULL;
+    assert(-1 != encode_message(&msg, &encoded));
+
+    char keep_alive[] = {COMPACT_KEEP_ALIVE};
+    const char *json_keep_alive = "{\"version\":2,\"data\":{},\"type\":\"KEEP_ALIVE\"}";
+    GString *stream = g_string_new(NULL);
+    g_string_append_len(stream, keep_alive, 1);
+    g_string_append(stream, encoded);
+    g_string_append_len(stream, keep_alive, 1);
+    g_string_append_len(stream, keep_alive, 1);
+    g_string_append(stream, json_keep_alive);
+    g_string_append(stream, encoded);
+    g_string_append_len(stream, keep_alive, 1);
+    free(encoded);
+
+    puts("connecting to server");
+    int fd = connect_to(addr);
+    free(addr);
+    assert((ssize_t) stream->len == write(fd, stream->str, stream->len));
+    g_string_free(stream, TRUE);
+    close(fd);
+
+    for (int i = 0; i < 2; i++) {
+        BufferItem *item = wait_message();
+        assert(NULL != item);
+        assert(HARD_ERROR_VALVE == item->msg.type);
+        assert(7 == item->msg.data.hardware_valve.valve_no);
+        assert(0 == strcmp(test_message, bufferitem_text(item)));
+        free_bufferitem(item);
+    }
+
+    // an unexpected byte would have been a read error, which closes the connection without reporting it
+    BufferItem *disconnect = wait_message();
+    assert(NULL != disconnect);
+    assert(SOFT_ERROR == disconnect->msg.type);
+    assert(0 == strcmp("Connection closed", bufferitem_text(disconnect)));
+    free_bufferitem(disconnect);
+
+    free_message(&msg);
+
+    puts("stopping server");
+    stop_server();
+
+    puts("passed");
+    return EXIT_SUCCESS;
+}
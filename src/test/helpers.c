@@ -0,0 +1,150 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * test/helpers.c
+ * Shared pieces of the tests
+ */
+
+// includes
+#include "config.h"
+#include "helpers.h"
+#include "edsac_representation.h"
+#include <stdbool.h>
+#include <assert.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+
+// seconds since some fixed point
+double monotonic_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+// a listening socket standing in for the server (see helpers.h)
+int listen_on(const struct sockaddr *addr, socklen_t addrlen) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    assert(-1 != fd);
+    int yes = 1;
+    assert(0 == setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)));
+    assert(0 == bind(fd, addr, addrlen));
+    assert(0 == listen(fd, 1));
+    return fd;
+}
+
+// accepts the sender's connection (see helpers.h)
+int accept_sender(int listen_fd) {
+    int fd = accept(listen_fd, NULL, NULL);
+    assert(-1 != fd);
+    struct timeval timeout = {.tv_sec = 5, .tv_usec = 0};
+    assert(0 == setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)));
+    return fd;
+}
+
+// connects to the server (see helpers.h)
+int connect_to(const struct sockaddr *addr) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    assert(-1 != fd);
+    assert(0 == connect(fd, addr, sizeof(*addr)));
+    struct timeval timeout = {.tv_sec = 5, .tv_usec = 0};
+    assert(0 == setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)));
+    return fd;
+}
+
+// writes all of str (see helpers.h)
+void write_str(int fd, const char *str) {
+    assert((ssize_t) strlen(str) == write(fd, str, strlen(str)));
+}
+
+// finds the sender's socket (see helpers.h)
+int find_sender_fd(uint16_t port) {
+    for (int fd = 3; fd < 1024; fd++) {
+        struct sockaddr_in peer;
+        socklen_t len = sizeof(peer);
+        if ((0 == getpeername(fd, (struct sockaddr *) &peer, &len)) && (AF_INET == peer.sin_family) &&
+                (htons(port) == peer.sin_port))
+            return fd;
+    }
+    assert(false);
+    return -1;
+}
+
+// reads one frame from fd (see helpers.h)
+size_t read_json_frame(int fd, char frame[MAX_ENCODED_LEN + 1]) {
+    size_t len = 0;
+    int nest = 0;
+    do {
+        assert(len < MAX_ENCODED_LEN);
+        assert(1 == read(fd, &frame[len], 1));
+        if ('{' == frame[len])
+            nest++;
+        else if ('}' == frame[len])
+            nest--;
+        len++;
+    } while (0 != nest);
+    frame[len] = '\0';
+    return len;
+}
+
+// reads the next message which isn't a KEEP_ALIVE (see helpers.h)
+void read_json_message(int fd, Message *msg) {
+    while (true) {
+        char frame[MAX_ENCODED_LEN + 1];
+        read_json_frame(fd, frame);
+        assert(decode_message(frame, msg));
+        if (KEEP_ALIVE != msg->type)
+            return;
+        free_message(msg);
+    }
+}
+
+// reads the next HARD_ERROR_VALVE message from fd (see helpers.h)
+int read_valve_no(int fd) {
+    Message msg;
+    read_json_message(fd, &msg);
+    assert(HARD_ERROR_VALVE == msg.type);
+    int valve_no = msg.data.hardware_valve.valve_no;
+    free_message(&msg);
+    return valve_no;
+}
+
+// read_message but waits for something to arrive (see helpers.h)
+BufferItem *wait_message(void) {
+    for (int i = 0; i < 200; i++) {
+        BufferItem *item = read_message();
+        if (NULL != item)
+            return item;
+        usleep(10000);
+    }
+    return NULL;
+}
+
+// sends numbered HARD_ERROR_VALVE messages (see helpers.h)
+void queue_valves(const char *text, int first, int count) {
+    Message msg;
+    hardware_error_valve(&msg, 0, text);
+    for (int i = first; i < first + count; i++) {
+        msg.data.hardware_valve.valve_no = i;
+        assert(send_message(&msg));
+    }
+    free_message(&msg);
+}
+
+// options for a lazily connecting sender (see helpers.h)
+void lazy_options(SendingOptions *opts) {
+    default_sending_options(opts);
+    opts->async = true;
+    opts->reconnect = true;
+    opts->reconnect_min_ms = 20;
+    opts->reconnect_max_ms = 100;
+    opts->lazy_connect = true;
+}
+
+// starts a lazily connecting sender with messages waiting (see helpers.h)
+void start_lazy(const struct sockaddr *addr, const SendingOptions *opts, const char *text, int count) {
+    assert(start_sending_opts(addr, sizeof(*addr), opts));
+    queue_valves(text, 0, count);
+}
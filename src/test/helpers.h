@@ -0,0 +1,71 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * test/helpers.h
+ * Shared pieces of the tests
+ */
+
+#ifndef EDSAC_TEST_HELPERS_H
+#define EDSAC_TEST_HELPERS_H
+
+// link properly with C++
+#ifdef _cplusplus
+extern "C" {
+#endif // _cplusplus
+
+// includes
+#include "edsac_server.h"
+#include "edsac_sending.h"
+#include "edsac_representation.h"
+#include <stdint.h>
+#include <sys/socket.h>
+
+// declarations
+
+// seconds since some fixed point
+double monotonic_now(void);
+
+// a listening socket standing in for the server
+int listen_on(const struct sockaddr *addr, socklen_t addrlen);
+
+// accepts the sender's connection. Reads time out so that a broken sender fails the test instead of hanging it
+int accept_sender(int listen_fd);
+
+// a connection to addr standing in for a sender. Reads time out as with accept_sender
+int connect_to(const struct sockaddr *addr);
+
+// writes all of str to fd
+void write_str(int fd, const char *str);
+
+// the sender's end of its connection to port: the only socket in this process whose peer is on port
+int find_sender_fd(uint16_t port);
+
+// reads one JSON frame from fd into frame, nul terminated, and returns its length
+// the frame must contain no braces in its strings because counting them is how its end is found
+size_t read_json_frame(int fd, char frame[MAX_ENCODED_LEN + 1]);
+
+// reads and decodes the next message from fd which isn't a KEEP_ALIVE (see read_json_frame)
+void read_json_message(int fd, Message *msg);
+
+// reads the next HARD_ERROR_VALVE message from fd and returns its valve number. KEEP_ALIVEs are skipped
+// (see read_json_frame)
+int read_valve_no(int fd);
+
+// read_message but waits up to a couple of seconds for something to arrive
+BufferItem *wait_message(void);
+
+// sends count HARD_ERROR_VALVE messages with this text, numbered from first
+void queue_valves(const char *text, int first, int count);
+
+// options for a sender whose messages queue up until the server is there, so that the writer has a batch's worth
+// waiting when it connects
+void lazy_options(SendingOptions *opts);
+
+// starts such a sender and queues count messages, numbered from 0
+void start_lazy(const struct sockaddr *addr, const SendingOptions *opts, const char *text, int count);
+
+#ifdef _cplusplus
+}
+#endif // _cplusplus
+
+#endif // EDSAC_TEST_HELPERS_H
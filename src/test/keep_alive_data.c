@@ -0,0 +1,81 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * test/keep_alive_data.c
+ * test that a connection carrying messages needs no KEEP_ALIVEs
+ */
+
+// includes
+#include "config.h"
+#include "edsac_server.h"
+#include "edsac_sending.h"
+#include "edsac_representation.h"
+#include "edsac_arguments.h"
+#include "helpers.h"
+#include <stdlib.h>
+#include <assert.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#define SERVER_PORT 4003
+#define FAKE_PORT 4004
+#define GAP 2 // seconds between messages
+#define NUM_MESSAGES ((KEEP_ALIVE_PROD) * 2 / (GAP))
+
+// looping because signals wake it up early
+static void strict_sleep(unsigned int left_to_sleep) {
+    while (0 != left_to_sleep)
+        left_to_sleep = sleep(left_to_sleep);
+}
+
+// the sender writes to a stand-in server which passes each frame on to a real one. For twice KEEP_ALIVE_PROD the
+// sender must write nothing but the messages, and the server must not time the connection out
+int main(void) {
+    struct sockaddr *server_addr = alloc_addr("127.0.0.1", SERVER_PORT);
+    assert(start_server(server_addr, sizeof(*server_addr)));
+    int server_fd = connect_to(server_addr);
+
+    struct sockaddr *fake_addr = alloc_addr("127.0.0.1", FAKE_PORT);
+    int listen_fd = listen_on(fake_addr, sizeof(*fake_addr));
+    assert(start_sending(fake_addr, sizeof(*fake_addr)));
+    int conn = accept_sender(listen_fd);
+
+    Message msg;
+    hardware_error_valve(&msg, 0, "valve stuck");
+    for (int i = 0; i < NUM_MESSAGES; i++) {
+        msg.data.hardware_valve.valve_no = i;
+        assert(send_message(&msg));
+
+        // a KEEP_ALIVE would turn up here instead
+        char frame[MAX_ENCODED_LEN + 1];
+        size_t len = read_json_frame(conn, frame);
+        Message sent;
+        assert(decode_message(frame, &sent));
+        assert((HARD_ERROR_VALVE == sent.type) && (i == sent.data.hardware_valve.valve_no));
+        free_message(&sent);
+
+        // and a "Connection timeout" here
+        assert((ssize_t) len == write(server_fd, frame, len));
+        BufferItem *item = wait_message();
+        assert(NULL != item);
+        assert(HARD_ERROR_VALVE == item->msg.type);
+        assert(i == item->msg.data.hardware_valve.valve_no);
+        free_bufferitem(item);
+
+        strict_sleep(GAP);
+    }
+    free_message(&msg);
+    assert(NULL == read_message());
+    puts("keep_alive_data succeeded");
+
+    stop_sending();
+    close(conn);
+    close(listen_fd);
+    close(server_fd);
+    stop_server();
+    free(server_addr);
+    free(fake_addr);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,168 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * test/multi.c
+ * test for sending to several servers at once
+ */
+
+// includes
+#include "config.h"
+#include "edsac_representation.h"
+#include "edsac_sending.h"
+#include "edsac_arguments.h"
+#include "helpers.h"
+#include <stdlib.h>
+#include <assert.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+
+#define NUM_MIRRORED 10
+#define NUM_FAILOVER 20 // messages sent after the primary goes away
+
+// every message reaches both servers in order
+static void test_mirror(void) {
+    puts("mirror");
+
+    struct sockaddr *primary = alloc_addr("127.0.0.1", 2009);
+    struct sockaddr *backup = alloc_addr("127.0.0.1", 2010);
+    assert((NULL != primary) && (NULL != backup));
+    int primary_listen = listen_on(primary, sizeof(*primary));
+    int backup_listen = listen_on(backup, sizeof(*backup));
+
+    SendingOptions opts;
+    default_sending_options(&opts);
+    opts.uplink_mode = UPLINK_MIRROR;
+    const struct sockaddr *addrs[] = {primary, backup};
+    const socklen_t addrlens[] = {sizeof(*primary), sizeof(*backup)};
+    assert(start_sending_multi(addrs, addrlens, 2, &opts));
+    int primary_conn = accept_sender(primary_listen);
+    int backup_conn = accept_sender(backup_listen);
+
+    Message msg;
+    hardware_error_valve(&msg, 0, "valve stuck");
+    for (int i = 0; i < NUM_MIRRORED; i++) {
+        msg.data.hardware_valve.valve_no = i;
+        assert(send_message(&msg));
+    }
+    for (int i = 0; i < NUM_MIRRORED; i++) {
+        assert(i == read_valve_no(primary_conn));
+        assert(i == read_valve_no(backup_conn));
+    }
+
+    stop_sending();
+    close(primary_conn);
+    close(backup_conn);
+    close(primary_listen);
+    close(backup_listen);
+    free_message(&msg);
+    free(primary);
+    free(backup);
+}
+
+// messages go to the backup once writing to the primary fails
+static void test_failover(void) {
+    puts("failover");
+
+    struct sockaddr *primary = alloc_addr("127.0.0.1", 2011);
+    struct sockaddr *backup = alloc_addr("127.0.0.1", 2012);
+    assert((NULL != primary) && (NULL != backup));
+    int primary_listen = listen_on(primary, sizeof(*primary));
+    int backup_listen = listen_on(backup, sizeof(*backup));
+
+    SendingOptions opts;
+    default_sending_options(&opts);
+    opts.uplink_mode = UPLINK_FAILOVER;
+    const struct sockaddr *addrs[] = {primary, backup};
+    const socklen_t addrlens[] = {sizeof(*primary), sizeof(*backup)};
+    assert(start_sending_multi(addrs, addrlens, 2, &opts));
+    int primary_conn = accept_sender(primary_listen);
+    int backup_conn = accept_sender(backup_listen);
+
+    Message msg;
+    hardware_error_valve(&msg, 0, "valve stuck");
+    assert(send_message(&msg));
+    assert(0 == read_valve_no(primary_conn));
+
+    puts("stopping the primary");
+    close(primary_conn);
+    close(primary_listen);
+
+    // the first few of these are written into the dead connection before the sender notices
+    for (int i = 1; i <= NUM_FAILOVER; i++) {
+        msg.data.hardware_valve.valve_no = i;
+        assert(send_message(&msg));
+        usleep(5000);
+    }
+
+    int first = read_valve_no(backup_conn);
+    printf("backup starts at %i\n", first);
+    assert((2 <= first) && (first <= 4));
+    for (int i = first + 1; i <= NUM_FAILOVER; i++)
+        assert(i == read_valve_no(backup_conn));
+
+    stop_sending();
+    close(backup_conn);
+    close(backup_listen);
+    free_message(&msg);
+    free(primary);
+    free(backup);
+}
+
+// an uplink which can't be reached at the start is connected once its server is there. Until then the backup is used
+static void test_unreachable(void) {
+    puts("unreachable");
+
+    struct sockaddr *primary = alloc_addr("127.0.0.1", 2036);
+    struct sockaddr *backup = alloc_addr("127.0.0.1", 2037);
+    assert((NULL != primary) && (NULL != backup));
+
+    SendingOptions opts;
+    default_sending_options(&opts);
+    opts.uplink_mode = UPLINK_FAILOVER;
+    opts.reconnect_min_ms = 20;
+    opts.reconnect_max_ms = 100;
+    const struct sockaddr *addrs[] = {primary, backup};
+    const socklen_t addrlens[] = {sizeof(*primary), sizeof(*backup)};
+
+    // but with neither there is nowhere to send anything
+    assert(!start_sending_multi(addrs, addrlens, 2, &opts));
+
+    int backup_listen = listen_on(backup, sizeof(*backup));
+    assert(start_sending_multi(addrs, addrlens, 2, &opts));
+    int backup_conn = accept_sender(backup_listen);
+
+    Message msg;
+    hardware_error_valve(&msg, 0, "valve stuck");
+    assert(send_message(&msg));
+    assert(0 == read_valve_no(backup_conn));
+
+    puts("starting the primary");
+    int primary_listen = listen_on(primary, sizeof(*primary));
+    int primary_conn = accept_sender(primary_listen);
+    usleep(100000); // let the writer mark it healthy
+    msg.data.hardware_valve.valve_no = 1;
+    assert(send_message(&msg));
+    assert(1 == read_valve_no(primary_conn));
+
+    stop_sending();
+    close(primary_conn);
+    close(backup_conn);
+    close(primary_listen);
+    close(backup_listen);
+    free_message(&msg);
+    free(primary);
+    free(backup);
+}
+
+int main(void) {
+    test_mirror();
+    test_failover();
+    test_unreachable();
+
+    puts("passed");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,121 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * test/nodes.c
+ * test for logical node ids announced by the sender and indexed by the server
+ */
+
+// includes
+#include "config.h"
+#include "edsac_server.h"
+#include "edsac_sending.h"
+#include "edsac_representation.h"
+#include "edsac_arguments.h"
+#include "helpers.h"
+#include <stdlib.h>
+#include <assert.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/socket.h>
+
+// the node field survives encoding and every way of decoding and is left out when there is none
+static void test_representation(void) {
+    Message msg;
+    software_error(&msg, "disk full");
+    msg.node_id = 4000000000u;
+
+    char *encoded = NULL;
+    assert(-1 != encode_message(&msg, &encoded));
+
+    Message decoded;
+    assert(decode_message(encoded, &decoded));
+    assert(4000000000u == decoded.node_id);
+    free_message(&decoded);
+
+    MessageRoute route;
+    assert(decode_message_route(encoded, strlen(encoded), &route));
+    assert((SOFT_ERROR == route.type) && (4000000000u == route.node_id));
+
+    const char *text;
+    assert(decode_message_inplace(encoded, strlen(encoded), &decoded, &text));
+    assert(4000000000u == decoded.node_id);
+    free(encoded);
+
+    msg.node_id = 0;
+    assert(-1 != encode_message(&msg, &encoded));
+    assert(NULL == strstr(encoded, "node"));
+    assert(decode_message_route(encoded, strlen(encoded), &route));
+    assert(0 == route.node_id);
+    free(encoded);
+    free_message(&msg);
+}
+
+static bool node_listed(uint32_t node_id) {
+    GSList *nodes = get_connected_nodes();
+    bool found = (NULL != g_slist_find(nodes, GUINT_TO_POINTER(node_id)));
+    g_slist_free(nodes);
+    return found;
+}
+
+// messages are attributed to the node which announced itself on the connection unless they name their own
+static void run(unsigned int decode_workers, uint16_t port) {
+    printf("%u decode workers\n", decode_workers);
+    struct sockaddr *addr = alloc_addr("127.0.0.1", port);
+    assert(NULL != addr);
+
+    ServerOptions server_opts;
+    default_server_options(&server_opts);
+    server_opts.decode_workers = decode_workers; // only the header is decoded before the node is looked at
+    assert(start_server_opts(addr, sizeof(*addr), &server_opts));
+
+    SendingOptions opts;
+    default_sending_options(&opts);
+    opts.node_id = 7;
+    assert(start_sending_opts(addr, sizeof(*addr), &opts));
+
+    Message msg;
+    hardware_error_valve(&msg, 3, "valve stuck");
+    assert(send_message(&msg));
+    BufferItem *item = wait_message();
+    assert(NULL != item);
+    assert(7 == item->node_id);
+    free_bufferitem(item);
+
+    // several logical nodes can share the connection
+    msg.node_id = 42;
+    assert(send_message(&msg));
+    item = wait_message();
+    assert(NULL != item);
+    assert(42 == item->node_id);
+    assert(42 == item->msg.node_id);
+    free_bufferitem(item);
+
+    assert(node_listed(7) && node_listed(42));
+    struct in_addr node_addr;
+    assert(get_node_address(42, &node_addr));
+    assert(0 == strcmp("127.0.0.1", inet_ntoa(node_addr)));
+    assert(!get_node_address(43, &node_addr));
+
+    // the server's own report names the node too, and the nodes go with the connection
+    stop_sending();
+    item = wait_message();
+    assert(NULL != item);
+    assert(0 == strcmp("Connection closed", bufferitem_text(item)));
+    assert(7 == item->node_id);
+    free_bufferitem(item);
+    assert(!node_listed(7) && !node_listed(42));
+
+    free_message(&msg);
+    stop_server();
+    free(addr);
+}
+
+int main(void) {
+    test_representation();
+    run(0, 2021);
+    run(2, 2022);
+
+    puts("passed");
+    return EXIT_SUCCESS;
+}
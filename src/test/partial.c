@@ -0,0 +1,116 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * test/partial.c
+ * test for writes which the socket only partly accepts
+ */
+
+// includes
+#include "config.h"
+#include "edsac_representation.h"
+#include "edsac_sending.h"
+#include "edsac_arguments.h"
+#include "helpers.h"
+#include <stdlib.h>
+#include <assert.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#define PORT 2035
+#define NUM_MESSAGES 500
+#define BUF_LEN 4096 // socket buffer sizes: a few frames' worth
+#define SEND_TIMEOUT_MS 300
+
+// long so that frames often straddle the end of the socket buffer (no braces: see read_valve_no)
+#define VALVE_TEXT "the valve is stuck open and the pressure downstream of it is rising faster than the relief " \
+    "valve can let it out"
+
+static void *send_valves(__attribute__((unused)) void *arg) {
+    queue_valves(VALVE_TEXT, 0, NUM_MESSAGES);
+    return NULL;
+}
+
+// a stand-in server with a small receive buffer which has accepted a sender with a small send buffer
+static int accept_small(int listen_fd) {
+    int conn = accept_sender(listen_fd);
+    int len = BUF_LEN;
+    assert(0 == setsockopt(find_sender_fd(PORT), SOL_SOCKET, SO_SNDBUF, &len, sizeof(len)));
+    return conn;
+}
+
+static int listen_small(const struct sockaddr *addr) {
+    int listen_fd = listen_on(addr, sizeof(*addr));
+    int len = BUF_LEN;
+    assert(0 == setsockopt(listen_fd, SOL_SOCKET, SO_RCVBUF, &len, sizeof(len)));
+    return listen_fd;
+}
+
+// the server stops reading for a while so the buffers fill up mid-frame. Once it reads again the rest of each frame
+// follows on, so every message arrives whole and in order
+static void test_intact(bool async) {
+    struct sockaddr *addr = alloc_addr("127.0.0.1", PORT);
+    int listen_fd = listen_small(addr);
+
+    SendingOptions opts;
+    default_sending_options(&opts);
+    opts.async = async;
+    assert(start_sending_opts(addr, sizeof(*addr), &opts));
+    int conn = accept_small(listen_fd);
+
+    pthread_t sender;
+    assert(0 == pthread_create(&sender, NULL, send_valves, NULL));
+    usleep(200000);
+    for (int i = 0; i < NUM_MESSAGES; i++)
+        assert(i == read_valve_no(conn));
+    assert(0 == pthread_join(sender, NULL));
+
+    stop_sending();
+    close(conn);
+    close(listen_fd);
+    free(addr);
+}
+
+// a server which never reads makes a send fail once it has waited send_timeout_ms for room
+static void test_timeout(void) {
+    struct sockaddr *addr = alloc_addr("127.0.0.1", PORT);
+    int listen_fd = listen_small(addr);
+
+    SendingOptions opts;
+    default_sending_options(&opts);
+    opts.send_timeout_ms = SEND_TIMEOUT_MS;
+    assert(start_sending_opts(addr, sizeof(*addr), &opts));
+    int conn = accept_small(listen_fd);
+
+    Message msg;
+    hardware_error_valve(&msg, 0, VALVE_TEXT);
+    bool sent = true;
+    double start = 0;
+    for (int i = 0; sent && (i < 10000); i++) {
+        msg.data.hardware_valve.valve_no = i;
+        start = monotonic_now();
+        sent = send_message(&msg);
+    }
+    double waited = monotonic_now() - start;
+    free_message(&msg);
+
+    printf("send failed after %.3fs\n", waited);
+    assert(!sent);
+    assert(waited >= SEND_TIMEOUT_MS / 1000.0);
+    assert(waited < 5);
+
+    stop_sending();
+    close(conn);
+    close(listen_fd);
+    free(addr);
+}
+
+int main(void) {
+    test_intact(false);
+    test_intact(true);
+    test_timeout();
+
+    puts("passed");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,107 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * test/pipeline.c
+ * system test for a server decoding message bodies with a pool of workers
+ */
+
+// includes
+#include "config.h"
+#include "edsac_server.h"
+#include "edsac_representation.h"
+#include "edsac_sending.h"
+#include "edsac_arguments.h"
+#include <stdlib.h>
+#include <assert.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+
+// sends numbered messages and checks they come out decoded and in order
+int main(void) {
+    const unsigned int num_messages = 1E4; // number of messages to send and receive
+    const char *test_message = "hello world!";
+
+    struct sockaddr *addr = alloc_addr("127.0.0.1", 2003);
+    assert(NULL != addr);
+
+    Message valve;
+    hardware_error_valve(&valve, 0, test_message);
+    Message other;
+    hardware_error_other(&other, test_message);
+
+    ServerOptions opts;
+    default_server_options(&opts);
+    opts.decode_workers = 4;
+
+    puts("starting server");
+    if (!start_server_opts(addr, sizeof(*addr), &opts)) {
+        perror("failed to start server");
+        free(addr);
+        return EXIT_FAILURE;
+    }
+
+    puts("connecting to server");
+    if (!start_sending(addr, sizeof(*addr))) {
+        perror("failed to start sending");
+        free(addr);
+        return EXIT_FAILURE;
+    }
+
+    free(addr);
+    addr = NULL;
+
+    puts("sending messages");
+    for (unsigned int i = 0; i < num_messages; i++) {
+        valve.data.hardware_valve.valve_no = (int) i;
+        if (!send_message((0 == i % 2) ? &valve : &other)) {
+            perror("failed to send message");
+            return EXIT_FAILURE;
+        }
+    }
+
+    puts("disconnecting");
+    stop_sending();
+
+    // wait for the pipeline to catch up
+    PipelineDepths depths;
+    do {
+        usleep(1000);
+        get_pipeline_depths(&depths);
+    } while ((depths.decode_queue != 0) || (depths.reorder != 0));
+    assert(num_messages + 1 == depths.read_queue);
+
+    for (unsigned int i = 0; i < num_messages; i++) {
+        BufferItem *item = read_message();
+        assert(NULL != item);
+        // read_message hands out fully decoded messages
+        assert(NULL == item->raw);
+        if (0 == i % 2) {
+            assert(HARD_ERROR_VALVE == item->msg.type);
+            assert(i == (unsigned int) item->msg.data.hardware_valve.valve_no);
+            assert(0 == strcmp(test_message, item->msg.data.hardware_valve.message->str));
+        } else {
+            assert(HARD_ERROR_OTHER == item->msg.type);
+            assert(0 == strcmp(test_message, item->msg.data.hardware_other.message->str));
+        }
+        free_bufferitem(item);
+    }
+
+    BufferItem *disconnect = read_message();
+    assert(NULL != disconnect);
+    assert(SOFT_ERROR == disconnect->msg.type);
+    assert(0 == strcmp("Connection closed", bufferitem_text(disconnect)));
+    free_bufferitem(disconnect);
+
+    get_pipeline_depths(&depths);
+    assert(0 == depths.read_queue);
+
+    free_message(&valve);
+    free_message(&other);
+
+    puts("stopping server");
+    stop_server();
+
+    puts("passed");
+    return EXIT_SUCCESS;
+}
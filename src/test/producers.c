@@ -0,0 +1,90 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * test/producers.c
+ * test for several threads sending through the async queue at once, with and without templates
+ */
+
+// includes
+#include "config.h"
+#include "edsac_representation.h"
+#include "edsac_sending.h"
+#include "edsac_arguments.h"
+#include "helpers.h"
+#include <stdlib.h>
+#include <assert.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+
+#define NUM_THREADS 4
+#define NUM_PER_THREAD 2000
+#define QUEUE_LEN 64 // small so that it fills up
+#define THREAD_STRIDE 100000 // valve_no is thread * THREAD_STRIDE + sequence number
+
+// sends NUM_PER_THREAD messages, retrying while the queue is full. Odd threads use a template
+static void *producer(void *arg) {
+    int thread = *(int *) arg;
+
+    Message msg;
+    hardware_error_valve(&msg, 0, "valve stuck");
+    MessageTemplate *tmpl = compile_template(&msg);
+    assert(NULL != tmpl);
+
+    for (int i = 0; i < NUM_PER_THREAD; i++) {
+        int valve_no = thread * THREAD_STRIDE + i;
+        msg.data.hardware_valve.valve_no = valve_no;
+        while (!((thread % 2) ? send_template(tmpl, valve_no) : send_message(&msg)))
+            sched_yield();
+    }
+    free_template(tmpl);
+    free_message(&msg);
+
+    return NULL;
+}
+
+int main(void) {
+    struct sockaddr *addr = alloc_addr("127.0.0.1", 2017);
+    assert(NULL != addr);
+    int listen_fd = listen_on(addr, sizeof(*addr));
+
+    SendingOptions opts;
+    default_sending_options(&opts);
+    opts.async = true;
+    opts.queue_len = QUEUE_LEN;
+    assert(start_sending_opts(addr, sizeof(*addr), &opts));
+    int conn = accept_sender(listen_fd);
+
+    pthread_t threads[NUM_THREADS];
+    int ids[NUM_THREADS];
+    for (int i = 0; i < NUM_THREADS; i++) {
+        ids[i] = i;
+        assert(0 == pthread_create(&threads[i], NULL, producer, &ids[i]));
+    }
+
+    // each thread's messages arrive in the order it sent them
+    int next[NUM_THREADS] = {0};
+    for (int i = 0; i < NUM_THREADS * NUM_PER_THREAD; i++) {
+        int valve_no = read_valve_no(conn);
+        int thread = valve_no / THREAD_STRIDE;
+        assert((0 <= thread) && (thread < NUM_THREADS));
+        assert(next[thread] == valve_no % THREAD_STRIDE);
+        next[thread]++;
+    }
+
+    for (int i = 0; i < NUM_THREADS; i++)
+        assert(0 == pthread_join(threads[i], NULL));
+
+    stop_sending();
+    close(conn);
+    close(listen_fd);
+    free(addr);
+
+    puts("passed");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,85 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * test/ratelimit.c
+ * test for the sender's per message type rate limits
+ */
+
+// includes
+#include "config.h"
+#include "edsac_representation.h"
+#include "edsac_sending.h"
+#include "edsac_arguments.h"
+#include "helpers.h"
+#include <stdlib.h>
+#include <assert.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+
+#define NUM_SENT 20 // of each type
+#define RATE 5
+
+int main(void) {
+    struct sockaddr *addr = alloc_addr("127.0.0.1", 2014);
+    assert(NULL != addr);
+    int listen_fd = listen_on(addr, sizeof(*addr));
+
+    SendingOptions opts;
+    default_sending_options(&opts);
+    opts.rate_limits[SOFT_ERROR].rate = RATE;
+    opts.rate_limits[HARD_ERROR_VALVE].rate = 1; // ignored
+    assert(start_sending_opts(addr, sizeof(*addr), &opts));
+    int conn = accept_sender(listen_fd);
+
+    // a monitor in a tight loop
+    Message soft, valve;
+    software_error(&soft, "out of memory");
+    hardware_error_valve(&valve, 0, "valve stuck");
+    for (int i = 0; i < NUM_SENT; i++) {
+        assert(send_message(&soft));
+        valve.data.hardware_valve.valve_no = i;
+        assert(send_message(&valve));
+    }
+
+    // every valve error arrives, the soft errors are either sent or counted in a summary
+    int valves = 0;
+    unsigned int softs = 0;
+    unsigned int suppressed = 0;
+    while ((valves < NUM_SENT) || (softs + suppressed < NUM_SENT)) {
+        Message msg;
+        read_json_message(conn, &msg);
+        if (HARD_ERROR_VALVE == msg.type) {
+            assert(valves == msg.data.hardware_valve.valve_no);
+            valves++;
+        } else {
+            assert(SOFT_ERROR == msg.type);
+            unsigned int count;
+            if (1 == sscanf(msg.data.software.message->str, "%u SOFT_ERRORs suppressed", &count)) {
+                printf("%s\n", msg.data.software.message->str);
+                suppressed += count;
+            } else {
+                assert(0 == strcmp("out of memory", msg.data.software.message->str));
+                softs++;
+            }
+        }
+        free_message(&msg);
+    }
+    printf("%u soft errors sent\n", softs);
+    assert(softs >= RATE);
+    assert(softs < NUM_SENT);
+    assert(NUM_SENT == softs + suppressed);
+
+    stop_sending();
+    close(conn);
+    close(listen_fd);
+    free_message(&soft);
+    free_message(&valve);
+    free(addr);
+
+    puts("passed");
+    return EXIT_SUCCESS;
+}
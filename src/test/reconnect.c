@@ -0,0 +1,108 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * test/reconnect.c
+ * test for the sender reconnecting after the server goes away
+ */
+
+// includes
+#include "config.h"
+#include "edsac_representation.h"
+#include "edsac_sending.h"
+#include "edsac_arguments.h"
+#include "helpers.h"
+#include <stdlib.h>
+#include <assert.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define NUM_OUTAGE 20 // messages sent while the server is down
+#define NUM_AFTER 5 // messages sent once it is back
+
+// waits until the connection on fd has been reset, so that the sender's next write to it fails
+static void wait_reset(int fd) {
+    for (int i = 0; i < 500; i++) {
+        struct tcp_info info;
+        socklen_t len = sizeof(info);
+        assert(0 == getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len));
+        if (TCP_CLOSE == info.tcpi_state)
+            return;
+        usleep(1000);
+    }
+    assert(false);
+}
+
+// sends messages across a server restart and checks that they arrive in order afterwards
+static void run(bool async, uint16_t port) {
+    printf("%s sender\n", async ? "async" : "sync");
+
+    struct sockaddr *addr = alloc_addr("127.0.0.1", port);
+    assert(NULL != addr);
+
+    int listen_fd = listen_on(addr, sizeof(*addr));
+
+    SendingOptions opts;
+    default_sending_options(&opts);
+    opts.async = async;
+    opts.reconnect = true;
+    opts.reconnect_min_ms = 20;
+    opts.reconnect_max_ms = 200;
+    assert(start_sending_opts(addr, sizeof(*addr), &opts));
+    int conn = accept_sender(listen_fd);
+
+    Message msg;
+    hardware_error_valve(&msg, 0, "valve stuck");
+    assert(send_message(&msg));
+    assert(0 == read_valve_no(conn));
+
+    // reset the connection rather than closing it, so that no write into it can look as if it worked. Only send
+    // once the sender's end has seen the reset
+    puts("stopping the server");
+    int sender_fd = find_sender_fd(port);
+    struct linger linger = {.l_onoff = 1, .l_linger = 0};
+    assert(0 == setsockopt(conn, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger)));
+    close(conn);
+    close(listen_fd);
+    wait_reset(sender_fd);
+
+    // nothing is lost: the first of these fails to be written and is kept for replay
+    for (int i = 1; i <= NUM_OUTAGE; i++) {
+        msg.data.hardware_valve.valve_no = i;
+        assert(send_message(&msg));
+        usleep(5000);
+    }
+
+    puts("restarting the server");
+    listen_fd = listen_on(addr, sizeof(*addr));
+    conn = accept_sender(listen_fd);
+
+    for (int i = 1; i <= NUM_OUTAGE; i++)
+        assert(i == read_valve_no(conn));
+
+    // new messages come after the replayed ones
+    for (int i = NUM_OUTAGE + 1; i <= NUM_OUTAGE + NUM_AFTER; i++) {
+        msg.data.hardware_valve.valve_no = i;
+        assert(send_message(&msg));
+    }
+    for (int i = NUM_OUTAGE + 1; i <= NUM_OUTAGE + NUM_AFTER; i++)
+        assert(i == read_valve_no(conn));
+
+    stop_sending();
+    close(conn);
+    close(listen_fd);
+    free_message(&msg);
+    free(addr);
+}
+
+int main(void) {
+    run(false, 2005);
+    run(true, 2006);
+
+    puts("passed");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,185 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * test/relay.c
+ * test for the relay and for the server accepting relayed origins
+ */
+
+// includes
+#include "config.h"
+#include "edsac_representation.h"
+#include "edsac_relay.h"
+#include "edsac_arguments.h"
+#include "helpers.h"
+#include <stdlib.h>
+#include <assert.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define UPSTREAM_PORT 2018
+#define RELAY_PORT 2019
+#define SERVER_PORT 2020
+
+static volatile sig_atomic_t stop = 0;
+
+static void stop_handler(__attribute__((unused)) int sig) {
+    stop = 1;
+}
+
+// the relay runs in its own process because it uses the server and the sender
+static pid_t run_relay(void) {
+    pid_t pid = fork();
+    assert(-1 != pid);
+    if (0 != pid)
+        return pid;
+
+    signal(SIGTERM, stop_handler);
+    struct sockaddr *listen_addr = alloc_addr("127.0.0.1", RELAY_PORT);
+    struct sockaddr *upstream_addr = alloc_addr("127.0.0.1", UPSTREAM_PORT);
+    RelayOptions opts;
+    default_relay_options(&opts);
+    assert(start_relay(listen_addr, sizeof(*listen_addr), upstream_addr, sizeof(*upstream_addr), &opts));
+    free(listen_addr);
+    free(upstream_addr);
+
+    while (!stop)
+        pause();
+
+    stop_relay();
+    _exit(EXIT_SUCCESS);
+}
+
+// connect to port from a particular loopback address
+static int connect_from(const char *from, uint16_t port) {
+    struct sockaddr *local = alloc_addr(from, 0);
+    struct sockaddr *remote = alloc_addr("127.0.0.1", port);
+    assert((NULL != local) && (NULL != remote));
+
+    int fd = -1;
+    for (int attempt = 0; attempt < 100; attempt++) {
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        assert(-1 != fd);
+        assert(0 == bind(fd, local, sizeof(*local)));
+        if (0 == connect(fd, remote, sizeof(*remote)))
+            break;
+        close(fd);
+        fd = -1;
+        usleep(10000); // the relay may not be listening yet
+    }
+    assert(-1 != fd);
+
+    free(local);
+    free(remote);
+    return fd;
+}
+
+static void expect_origin(const Message *msg, const char *origin) {
+    char str[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &(msg->origin), str, sizeof(str));
+    assert(0 == strcmp(origin, str));
+}
+
+// messages from two monitors reach the server over one connection, marked with where they came from
+static void test_relay(void) {
+    struct sockaddr *upstream_addr = alloc_addr("127.0.0.1", UPSTREAM_PORT);
+    int listen_fd = listen_on(upstream_addr, sizeof(*upstream_addr));
+    free(upstream_addr);
+
+    pid_t relay = run_relay();
+    int upstream = accept(listen_fd, NULL, NULL);
+    assert(-1 != upstream);
+    struct timeval timeout = {.tv_sec = 5, .tv_usec = 0};
+    assert(0 == setsockopt(upstream, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)));
+
+    int monitor_a = connect_from("127.0.0.2", RELAY_PORT);
+    int monitor_b = connect_from("127.0.0.3", RELAY_PORT);
+
+    // KEEP_ALIVEs stop at the relay
+    write_str(monitor_a, "{\"version\":2,\"data\":{},\"type\":\"KEEP_ALIVE\"}");
+    write_str(monitor_a, "{\"version\":2,\"data\":{\"message\":\"valve stuck\",\"valve_no\":1},\"type\":\"HARD_ERROR_VALVE\"}");
+    write_str(monitor_b, "\x05{\"version\":2,\"data\":{\"message\":\"b broke\"},\"type\":\"SOFT_ERROR\"}");
+
+    for (int i = 0; i < 2; i++) {
+        Message msg;
+        read_json_message(upstream, &msg);
+        if (HARD_ERROR_VALVE == msg.type) {
+            assert(1 == msg.data.hardware_valve.valve_no);
+            expect_origin(&msg, "127.0.0.2");
+        } else {
+            assert(SOFT_ERROR == msg.type);
+            assert(0 == strcmp("b broke", msg.data.software.message->str));
+            expect_origin(&msg, "127.0.0.3");
+        }
+        free_message(&msg);
+    }
+
+    // so are the relay's errors about the monitors
+    close(monitor_a);
+    Message msg;
+    read_json_message(upstream, &msg);
+    assert(SOFT_ERROR == msg.type);
+    assert(0 == strcmp("Connection closed", msg.data.software.message->str));
+    expect_origin(&msg, "127.0.0.2");
+    free_message(&msg);
+
+    // the monitors hang up first so that the relay's port isn't left in TIME_WAIT
+    close(monitor_b);
+    read_json_message(upstream, &msg);
+    assert(SOFT_ERROR == msg.type);
+    expect_origin(&msg, "127.0.0.3");
+    free_message(&msg);
+
+    assert(0 == kill(relay, SIGTERM));
+    int status;
+    assert(relay == waitpid(relay, &status, 0));
+    assert(WIFEXITED(status) && (EXIT_SUCCESS == WEXITSTATUS(status)));
+
+    close(upstream);
+    close(listen_fd);
+}
+
+// the server reports relayed messages as coming from their origin
+static void test_server(void) {
+    struct sockaddr *addr = alloc_addr("127.0.0.1", SERVER_PORT);
+    ServerOptions opts;
+    default_server_options(&opts);
+    opts.relayed_origins = true;
+    assert(start_server_opts(addr, sizeof(*addr), &opts));
+    free(addr);
+
+    int relay = connect_from("127.0.0.1", SERVER_PORT);
+    write_str(relay, "{\"version\":2,\"data\":{\"message\":\"x\"},\"type\":\"SOFT_ERROR\",\"origin\":\"10.1.2.3\"}");
+    write_str(relay, "{\"version\":2,\"data\":{\"message\":\"y\"},\"type\":\"SOFT_ERROR\"}");
+
+    const char *expected[] = {"10.1.2.3", "127.0.0.1"};
+    for (int i = 0; i < 2; i++) {
+        BufferItem *item = NULL;
+        for (int tries = 0; (NULL == item) && (tries < 500); tries++) {
+            item = read_message();
+            if (NULL == item)
+                usleep(10000);
+        }
+        assert(NULL != item);
+        printf("message from %s\n", inet_ntoa(item->address));
+        assert(0 == strcmp(expected[i], inet_ntoa(item->address)));
+        free_bufferitem(item);
+    }
+
+    close(relay);
+    stop_server();
+}
+
+int main(void) {
+    test_relay();
+    test_server();
+
+    puts("passed");
+    return EXIT_SUCCESS;
+}
@@ -11,6 +11,7 @@
 #include <stdio.h>
 #include <assert.h>
 #include <string.h>
+#include <limits.h>
 
 // shorthand for similar message types
 #define MESSAGE_ENCODE(_message) \
@@ -109,9 +110,146 @@ static void test_decoding(void) {
     free_message(&msg);
 }
 
+// decode a string literal in place (the literal itself is read only)
+#define INPLACE_DECODE(_encoded, _msg, _text) \
+    strncpy(frame, _encoded, sizeof(frame)); \
+    assert(decode_message_inplace(frame, strlen(_encoded), &_msg, &_text));
+
+static void test_decoding_inplace(void) {
+    char frame[MAX_ENCODED_LEN];
+    Message msg;
+    const char *text = NULL;
+
+    // fields in any order with whitespace and fields we don't know about
+    INPLACE_DECODE("{ \"type\" : \"HARD_ERROR_VALVE\", \"extra\":[1,{\"a\":\"}\"}], \"data\":{\"valve_no\":7,\"message\":\"my string\"},\"version\":2}", msg, text)
+    assert(HARD_ERROR_VALVE == msg.type);
+    assert(7 == msg.data.hardware_valve.valve_no);
+    assert(NULL == msg.data.hardware_valve.message);
+    assert(0 == strcmp("my string", text));
+    assert((text >= frame) && (text < frame + sizeof(frame)));
+    free_message(&msg);
+
+    // escapes are expanded in place
+    INPLACE_DECODE("{\"version\":2,\"data\":{\"message\":\"a\\\"b\\\\c\\n\\u00e9\\ud83d\\ude00\"},\"type\":\"SOFT_ERROR\"}", msg, text)
+    assert(SOFT_ERROR == msg.type);
+    assert(0 == strcmp("a\"b\\c\n\xc3\xa9\xf0\x9f\x98\x80", text));
+    free_message(&msg);
+
+    // the frame does not need to be NUL terminated
+    const char *two_frames = "{\"version\":2,\"data\":{\"message\":\"first\"},\"type\":\"HARD_ERROR_OTHER\"}{\"version\":2";
+    strncpy(frame, two_frames, sizeof(frame));
+    assert(decode_message_inplace(frame, strlen(two_frames) - 12, &msg, &text));
+    assert(HARD_ERROR_OTHER == msg.type);
+    assert(0 == strcmp("first", text));
+    free_message(&msg);
+
+    // keep alive has no text
+    INPLACE_DECODE("{\"version\":2,\"data\":{},\"type\":\"KEEP_ALIVE\"}", msg, text)
+    assert(KEEP_ALIVE == msg.type);
+    assert(NULL == text);
+
+    // invalid cases
+    strncpy(frame, "{\"version\":2,\"data\":{\"message\":\"x\"},\"type\":\"SOFT_ERROR\"}", sizeof(frame));
+    assert(!decode_message_inplace(frame, 20, &msg, &text)); // truncated
+    strncpy(frame, "{\"version\":-1,\"data\":{\"message\":\"x\"},\"type\":\"SOFT_ERROR\"}", sizeof(frame));
+    assert(!decode_message_inplace(frame, strlen(frame), &msg, &text));
+    strncpy(frame, "{\"version\":2,\"data\":{\"message\":\"x\"},\"type\":\"HARD_ERROR_VALVE\"}", sizeof(frame));
+    assert(!decode_message_inplace(frame, strlen(frame), &msg, &text)); // no valve_no
+    strncpy(frame, "{\"unrelated\":3.14159}", sizeof(frame));
+    assert(!decode_message_inplace(frame, strlen(frame), &msg, &text));
+}
+
+static void test_decoding_header(void) {
+    const char *hardware_valve = "{\"version\":2,\"data\":{\"valve_no\":2,\"message\":\"my string\"},\"type\":\"HARD_ERROR_VALVE\"}";
+    const char *keep_alive_encoded = "{\"version\":2,\"data\":{},\"type\":\"KEEP_ALIVE\"}";
+    const char *invalid_version = "{\"version\":1,\"data\":{},\"type\":\"KEEP_ALIVE\"}";
+    const char *invalid_type = "{\"version\":2,\"data\":{},\"type\":\"NOT_A_TYPE\"}";
+    MessageType type;
+
+    assert(decode_message_header(hardware_valve, strlen(hardware_valve), &type));
+    assert(HARD_ERROR_VALVE == type);
+    assert(decode_message_header(keep_alive_encoded, strlen(keep_alive_encoded), &type));
+    assert(KEEP_ALIVE == type);
+    assert(!decode_message_header(invalid_version, strlen(invalid_version), &type));
+    assert(!decode_message_header(invalid_type, strlen(invalid_type), &type));
+}
+
+static void test_type_names(void) {
+    // every type round trips through its name, so the hard-coded perfect hash has no collisions and is up to date
+    for (int t = 0; t < INVALID; t++) {
+        const char *name = message_type_name((MessageType) t);
+        assert(NULL != name);
+        assert(t == (int) message_type_from_name(name, strlen(name)));
+    }
+    assert(NULL == message_type_name(INVALID));
+
+    // names must match exactly
+    assert(INVALID == message_type_from_name("SOFT_ERR", 8));
+    assert(INVALID == message_type_from_name("SOFT_ERRORS", 11));
+    assert(SOFT_ERROR == message_type_from_name("SOFT_ERRORS", 10));
+    assert(INVALID == message_type_from_name("", 0));
+
+    // prefixes used to be accepted
+    Message msg;
+    assert(!decode_message("{\"version\":2,\"data\":{\"message\":\"x\"},\"type\":\"SOFT_ERR\"}", &msg));
+    assert(!decode_message("{\"version\":2,\"data\":{\"message\":\"x\"},\"type\":\"SOFT_ERROR_X\"}", &msg));
+}
+
+// templates render the same bytes as encoding the message
+static void test_templates(void) {
+    // the text contains the key and placeholder to make sure they aren't mistaken for the slot
+    Message msg;
+    hardware_error_valve(&msg, 0, "\"valve_no\":123456789 stuck");
+    MessageTemplate *tmpl = compile_template(&msg);
+    assert(NULL != tmpl);
+    assert(HARD_ERROR_VALVE == template_type(tmpl));
+
+    const int valve_nos[] = {0, 1, 9, 10, 42, -7, 123456789, INT_MAX, INT_MIN};
+    for (size_t i = 0; i < sizeof(valve_nos) / sizeof(valve_nos[0]); i++) {
+        msg.data.hardware_valve.valve_no = valve_nos[i];
+        char expected[MAX_ENCODED_LEN + 1];
+        char rendered[MAX_ENCODED_LEN + 1];
+        ssize_t len = encode_message_buf(&msg, expected, sizeof(expected));
+        assert(-1 != len);
+        assert(len == render_template(tmpl, valve_nos[i], rendered, sizeof(rendered)));
+        assert(0 == strcmp(expected, rendered));
+
+        // too small
+        assert(-1 == render_template(tmpl, valve_nos[i], rendered, (size_t) len));
+
+        Message decoded;
+        assert(template_message(tmpl, valve_nos[i], &decoded));
+        assert(valve_nos[i] == decoded.data.hardware_valve.valve_no);
+        assert(0 == strcmp(msg.data.hardware_valve.message->str, decoded.data.hardware_valve.message->str));
+        free_message(&decoded);
+    }
+    free_template(tmpl);
+    free_message(&msg);
+
+    // other types have no slot
+    software_error(&msg, "blah blah software broke");
+    tmpl = compile_template(&msg);
+    assert(NULL != tmpl);
+    char *expected;
+    char rendered[MAX_ENCODED_LEN + 1];
+    assert(-1 != encode_message(&msg, &expected));
+    assert((ssize_t) strlen(expected) == render_template(tmpl, 5, rendered, sizeof(rendered)));
+    assert(0 == strcmp(expected, rendered));
+    free(expected);
+    free_template(tmpl);
+    free_message(&msg);
+
+    msg.type = INVALID;
+    assert(NULL == compile_template(&msg));
+}
+
 int main(void) {
     test_encoding();
     test_decoding();
+    test_decoding_inplace();
+    test_decoding_header();
+    test_type_names();
+    test_templates();
 
     return EXIT_SUCCESS;
 }
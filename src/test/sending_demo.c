@@ -38,8 +38,7 @@ int main(int argc, char** argv) {
 
     // continually get and send messages
     Message msg;
-    msg.type = SOFT_ERROR;
-    msg.data.software.message = g_string_new(NULL);
+    software_error(&msg, "");
 
     static char buf[128] = {'\0'};
 
@@ -0,0 +1,173 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * test/sequence.c
+ * test for the server checking the sequence numbers of received messages
+ */
+
+// includes
+#include "config.h"
+#include "edsac_server.h"
+#include "edsac_sending.h"
+#include "edsac_representation.h"
+#include "edsac_arguments.h"
+#include "helpers.h"
+#include <stdlib.h>
+#include <assert.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#define PORT 2023
+
+static int connect_server(const struct sockaddr *addr) {
+    int fd = connect_to(addr);
+    usleep(50000); // let the server set the connection up
+    return fd;
+}
+
+// writes a SOFT_ERROR numbered seq
+static void write_seq(int fd, uint64_t seq) {
+    char frame[128];
+    snprintf(frame, sizeof(frame), "{\"version\":2,\"data\":{\"message\":\"m\"},\"type\":\"SOFT_ERROR\",\"seq\":%lu}",
+            (unsigned long) seq);
+    write_str(fd, frame);
+}
+
+// the next message must be numbered seq
+static void expect_seq(uint64_t seq) {
+    BufferItem *item = wait_message();
+    assert(NULL != item);
+    assert(seq == item->msg.seq);
+    free_bufferitem(item);
+}
+
+// the next message must be the server reporting a closed connection
+static void expect_closed(void) {
+    BufferItem *item = wait_message();
+    assert(NULL != item);
+    assert(0 == strcmp("Connection closed", bufferitem_text(item)));
+    free_bufferitem(item);
+}
+
+static void expect_stats(const SequenceStats *stats, uint64_t received, uint64_t lost, uint64_t reordered,
+        uint64_t duplicates, uint64_t restarts) {
+    printf("received %lu lost %lu reordered %lu duplicates %lu restarts %lu\n", (unsigned long) stats->received,
+            (unsigned long) stats->lost, (unsigned long) stats->reordered, (unsigned long) stats->duplicates,
+            (unsigned long) stats->restarts);
+    assert(received == stats->received);
+    assert(lost == stats->lost);
+    assert(reordered == stats->reordered);
+    assert(duplicates == stats->duplicates);
+    assert(restarts == stats->restarts);
+}
+
+// gaps, late arrivals, duplicates and restarts on one connection
+static void test_connection(const struct sockaddr *addr) {
+    int fd = connect_server(addr);
+
+    // 3 and 4 are missing until 3 turns up late. The second 3 is dropped
+    const uint64_t sent[] = {1, 2, 5, 3, 3, 6};
+    for (size_t i = 0; i < sizeof(sent) / sizeof(sent[0]); i++)
+        write_seq(fd, sent[i]);
+    const uint64_t expected[] = {1, 2, 5, 3, 6};
+    for (size_t i = 0; i < sizeof(expected) / sizeof(expected[0]); i++)
+        expect_seq(expected[i]);
+
+    GSList *connections = get_connection_stats();
+    assert(1 == g_slist_length(connections));
+    const ConnectionStats *conn = connections->data;
+    assert(0 == conn->node_id);
+    expect_stats(&conn->seq, 5, 1, 1, 1, 0);
+    g_slist_free_full(connections, free);
+
+    // the sender starts again, then sends something too old to check
+    write_seq(fd, 1);
+    write_seq(fd, 100);
+    write_seq(fd, 10);
+    write_seq(fd, 101);
+    expect_seq(1);
+    expect_seq(100);
+    expect_seq(101);
+
+    SequenceStats totals;
+    get_sequence_stats(&totals);
+    expect_stats(&totals, 8, 99, 1, 2, 1);
+
+    close(fd);
+    expect_closed();
+}
+
+// a node's numbers are followed across its connections
+static void test_node(const struct sockaddr *addr) {
+    const char *hello = "{\"version\":2,\"data\":{},\"type\":\"KEEP_ALIVE\",\"node\":9}";
+
+    int fd = connect_server(addr);
+    write_str(fd, hello);
+    write_seq(fd, 1);
+    write_seq(fd, 2);
+    expect_seq(1);
+    expect_seq(2);
+    close(fd);
+    expect_closed();
+
+    // 3 was lost while reconnecting
+    fd = connect_server(addr);
+    write_str(fd, hello);
+    write_seq(fd, 4);
+    expect_seq(4);
+
+    SequenceStats stats;
+    assert(get_node_sequence_stats(9, &stats));
+    expect_stats(&stats, 3, 1, 0, 0, 0);
+    assert(!get_node_sequence_stats(10, &stats));
+
+    close(fd);
+    expect_closed();
+}
+
+// the sender numbers its messages, templates included
+static void test_sender(const struct sockaddr *addr) {
+    SendingOptions opts;
+    default_sending_options(&opts);
+    opts.node_id = 11;
+    opts.sequence_numbers = true;
+    assert(start_sending_opts(addr, sizeof(*addr), &opts));
+
+    Message msg;
+    hardware_error_valve(&msg, 3, "valve stuck");
+    MessageTemplate *tmpl = compile_template(&msg);
+    assert(NULL != tmpl);
+    assert(send_message(&msg));
+    assert(send_template(tmpl, 4));
+    assert(send_message(&msg));
+    for (uint64_t seq = 1; seq <= 3; seq++)
+        expect_seq(seq);
+
+    stop_sending();
+    expect_closed();
+
+    SequenceStats stats;
+    assert(get_node_sequence_stats(11, &stats));
+    expect_stats(&stats, 3, 0, 0, 0, 0);
+
+    free_template(tmpl);
+    free_message(&msg);
+}
+
+int main(void) {
+    struct sockaddr *addr = alloc_addr("127.0.0.1", PORT);
+    assert(NULL != addr);
+    assert(start_server(addr, sizeof(*addr)));
+
+    test_connection(addr);
+    test_node(addr);
+    test_sender(addr);
+
+    stop_server();
+    free(addr);
+
+    puts("passed");
+    return EXIT_SUCCESS;
+}
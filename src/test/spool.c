@@ -0,0 +1,232 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * test/spool.c
+ * tests for the on-disk spool and for the sender draining it after an outage
+ */
+
+// includes
+#include "config.h"
+#include "edsac_spool.h"
+#include "edsac_representation.h"
+#include "edsac_sending.h"
+#include "edsac_arguments.h"
+#include "helpers.h"
+#include <stdlib.h>
+#include <assert.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+
+#define SEGMENT_SIZE 4096
+#define MAX_SEGMENTS 8
+#define NUM_OUTAGE 30 // messages sent while the server is down
+
+// number of segment files in dir
+static unsigned int count_segments(const char *dir) {
+    DIR *d = opendir(dir);
+    assert(NULL != d);
+    unsigned int count = 0;
+    struct dirent *entry;
+    while (NULL != (entry = readdir(d))) {
+        if (NULL != strstr(entry->d_name, ".spool"))
+            count++;
+    }
+    closedir(d);
+    return count;
+}
+
+// deletes the spool directory
+static void remove_spool(const char *dir) {
+    DIR *d = opendir(dir);
+    assert(NULL != d);
+    struct dirent *entry;
+    while (NULL != (entry = readdir(d))) {
+        char path[PATH_MAX];
+        if ('.' == entry->d_name[0])
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+        assert(0 == unlink(path));
+    }
+    closedir(d);
+    assert(0 == rmdir(dir));
+}
+
+// checks that a record is "record i"
+static void check_record(const struct iovec *iov, int i) {
+    char expected[32];
+    snprintf(expected, sizeof(expected), "record %i", i);
+
+    assert(strlen(expected) == iov->iov_len);
+    assert(0 == memcmp(expected, iov->iov_base, iov->iov_len));
+}
+
+// flips a byte of the record "record i" in the segment files, as if it had only been partly written
+static void corrupt_record(const char *dir, int i) {
+    char needle[32];
+    snprintf(needle, sizeof(needle), "record %i", i);
+
+    DIR *d = opendir(dir);
+    assert(NULL != d);
+    struct dirent *entry;
+    bool found = false;
+    while (!found && (NULL != (entry = readdir(d)))) {
+        char path[PATH_MAX];
+        if (NULL == strstr(entry->d_name, ".spool"))
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+
+        static char data[SEGMENT_SIZE];
+        FILE *f = fopen(path, "r+b");
+        assert(NULL != f);
+        assert(SEGMENT_SIZE == fread(data, 1, SEGMENT_SIZE, f));
+        for (size_t off = 0; off + strlen(needle) < SEGMENT_SIZE; off++) {
+            // the last record is followed by zeros so this won't match "record 10" when looking for "record 1"
+            if ((0 == memcmp(&data[off], needle, strlen(needle))) && ('\0' == data[off + strlen(needle)])) {
+                assert(0 == fseek(f, (long) off, SEEK_SET));
+                assert(EOF != fputc('X', f));
+                found = true;
+                break;
+            }
+        }
+        fclose(f);
+    }
+    closedir(d);
+    assert(found);
+}
+
+// appends, recovers and consumes records directly
+static void test_spool(void) {
+    char dir[] = "/tmp/edsac_spool_XXXXXX";
+    assert(NULL != mkdtemp(dir));
+
+    // fill it up
+    Spool *spool = spool_open(dir, SEGMENT_SIZE, MAX_SEGMENTS);
+    assert(NULL != spool);
+    int count = 0;
+    while (true) {
+        char record[32];
+        snprintf(record, sizeof(record), "record %i", count);
+        if (!spool_append(spool, record, strlen(record)))
+            break;
+        count++;
+    }
+    printf("%i records fit in %i segments\n", count, MAX_SEGMENTS);
+    assert(count > MAX_SEGMENTS);
+    assert((size_t) count == spool_pending(spool));
+    assert(MAX_SEGMENTS == count_segments(dir));
+
+    // consume some and reopen
+    struct iovec iov[10];
+    assert(10 == spool_peek(spool, iov, 10));
+    for (int i = 0; i < 10; i++)
+        check_record(&iov[i], i);
+    spool_consume(spool, 10);
+    spool_close(spool);
+
+    spool = spool_open(dir, SEGMENT_SIZE, MAX_SEGMENTS);
+    assert(NULL != spool);
+    assert((size_t) count - 10 == spool_pending(spool));
+    assert(5 == spool_peek(spool, iov, 5));
+    for (int i = 0; i < 5; i++)
+        check_record(&iov[i], 10 + i);
+    spool_close(spool);
+
+    // a damaged last record is dropped when the spool is recovered
+    corrupt_record(dir, count - 1);
+    spool = spool_open(dir, SEGMENT_SIZE, MAX_SEGMENTS);
+    assert(NULL != spool);
+    assert((size_t) count - 11 == spool_pending(spool));
+
+    // which leaves room for a new one
+    assert(spool_append(spool, "record new", strlen("record new")));
+
+    // consuming everything deletes all but the last segment
+    spool_consume(spool, (size_t) count - 11);
+    assert(1 == spool_pending(spool));
+    assert(1 == spool_peek(spool, iov, 1));
+    assert(0 == memcmp("record new", iov[0].iov_base, iov[0].iov_len));
+    spool_consume(spool, 1);
+    assert(0 == spool_pending(spool));
+    assert(1 == count_segments(dir));
+    spool_close(spool);
+
+    remove_spool(dir);
+}
+
+// messages spooled during an outage are sent by the next run of the sender
+static void test_sender(void) {
+    char dir[] = "/tmp/edsac_spool_XXXXXX";
+    assert(NULL != mkdtemp(dir));
+
+    struct sockaddr *addr = alloc_addr("127.0.0.1", 2007);
+    assert(NULL != addr);
+    int listen_fd = listen_on(addr, sizeof(*addr));
+
+    SendingOptions opts;
+    default_sending_options(&opts);
+    opts.reconnect = true;
+    opts.reconnect_min_ms = 20;
+    opts.reconnect_max_ms = 200;
+    opts.spool_dir = dir;
+    opts.spool_segment_size = SEGMENT_SIZE;
+    opts.spool_drain_rate = 1000;
+    assert(start_sending_opts(addr, sizeof(*addr), &opts));
+    int conn = accept_sender(listen_fd);
+
+    Message msg;
+    hardware_error_valve(&msg, 0, "valve stuck");
+    assert(send_message(&msg));
+    assert(0 == read_valve_no(conn));
+
+    puts("stopping the server");
+    close(conn);
+    close(listen_fd);
+
+    // the first of these may be written into the dead connection before the sender notices
+    for (int i = 1; i <= NUM_OUTAGE; i++) {
+        msg.data.hardware_valve.valve_no = i;
+        assert(send_message(&msg));
+        usleep(2000);
+    }
+
+    // as if the node had been restarted
+    puts("restarting the sender");
+    stop_sending();
+    assert(0 != count_segments(dir));
+
+    listen_fd = listen_on(addr, sizeof(*addr));
+    assert(start_sending_opts(addr, sizeof(*addr), &opts));
+    conn = accept_sender(listen_fd);
+
+    int first = read_valve_no(conn);
+    printf("spool starts at %i\n", first);
+    assert((1 <= first) && (first <= 2));
+    for (int i = first + 1; i <= NUM_OUTAGE; i++)
+        assert(i == read_valve_no(conn));
+
+    // new messages come after the spooled ones
+    msg.data.hardware_valve.valve_no = NUM_OUTAGE + 1;
+    assert(send_message(&msg));
+    assert(NUM_OUTAGE + 1 == read_valve_no(conn));
+
+    stop_sending();
+    close(conn);
+    close(listen_fd);
+    free_message(&msg);
+    free(addr);
+    remove_spool(dir);
+}
+
+int main(void) {
+    test_spool();
+    test_sender();
+
+    puts("passed");
+    return EXIT_SUCCESS;
+}
@@ -14,6 +14,11 @@
 // functions
 
 bool create_timer(timer_handler_t handler, timer_t *timer_id, time_t seconds) {
+    return create_timer_ms(handler, timer_id, (unsigned int) seconds * 1000);
+}
+
+// the same as create_timer but with a period in milliseconds
+bool create_timer_ms(timer_handler_t handler, timer_t *timer_id, unsigned int ms) {
     struct sigevent sig_event;
     memset(&sig_event, 0, sizeof(sig_event));
 
@@ -27,10 +32,9 @@ bool create_timer(timer_handler_t handler, timer_t *timer_id, time_t seconds) {
     }
 
     struct itimerspec t_spec;
-    t_spec.it_interval.tv_nsec = 0;
-    t_spec.it_interval.tv_sec = seconds;
-    t_spec.it_value.tv_nsec = 0;
-    t_spec.it_value.tv_sec = seconds;
+    t_spec.it_interval.tv_nsec = (long) (ms % 1000) * 1000000;
+    t_spec.it_interval.tv_sec = ms / 1000;
+    t_spec.it_value = t_spec.it_interval;
 
     if (0 != timer_settime(*timer_id, 0, &t_spec, NULL)) {
         return false;